@@ -18,6 +18,8 @@ typedef epicsGuardRelease<epicsMutex> UnGuard;
 namespace pvd = epics::pvData;
 namespace pva = epics::pvAccess;
 
+bool testUtilQuiet;
+
 static size_t countTestChannelRequester;
 
 TestChannelRequester::TestChannelRequester()
@@ -34,7 +36,7 @@ TestChannelRequester::~TestChannelRequester()
 
 void TestChannelRequester::channelCreated(const pvd::Status& status, pva::Channel::shared_pointer const & channel)
 {
-    testDiag("channelCreated %s", channel ? channel->getChannelName().c_str() : "<fails>");
+    TESTDIAG("channelCreated %s", channel ? channel->getChannelName().c_str() : "<fails>");
     Guard G(lock);
     laststate = pva::Channel::CONNECTED;
     this->status = status;
@@ -45,7 +47,7 @@ void TestChannelRequester::channelCreated(const pvd::Status& status, pva::Channe
 void TestChannelRequester::channelStateChange(pva::Channel::shared_pointer const & channel,
                                               pva::Channel::ConnectionState connectionState)
 {
-    testDiag("channelStateChange %s %d", channel->getChannelName().c_str(), (int)connectionState);
+    TESTDIAG("channelStateChange %s %d", channel->getChannelName().c_str(), (int)connectionState);
     Guard G(lock);
     laststate = connectionState;
     wait.trigger();
@@ -170,7 +172,7 @@ void TestChannelMonitorRequester::monitorConnect(pvd::Status const & status,
                                                  pvd::MonitorPtr const & monitor,
                                                  pvd::StructureConstPtr const & structure)
 {
-    testDiag("monitorConnect %p %d", monitor.get(), (int)status.isSuccess());
+    TESTDIAG("monitorConnect %p %d", monitor.get(), (int)status.isSuccess());
     Guard G(lock);
     connectStatus = status;
     dtype = structure;
@@ -180,7 +182,7 @@ void TestChannelMonitorRequester::monitorConnect(pvd::Status const & status,
 
 void TestChannelMonitorRequester::monitorEvent(pvd::MonitorPtr const & monitor)
 {
-    testDiag("monitorEvent %p", monitor.get());
+    TESTDIAG("monitorEvent %p", monitor.get());
     mon = monitor;
     eventCnt++;
     wait.trigger();
@@ -188,7 +190,7 @@ void TestChannelMonitorRequester::monitorEvent(pvd::MonitorPtr const & monitor)
 
 void TestChannelMonitorRequester::unlisten(pvd::MonitorPtr const & monitor)
 {
-    testDiag("unlisten %p", monitor.get());
+    TESTDIAG("unlisten %p", monitor.get());
     Guard G(lock);
     unlistend = true;
     wait.trigger();
@@ -251,24 +253,154 @@ TestPVChannel::createMonitor(
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
     shared_pointer self(weakself);
-    TestPVMonitor::shared_pointer ret(new TestPVMonitor(self, requester, 2));
+    TestPVMonitor::shared_pointer ret(new TestPVMonitor(self, requester, pvRequest, 2));
     {
         Guard G(pv->lock);
         monitors.insert(ret);
         static_cast<TestPVMonitor*>(ret.get())->weakself = ret; // save wrapped weak ref
     }
-    testDiag("TestPVChannel::createMonitor %s %p", pv->name.c_str(), ret.get());
+    TESTDIAG("TestPVChannel::createMonitor %s %p", pv->name.c_str(), ret.get());
     requester->monitorConnect(pvd::Status(), ret, pv->dtype);
     return ret;
 }
 
+pva::ChannelGet::shared_pointer
+TestPVChannel::createChannelGet(
+        pva::ChannelGetRequester::shared_pointer const & requester,
+        pvd::PVStructure::shared_pointer const & pvRequest)
+{
+    shared_pointer self(weakself);
+    TestPVGet::shared_pointer ret(new TestPVGet(self, requester));
+    ret->weakself = ret;
+    {
+        Guard G(pv->lock);
+        gets.insert(ret);
+    }
+    TESTDIAG("TestPVChannel::createChannelGet %s %p", pv->name.c_str(), ret.get());
+    requester->channelGetConnect(pvd::Status(), ret, pv->dtype);
+    return ret;
+}
+
+static size_t countTestPVGet;
+
+TestPVGet::TestPVGet(const TestPVChannel::shared_pointer& ch,
+                     const pva::ChannelGetRequester::shared_pointer& req)
+    :channel(ch)
+    ,requester(req)
+    ,ndone(0u)
+{
+    epicsAtomicIncrSizeT(&countTestPVGet);
+}
+
+TestPVGet::~TestPVGet()
+{
+    epicsAtomicDecrSizeT(&countTestPVGet);
+}
+
+void TestPVGet::get()
+{
+    TESTDIAG("TestPVGet::get %p", this);
+    {
+        Guard G(channel->pv->lock);
+        channel->pv->ngets++;
+        if(channel->pv->deferGets) {
+            ndone++;
+            return;
+        }
+    }
+    complete();
+}
+
+void TestPVGet::complete()
+{
+    pva::ChannelGetRequester::shared_pointer req(requester.lock());
+    if(!req)
+        return;
+    shared_pointer self(weakself);
+
+    pvd::PVStructurePtr value(pvd::getPVDataCreate()->createPVStructure(channel->pv->dtype));
+    pvd::BitSet::shared_pointer changed(new pvd::BitSet);
+    changed->set(0);
+    {
+        Guard G(channel->pv->lock);
+        value->copyUnchecked(*channel->pv->value);
+    }
+    req->getDone(pvd::Status(), self, value, changed);
+}
+
+pva::ChannelPut::shared_pointer
+TestPVChannel::createChannelPut(
+        pva::ChannelPutRequester::shared_pointer const & requester,
+        pvd::PVStructure::shared_pointer const & pvRequest)
+{
+    shared_pointer self(weakself);
+    TestPVPut::shared_pointer ret(new TestPVPut(self, requester));
+    ret->weakself = ret;
+    {
+        Guard G(pv->lock);
+        puts.insert(ret);
+    }
+    TESTDIAG("TestPVChannel::createChannelPut %s %p", pv->name.c_str(), ret.get());
+    requester->channelPutConnect(pvd::Status(), ret, pv->dtype);
+    return ret;
+}
+
+static size_t countTestPVPut;
+
+TestPVPut::TestPVPut(const TestPVChannel::shared_pointer& ch,
+                     const pva::ChannelPutRequester::shared_pointer& req)
+    :channel(ch)
+    ,requester(req)
+    ,nputs(0u)
+    ,ndone(0u)
+{
+    epicsAtomicIncrSizeT(&countTestPVPut);
+}
+
+TestPVPut::~TestPVPut()
+{
+    epicsAtomicDecrSizeT(&countTestPVPut);
+}
+
+void TestPVPut::put(pvd::PVStructure::shared_pointer const & pvPutStructure,
+                    pvd::BitSet::shared_pointer const & putBitSet)
+{
+    TESTDIAG("TestPVPut::put %p changed '%s'", this, toString(*putBitSet).c_str());
+    {
+        Guard G(channel->pv->lock);
+        channel->pv->value->copyUnchecked(*pvPutStructure, *putBitSet);
+        nputs++;
+        ndone++;
+    }
+    channel->pv->post(*putBitSet);
+}
+
+void TestPVPut::get()
+{
+    pva::ChannelPutRequester::shared_pointer req(requester.lock());
+    if(!req)
+        return;
+    shared_pointer self(weakself);
+
+    pvd::PVStructurePtr value(pvd::getPVDataCreate()->createPVStructure(channel->pv->dtype));
+    pvd::BitSet::shared_pointer changed(new pvd::BitSet);
+    changed->set(0);
+    {
+        Guard G(channel->pv->lock);
+        value->copyUnchecked(*channel->pv->value);
+    }
+    req->getDone(pvd::Status(), self, value, changed);
+}
+
 static size_t countTestPVMonitor;
 
 TestPVMonitor::TestPVMonitor(const TestPVChannel::shared_pointer& ch,
               const pvd::MonitorRequester::shared_pointer& req,
+              const pvd::PVStructurePtr& pvRequest,
               size_t bsize)
     :channel(ch)
     ,requester(req)
+    ,pvRequest(pvRequest)
     ,running(false)
     ,finalize(false)
     ,inoverflow(false)
@@ -299,7 +431,7 @@ void TestPVMonitor::destroy()
 
 pvd::Status TestPVMonitor::start()
 {
-    testDiag("TestPVMonitor::start %p", this);
+    TESTDIAG("TestPVMonitor::start %p", this);
 
     Guard G(channel->pv->lock);
     if(finalize && buffer.empty())
@@ -314,7 +446,7 @@ pvd::Status TestPVMonitor::start()
 
     if(this->buffer.empty()) {
         needWakeup = true;
-        testDiag(" need wakeup");
+        TESTDIAG(" need wakeup");
     }
 
     if(!this->free.empty()) {
@@ -333,13 +465,13 @@ pvd::Status TestPVMonitor::start()
 
         buffer.push_back(monitorElement);
         this->free.pop_front();
-        testDiag(" push current");
+        TESTDIAG(" push current");
 
     } else {
         inoverflow = true;
         overflow->changedBitSet->clear();
         overflow->changedBitSet->set(0);
-        testDiag(" push overflow");
+        TESTDIAG(" push overflow");
     }
 
     return pvd::Status();
@@ -347,7 +479,7 @@ pvd::Status TestPVMonitor::start()
 
 pvd::Status TestPVMonitor::stop()
 {
-    testDiag("TestPVMonitor::stop %p", this);
+    TESTDIAG("TestPVMonitor::stop %p", this);
     Guard G(channel->pv->lock);
     running = false;
     return pvd::Status();
@@ -361,14 +493,14 @@ pva::MonitorElementPtr TestPVMonitor::poll()
         ret = buffer.front();
         buffer.pop_front();
     }
-    testDiag("TestPVMonitor::poll %p %p", this, ret.get());
+    TESTDIAG("TestPVMonitor::poll %p %p", this, ret.get());
     return ret;
 }
 
 void TestPVMonitor::release(pva::MonitorElementPtr const & monitorElement)
 {
     Guard G(channel->pv->lock);
-    testDiag("TestPVMonitor::release %p %p", this, monitorElement.get());
+    TESTDIAG("TestPVMonitor::release %p %p", this, monitorElement.get());
 
     if(inoverflow) {
         // buffer.empty() may be true if all elements poll()d by user
@@ -382,7 +514,7 @@ void TestPVMonitor::release(pva::MonitorElementPtr const & monitorElement)
         overflow->overrunBitSet->clear();
 
         buffer.push_back(monitorElement);
-        testDiag("TestPVMonitor::release overflow resume %p %p", this, monitorElement.get());
+        TESTDIAG("TestPVMonitor::release overflow resume %p %p", this, monitorElement.get());
         inoverflow = false;
     } else {
         this->free.push_back(monitorElement);
@@ -399,6 +531,9 @@ TestPV::TestPV(const std::string& name,
     ,factory(pvd::PVDataCreate::getPVDataCreate())
     ,dtype(dtype)
     ,value(factory->createPVStructure(dtype))
+    ,deferGets(false)
+    ,ngets(0u)
+    ,offline(false)
 {
     epicsAtomicIncrSizeT(&countTestPV);
 }
@@ -417,7 +552,7 @@ void TestPV::post(bool notify)
 
 void TestPV::post(const pvd::BitSet& changed, bool notify)
 {
-    testDiag("post %s %d changed '%s'", name.c_str(), (int)notify, toString(changed).c_str());
+    TESTDIAG("post %s %d changed '%s'", name.c_str(), (int)notify, toString(changed).c_str());
     Guard G(lock);
 
     channels_t::vector_type toupdate(channels.lock_vector());
@@ -440,7 +575,7 @@ void TestPV::post(const pvd::BitSet& changed, bool notify)
                 mon->inoverflow = true;
                 mon->overflow->overrunBitSet->or_and(*mon->overflow->changedBitSet, changed); // oflow |= prev_changed & new_changed
                 *mon->overflow->changedBitSet |= changed;
-                testDiag("overflow changed '%s' overrun '%s'",
+                TESTDIAG("overflow changed '%s' overrun '%s'",
                          toString(*mon->overflow->changedBitSet).c_str(),
                          toString(*mon->overflow->overrunBitSet).c_str());
 
@@ -459,13 +594,13 @@ void TestPV::post(const pvd::BitSet& changed, bool notify)
 
                 mon->buffer.push_back(elem);
                 mon->free.pop_front();
-                testDiag("push %p changed '%s' overflow '%s'", elem.get(),
+                TESTDIAG("push %p changed '%s' overflow '%s'", elem.get(),
                          toString(*elem->changedBitSet).c_str(),
                          toString(*elem->overrunBitSet).c_str());
             }
 
             if(mon->needWakeup && notify) {
-                testDiag(" wakeup");
+                TESTDIAG(" wakeup");
                 mon->needWakeup = false;
                 pva::MonitorRequester::shared_pointer req(mon->requester.lock());
                 UnGuard U(G);
@@ -492,6 +627,55 @@ void TestPV::disconnect()
             if(req)
                 req->channelStateChange(*it, TestPVChannel::DISCONNECTED);
         }
+
+        TestPVChannel::monitors_t::vector_type tomon(chan->monitors.lock_vector());
+        FOREACH(TestPVChannel::monitors_t::vector_type::const_iterator, it2, end2, tomon)
+        {
+            pvd::MonitorRequester::shared_pointer req((*it2)->requester.lock());
+            UnGuard U(G);
+            if(req)
+                req->channelDisconnect(false);
+        }
+    }
+}
+
+void TestPV::reconnect(const pvd::StructureConstPtr& type)
+{
+    const pvd::StructureConstPtr& ntype = type ? type : dtype;
+    Guard G(lock);
+    offline = false;
+    channels_t::vector_type toupdate(channels.lock_vector());
+
+    FOREACH(channels_t::vector_type::const_iterator, it, end, toupdate) // channel
+    {
+        TestPVChannel *chan = it->get();
+
+        chan->state = TestPVChannel::CONNECTED;
+        {
+            pva::ChannelRequester::shared_pointer req(chan->requester.lock());
+            UnGuard U(G);
+            if(req)
+                req->channelStateChange(*it, TestPVChannel::CONNECTED);
+        }
+
+        // the same subscriptions, started again with a complete update for TestProvider::dispatch()
+        TestPVChannel::monitors_t::vector_type tomon(chan->monitors.lock_vector());
+        FOREACH(TestPVChannel::monitors_t::vector_type::const_iterator, it2, end2, tomon)
+        {
+            TestPVMonitor *mon = it2->get();
+            const bool restart = mon->running && ntype==dtype;
+            mon->running = false;
+            {
+                pvd::MonitorRequester::shared_pointer req(mon->requester.lock());
+                UnGuard U(G);
+                if(req)
+                    req->monitorConnect(pvd::Status(), *it2, ntype);
+            }
+            if(restart) {
+                mon->overflow->changedBitSet->clear(); // start() queues all changed
+                mon->start();
+            }
+        }
     }
 }
 
@@ -554,6 +738,11 @@ TestProvider::createChannel(std::string const & channelName,
         TestPV::shared_pointer pv(pvs.find(channelName));
         if(pv) {
             TestPVChannel::shared_pointer chan(new TestPVChannel(pv, requester));
+            {
+                Guard G2(pv->lock);
+                if(pv->offline)
+                    chan->state = TestPVChannel::NEVER_CONNECTED;
+            }
             pv->channels.insert(chan);
             chan->weakself = chan;
             ret = chan;
@@ -565,7 +754,7 @@ TestProvider::createChannel(std::string const & channelName,
     } else {
         requester->channelCreated(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "PV not found"), ret);
     }
-    testDiag("createChannel %s %p", channelName.c_str(), ret.get());
+    TESTDIAG("createChannel %s %p", channelName.c_str(), ret.get());
     return ret;
 }
 
@@ -581,7 +770,7 @@ TestProvider::addPV(const std::string& name, const pvd::StructureConstPtr& tdef)
 void TestProvider::dispatch()
 {
     Guard G(lock);
-    testDiag("TestProvider::dispatch");
+    TESTDIAG("TestProvider::dispatch");
 
     pvs_t::lock_vector_type allpvs(pvs.lock_vector());
     FOREACH(pvs_t::lock_vector_type::const_iterator, pvit, pvend, allpvs)
@@ -597,6 +786,42 @@ void TestProvider::dispatch()
             if(!chan->isConnected())
                 continue;
 
+            TestPVChannel::gets_t::vector_type gets(chan->gets.lock_vector());
+            FOREACH(TestPVChannel::gets_t::vector_type::const_iterator, getit, getend, gets)
+            {
+                TestPVGet *get = getit->get();
+                size_t ndone;
+                {
+                    Guard G2(pv->lock);
+                    ndone = get->ndone;
+                    get->ndone = 0u;
+                }
+                for(; ndone; ndone--) {
+                    TESTDIAG("  complete get %p", get);
+                    UnGuard U(G);
+                    get->complete();
+                }
+            }
+
+            TestPVChannel::puts_t::vector_type puts(chan->puts.lock_vector());
+            FOREACH(TestPVChannel::puts_t::vector_type::const_iterator, putit, putend, puts)
+            {
+                TestPVPut *put = putit->get();
+                size_t ndone;
+                {
+                    Guard G2(pv->lock);
+                    ndone = put->ndone;
+                    put->ndone = 0u;
+                }
+                for(; ndone; ndone--) {
+                    TESTDIAG("  complete put %p", put);
+                    pva::ChannelPutRequester::shared_pointer req(put->requester.lock());
+                    UnGuard U(G);
+                    if(req)
+                        req->putDone(pvd::Status(), *putit);
+                }
+            }
+
             FOREACH(TestPVChannel::monitors_t::vector_type::const_iterator, monit, monend, monitors)
             {
                 TestPVMonitor *mon = monit->get();
@@ -605,7 +830,7 @@ void TestProvider::dispatch()
                     continue;
 
                 if(mon->needWakeup) {
-                    testDiag("  wakeup monitor %p", mon);
+                    TESTDIAG("  wakeup monitor %p", mon);
                     mon->needWakeup = false;
                     pva::MonitorRequester::shared_pointer req(mon->requester.lock());
                     UnGuard U(G);
@@ -628,6 +853,8 @@ void TestProvider::testCounts()
     TESTC(TestPV);
     TESTC(TestPVChannel);
     TESTC(TestPVMonitor);
+    TESTC(TestPVGet);
+    TESTC(TestPVPut);
 #undef TESTC
     testOk(ok, "All instances free'd");
 }
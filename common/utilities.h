@@ -19,8 +19,14 @@
 struct TestPV;
 struct TestPVChannel;
 struct TestPVMonitor;
+struct TestPVGet;
+struct TestPVPut;
 struct TestProvider;
 
+//! Set to skip the testDiag() of each operation by the Test* classes below.  eg. when benchmarking
+extern bool testUtilQuiet;
+#define TESTDIAG if(testUtilQuiet) {} else testDiag
+
 // minimally useful boilerplate which must appear *everywhere*
 #define DUMBREQUESTER(NAME) \
     virtual std::string getRequesterName() OVERRIDE { return #NAME; }
@@ -191,6 +197,12 @@ struct TestPVChannel : public BaseChannel
     typedef weak_set<TestPVMonitor> monitors_t;
     monitors_t monitors;
 
+    typedef weak_set<TestPVGet> gets_t;
+    gets_t gets;
+
+    typedef weak_set<TestPVPut> puts_t;
+    puts_t puts;
+
     TestPVChannel(const std::tr1::shared_ptr<TestPV>& pv,
                   const std::tr1::shared_ptr<epics::pvAccess::ChannelRequester>& req);
     virtual ~TestPVChannel();
@@ -203,6 +215,64 @@ struct TestPVChannel : public BaseChannel
     virtual epics::pvData::Monitor::shared_pointer createMonitor(
             epics::pvData::MonitorRequester::shared_pointer const & monitorRequester,
             epics::pvData::PVStructure::shared_pointer const & pvRequest);
+
+    virtual epics::pvAccess::ChannelGet::shared_pointer createChannelGet(
+            epics::pvAccess::ChannelGetRequester::shared_pointer const & requester,
+            epics::pvData::PVStructure::shared_pointer const & pvRequest);
+
+    virtual epics::pvAccess::ChannelPut::shared_pointer createChannelPut(
+            epics::pvAccess::ChannelPutRequester::shared_pointer const & requester,
+            epics::pvData::PVStructure::shared_pointer const & pvRequest);
+};
+
+// get() completes with a copy of the whole TestPV::value.  immediately,
+// or with TestPV::deferGets in TestProvider::dispatch()
+struct TestPVGet : public epics::pvAccess::ChannelGet
+{
+    POINTER_DEFINITIONS(TestPVGet);
+    std::tr1::weak_ptr<TestPVGet> weakself;
+
+    const TestPVChannel::shared_pointer channel;
+    const epics::pvAccess::ChannelGetRequester::weak_pointer requester;
+
+    size_t ndone; // with deferGets, getDone()s not yet sent.  guarded by TestPV::lock
+
+    TestPVGet(const TestPVChannel::shared_pointer& ch,
+              const epics::pvAccess::ChannelGetRequester::shared_pointer& req);
+    virtual ~TestPVGet();
+
+    virtual void destroy() {}
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> getChannel() { return channel; }
+    virtual void cancel() {}
+    virtual void lastRequest() {}
+    virtual void get();
+
+    void complete();
+};
+
+// put() updates and posts TestPV::value immediately.  putDone() waits for TestProvider::dispatch()
+struct TestPVPut : public epics::pvAccess::ChannelPut
+{
+    POINTER_DEFINITIONS(TestPVPut);
+    std::tr1::weak_ptr<TestPVPut> weakself;
+
+    const TestPVChannel::shared_pointer channel;
+    const epics::pvAccess::ChannelPutRequester::weak_pointer requester;
+
+    size_t nputs; // put()s received
+    size_t ndone; // putDone()s not yet sent.  guarded by TestPV::lock
+
+    TestPVPut(const TestPVChannel::shared_pointer& ch,
+              const epics::pvAccess::ChannelPutRequester::shared_pointer& req);
+    virtual ~TestPVPut();
+
+    virtual void destroy() {}
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> getChannel() { return channel; }
+    virtual void cancel() {}
+    virtual void lastRequest() {}
+    virtual void put(epics::pvData::PVStructure::shared_pointer const & pvPutStructure,
+                     epics::pvData::BitSet::shared_pointer const & putBitSet);
+    virtual void get();
 };
 
 struct TestPVMonitor : public epics::pvData::Monitor
@@ -212,6 +282,7 @@ struct TestPVMonitor : public epics::pvData::Monitor
 
     const TestPVChannel::shared_pointer channel;
     const epics::pvData::MonitorRequester::weak_pointer requester;
+    const epics::pvData::PVStructurePtr pvRequest; // as given to createMonitor()
 
     bool running;
     bool finalize;
@@ -220,6 +291,7 @@ struct TestPVMonitor : public epics::pvData::Monitor
 
     TestPVMonitor(const TestPVChannel::shared_pointer& ch,
                   const epics::pvData::MonitorRequester::shared_pointer& req,
+                  const epics::pvData::PVStructurePtr& pvRequest,
                   size_t bsize);
     virtual ~TestPVMonitor();
 
@@ -247,6 +319,11 @@ struct TestPV
     const epics::pvData::StructureConstPtr dtype;
     epics::pvData::PVStructurePtr value;
 
+    // guarded by lock
+    bool deferGets; // TestPVGet::get() completes in TestProvider::dispatch()
+    size_t ngets;   // # of TestPVGet::get() calls
+    bool offline;   // new channels are NEVER_CONNECTED until reconnect()
+
     TestPV(const std::string& name,
            const std::tr1::shared_ptr<TestProvider>& provider,
            const epics::pvData::StructureConstPtr& dtype);
@@ -256,6 +333,10 @@ struct TestPV
     void post(const epics::pvData::BitSet& changed, bool notify = true);
 
     void disconnect();
+    // end a disconnect(), or 'offline', re-subscribing monitors as the PVA client does.
+    // A different 'type' is only reported to monitors, as if the server restarted
+    // with a new type.  'value' isn't changed, so don't post() afterwards.
+    void reconnect(const epics::pvData::StructureConstPtr& type = epics::pvData::StructureConstPtr());
 
     mutable epicsMutex lock;
 
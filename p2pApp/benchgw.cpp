@@ -0,0 +1,619 @@
+/* Gateway micro-benchmarks.
+ *
+ * Drives a GWServerChannelProvider connected to an in-process TestProvider,
+ * so no network is involved.  Not run as part of "make runtests".
+ *
+ *   ./benchgw [-j] [-m search,create,monitor,get] [-n #names] [-c #searches/thread] [-t max #threads]
+ *             [-u #updates] [-r updates/sec] [-e #elements] [-S #subscribers] [-q queueSize]
+ *             [-d drain interval] [-w #fanout workers] [-x] [-g #gets]
+ *
+ * Each result is printed as one line of "<benchmark> key=value ...",
+ * or with -j as one JSON object per line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <new>
+#include <vector>
+#include <string>
+#include <utility>
+
+#include <epicsAtomic.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <epicsGetopt.h>
+
+#include <pv/pvAccess.h>
+
+#include "helper.h"
+#include "pva2pva.h"
+#include "server.h"
+
+#include "utilities.h"
+
+namespace pvd = epics::pvData;
+namespace pva = epics::pvAccess;
+
+// count all heap allocations made by this process
+static size_t nallocs;
+
+#if __cplusplus>=201103L
+#  define THROW_BAD_ALLOC
+#  define NOTHROW noexcept
+#else
+#  define THROW_BAD_ALLOC throw(std::bad_alloc)
+#  define NOTHROW throw()
+#endif
+
+void* operator new(size_t size) THROW_BAD_ALLOC
+{
+    epicsAtomicIncrSizeT(&nallocs);
+    void *ret = malloc(size ? size : 1u);
+    if(!ret)
+        throw std::bad_alloc();
+    return ret;
+}
+
+void* operator new[](size_t size) THROW_BAD_ALLOC
+{
+    return operator new(size);
+}
+
+void operator delete(void *ptr) NOTHROW
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) NOTHROW
+{
+    free(ptr);
+}
+
+namespace {
+
+bool jsonout;
+
+// one line of output.  Counters are reset by the constructor.
+struct Result
+{
+    const std::string name;
+    typedef std::vector<std::pair<std::string, double> > values_t;
+    values_t values;
+
+    const size_t allocs0;
+    const clock_t cpu0;
+    const epicsTime start;
+
+    explicit Result(const std::string& name)
+        :name(name)
+        ,allocs0(epicsAtomicGetSizeT(&nallocs))
+        ,cpu0(clock())
+        ,start(epicsTime::getCurrent())
+    {}
+
+    Result& add(const char *key, double val)
+    {
+        values.push_back(std::make_pair(std::string(key), val));
+        return *this;
+    }
+
+    // stop timing, add per-op rate, CPU and allocation counts, and print
+    void done(size_t nops)
+    {
+        double elapsed = epicsTime::getCurrent() - start;
+        double cpu = double(clock() - cpu0)/CLOCKS_PER_SEC;
+        size_t allocs = epicsAtomicGetSizeT(&nallocs) - allocs0;
+
+        add("ops", nops);
+        add("seconds", elapsed);
+        add("rate", elapsed>0.0 ? nops/elapsed : 0.0);
+        add("cpu", cpu);
+        add("allocs", allocs);
+        add("allocs_per_op", nops ? double(allocs)/nops : 0.0);
+
+        if(jsonout) {
+            printf("{\"bench\":\"%s\"", name.c_str());
+            FOREACH(values_t::const_iterator, it, end, values)
+                printf(",\"%s\":%.9g", it->first.c_str(), it->second);
+            printf("}\n");
+        } else {
+            printf("%s", name.c_str());
+            FOREACH(values_t::const_iterator, it, end, values)
+                printf(" %s=%.9g", it->first.c_str(), it->second);
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+};
+
+struct BenchFindRequester : public pva::ChannelFindRequester
+{
+    POINTER_DEFINITIONS(BenchFindRequester);
+    size_t nfound, nmissed;
+    BenchFindRequester() :nfound(0), nmissed(0) {}
+    virtual ~BenchFindRequester() {}
+    virtual void channelFindResult(const pvd::Status& status,
+                                   const pva::ChannelFind::shared_pointer& channelFind,
+                                   bool wasFound)
+    {
+        if(wasFound)
+            epicsAtomicIncrSizeT(&nfound);
+        else
+            epicsAtomicIncrSizeT(&nmissed);
+    }
+};
+
+// repeatedly search for the same set of names, as a client
+// retrying searches would.
+struct SearchWorker : public epicsThreadRunable
+{
+    const GWServerChannelProvider::shared_pointer gateway;
+    const std::vector<std::string>& names;
+    const size_t count;
+    const size_t offset;
+    BenchFindRequester::shared_pointer req;
+    epicsEvent go;
+    epicsThread worker;
+
+    SearchWorker(const GWServerChannelProvider::shared_pointer& gw,
+                 const std::vector<std::string>& names,
+                 size_t count, size_t offset,
+                 const BenchFindRequester::shared_pointer& req)
+        :gateway(gw)
+        ,names(names)
+        ,count(count)
+        ,offset(offset)
+        ,req(req)
+        ,worker(*this, "benchgw", epicsThreadGetStackSize(epicsThreadStackSmall))
+    {
+        worker.start();
+    }
+    virtual ~SearchWorker() {}
+
+    virtual void run()
+    {
+        go.wait();
+        for(size_t i=0; i<count; i++) {
+            gateway->channelFind(names[(offset+i)%names.size()], req);
+        }
+    }
+};
+
+void benchSearch(const GWServerChannelProvider::shared_pointer& gateway,
+                 const std::vector<std::string>& names,
+                 size_t count, unsigned nthreads)
+{
+    BenchFindRequester::shared_pointer req(new BenchFindRequester);
+    std::vector<SearchWorker*> workers;
+
+    for(unsigned i=0; i<nthreads; i++)
+        workers.push_back(new SearchWorker(gateway, names, count, i*(names.size()/nthreads), req));
+
+    Result R("search");
+
+    FOREACH(std::vector<SearchWorker*>::const_iterator, it, end, workers)
+        (*it)->go.signal();
+    FOREACH(std::vector<SearchWorker*>::const_iterator, it, end, workers)
+        (*it)->worker.exitWait();
+
+    size_t total = epicsAtomicGetSizeT(&req->nfound) + epicsAtomicGetSizeT(&req->nmissed);
+
+    R.add("threads", nthreads)
+     .add("found", epicsAtomicGetSizeT(&req->nfound))
+     .done(total);
+
+    FOREACH(std::vector<SearchWorker*>::const_iterator, it, end, workers)
+        delete *it;
+}
+
+// downstream server channels come and go for names already in the cache
+void benchCreate(const GWServerChannelProvider::shared_pointer& gateway,
+                 const std::vector<std::string>& names,
+                 size_t count)
+{
+    TestChannelRequester::shared_pointer req(new TestChannelRequester);
+    size_t nok = 0;
+
+    Result R("create");
+
+    for(size_t i=0; i<count; i++) {
+        pva::Channel::shared_pointer chan(gateway->createChannel(names[i%names.size()], req));
+        if(chan) {
+            nok++;
+            chan->destroy();
+        }
+    }
+
+    R.add("created", nok)
+     .done(count);
+}
+
+// A subscriber.  By default drains its queue on each wakeup, like a fast client.
+struct BenchMonitorRequester : public pvd::MonitorRequester
+{
+    POINTER_DEFINITIONS(BenchMonitorRequester);
+    DUMBREQUESTER(BenchMonitorRequester)
+
+    bool drainOnEvent;
+    size_t nevents;
+    pvd::MonitorPtr mon;
+
+    explicit BenchMonitorRequester(bool drain) :drainOnEvent(drain), nevents(0) {}
+    virtual ~BenchMonitorRequester() {}
+
+    void drain()
+    {
+        pvd::MonitorPtr M(mon);
+        if(!M)
+            return;
+        pvd::MonitorElementPtr elem;
+        while(!!(elem=M->poll())) {
+            epicsAtomicIncrSizeT(&nevents);
+            M->release(elem);
+        }
+    }
+
+    virtual void monitorConnect(pvd::Status const & status,
+                                pvd::MonitorPtr const & monitor,
+                                pvd::StructureConstPtr const & structure) {}
+    virtual void monitorEvent(pvd::MonitorPtr const & monitor)
+    {
+        if(drainOnEvent)
+            drain();
+    }
+    virtual void unlisten(pvd::MonitorPtr const & monitor) {}
+};
+
+struct BenchGetRequester : public pva::ChannelGetRequester
+{
+    POINTER_DEFINITIONS(BenchGetRequester);
+    DUMBREQUESTER(BenchGetRequester)
+
+    size_t ndone, nerror;
+
+    BenchGetRequester() :ndone(0), nerror(0) {}
+    virtual ~BenchGetRequester() {}
+
+    virtual void channelGetConnect(const pvd::Status& status,
+                                   pva::ChannelGet::shared_pointer const & channelGet,
+                                   pvd::StructureConstPtr const & structure) {}
+    virtual void getDone(const pvd::Status& status,
+                         pva::ChannelGet::shared_pointer const & channelGet,
+                         pvd::PVStructure::shared_pointer const & pvStructure,
+                         pvd::BitSet::shared_pointer const & bitSet)
+    {
+        if(status.isSuccess())
+            epicsAtomicIncrSizeT(&ndone);
+        else
+            epicsAtomicIncrSizeT(&nerror);
+    }
+};
+
+pvd::PVStructurePtr makeRequest(size_t bsize)
+{
+    pvd::StructureConstPtr dtype(pvd::getFieldCreate()->createFieldBuilder()
+                                 ->addNestedStructure("record")
+                                    ->addNestedStructure("_options")
+                                        ->add("queueSize", pvd::pvString)
+                                    ->endNested()
+                                 ->endNested()
+                                 ->createStructure());
+
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(dtype));
+    ret->getSubFieldT<pvd::PVScalar>("record._options.queueSize")->putFrom<pvd::int32>(bsize);
+    return ret;
+}
+
+struct MonitorConfig {
+    size_t nupdates;
+    double rate;      // updates/sec.  <=0 as fast as possible
+    size_t nelements; // 0 for scalar
+    size_t nsubscribers;
+    size_t queueSize;
+    size_t drainEvery; // 0 drain on wakeup, N drain all subscribers after each N updates
+};
+
+// wait for FanoutPool workers to finish
+void waitFanout(const GWServerChannelProvider::shared_pointer& gateway)
+{
+    if(!gateway->cache.fanout)
+        return;
+    const FanoutPool::workers_t& W = gateway->cache.fanout->workers;
+    for(size_t i=0; i<W.size(); i++) {
+        while(true) {
+            {
+                Guard G(W[i]->lock);
+                if(W[i]->queue.empty())
+                    break;
+            }
+            epicsThreadSleep(0.001);
+        }
+    }
+    epicsThreadSleep(0.01); // last update may still be in queueUpdate()
+}
+
+void benchMonitor(const GWServerChannelProvider::shared_pointer& gateway,
+                  const TestProvider::shared_pointer& upstream,
+                  const TestPV::shared_pointer& pv,
+                  const MonitorConfig& conf)
+{
+    TestChannelRequester::shared_pointer creq(new TestChannelRequester);
+    pva::Channel::shared_pointer chan(gateway->createChannel(pv->name, creq));
+    if(!chan) {
+        fprintf(stderr, "Can't create channel %s\n", pv->name.c_str());
+        return;
+    }
+
+    std::vector<BenchMonitorRequester::shared_pointer> subs(conf.nsubscribers);
+    for(size_t i=0; i<subs.size(); i++) {
+        subs[i].reset(new BenchMonitorRequester(conf.drainEvery==0));
+        subs[i]->mon = chan->createMonitor(subs[i], makeRequest(conf.queueSize));
+        if(!subs[i]->mon) {
+            fprintf(stderr, "Can't create monitor\n");
+            return;
+        }
+        subs[i]->mon->start();
+    }
+
+    upstream->dispatch(); // initial update
+    waitFanout(gateway);
+    for(size_t i=0; i<subs.size(); i++) {
+        subs[i]->drain();
+        subs[i]->nevents = 0;
+    }
+
+    pvd::BitSet changed;
+    changed.set(1); // .value
+
+    pvd::PVScalarPtr scalar;
+    pvd::PVDoubleArray::shared_pointer array;
+    if(conf.nelements)
+        array = pv->value->getSubFieldT<pvd::PVDoubleArray>("value");
+    else
+        scalar = pv->value->getSubFieldT<pvd::PVScalar>("value");
+
+    char name[64];
+    sprintf(name, "monitor%s", conf.nelements ? "_array" : "");
+    Result R(name);
+
+    for(size_t n=0; n<conf.nupdates; n++) {
+        if(conf.rate>0.0) {
+            double ahead = n/conf.rate - (epicsTime::getCurrent() - R.start);
+            if(ahead>0.0)
+                epicsThreadSleep(ahead);
+        }
+
+        {
+            Guard G(pv->lock);
+            if(array) {
+                // new array for each update, as a real IOC would
+                pvd::PVDoubleArray::svector arr(conf.nelements, double(n));
+                array->replace(pvd::freeze(arr));
+            } else {
+                scalar->putFrom<double>(n);
+            }
+        }
+        pv->post(changed);
+
+        if(conf.drainEvery && (n+1)%conf.drainEvery==0) {
+            waitFanout(gateway);
+            for(size_t i=0; i<subs.size(); i++)
+                subs[i]->drain();
+        }
+    }
+
+    waitFanout(gateway);
+    size_t nevents = 0, ndropped = 0;
+    for(size_t i=0; i<subs.size(); i++) {
+        subs[i]->drain();
+        nevents += epicsAtomicGetSizeT(&subs[i]->nevents);
+
+        MonitorUser::shared_pointer MU(std::tr1::dynamic_pointer_cast<MonitorUser>(subs[i]->mon));
+        if(MU)
+            ndropped += epicsAtomicGetSizeT(&MU->ndropped);
+    }
+
+    R.add("subscribers", conf.nsubscribers)
+     .add("elements", conf.nelements)
+     .add("queue", conf.queueSize)
+     .add("events", nevents)
+     .add("drops", ndropped)
+     .add("fanout", gateway->cache.fanout ? gateway->cache.fanout->workers.size() : 0u)
+     .add("shared", gateway->cache.sharedSnapshots);
+
+    double elapsed = epicsTime::getCurrent() - R.start;
+    R.add("events_per_sec", elapsed>0.0 ? nevents/elapsed : 0.0)
+     .done(conf.nupdates);
+
+    for(size_t i=0; i<subs.size(); i++) {
+        subs[i]->mon->destroy();
+        subs[i]->mon.reset();
+    }
+    chan->destroy();
+}
+
+// ngets get()s spread over nclients ChannelGets, with or without a monitor of the same PV
+void benchGet(const GWServerChannelProvider::shared_pointer& gateway,
+              const TestProvider::shared_pointer& upstream,
+              const TestPV::shared_pointer& pv,
+              size_t ngets, size_t nclients, bool withmonitor)
+{
+    TestChannelRequester::shared_pointer creq(new TestChannelRequester);
+    pva::Channel::shared_pointer chan(gateway->createChannel(pv->name, creq));
+    if(!chan) {
+        fprintf(stderr, "Can't create channel %s\n", pv->name.c_str());
+        return;
+    }
+
+    BenchMonitorRequester::shared_pointer mreq;
+    if(withmonitor) {
+        mreq.reset(new BenchMonitorRequester(true));
+        mreq->mon = chan->createMonitor(mreq, makeRequest(4));
+        mreq->mon->start();
+        upstream->dispatch();
+        waitFanout(gateway);
+        mreq->drain();
+    }
+
+    pvd::PVStructurePtr pvr(pvd::getPVDataCreate()->createPVStructure(pvd::getFieldCreate()->createFieldBuilder()
+                                                                       ->createStructure()));
+    BenchGetRequester::shared_pointer greq(new BenchGetRequester);
+    std::vector<pva::ChannelGet::shared_pointer> gets(nclients ? nclients : 1u);
+    for(size_t i=0; i<gets.size(); i++)
+        gets[i] = chan->createChannelGet(greq, pvr);
+
+    ChannelCache& cache = gateway->cache;
+    size_t nup = epicsAtomicGetSizeT(&cache.getUpstream),
+           nco = epicsAtomicGetSizeT(&cache.getCoalesced),
+           nmon = epicsAtomicGetSizeT(&cache.getMonitor);
+
+    Result R(withmonitor ? "get_monitor" : "get");
+
+    for(size_t n=0; n<ngets; n++)
+        gets[n%gets.size()]->get();
+
+    R.add("clients", gets.size())
+     .add("done", epicsAtomicGetSizeT(&greq->ndone))
+     .add("errors", epicsAtomicGetSizeT(&greq->nerror))
+     .add("upstream", epicsAtomicGetSizeT(&cache.getUpstream)-nup)
+     .add("coalesced", epicsAtomicGetSizeT(&cache.getCoalesced)-nco)
+     .add("from_monitor", epicsAtomicGetSizeT(&cache.getMonitor)-nmon)
+     .done(ngets);
+
+    for(size_t i=0; i<gets.size(); i++)
+        gets[i]->destroy();
+    if(mreq)
+        mreq->mon->destroy();
+    chan->destroy();
+}
+
+bool hasMode(const std::string& modes, const char *mode)
+{
+    return modes=="all" || (","+modes+",").find(std::string(",")+mode+",")!=std::string::npos;
+}
+
+void usage(const char *me)
+{
+    fprintf(stderr, "Usage: %s [-j] [-m search,create,monitor,get] [-n #names] [-c #searches/thread] [-t max #threads]\n"
+                    "          [-u #updates] [-r updates/sec] [-e #elements] [-S #subscribers] [-q queueSize]\n"
+                    "          [-d drain interval] [-w #fanout workers] [-x] [-g #gets]\n"
+                    "\n"
+                    " -j  JSON output, one object per line\n"
+                    " -m  comma separated list of benchmarks (default all)\n"
+                    " -e  0 for a scalar value, otherwise a double array of this length\n"
+                    " -d  0 subscribers drain on each wakeup, N drain after every N updates\n"
+                    " -x  shared snapshots\n", me);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    size_t nnames = 1000, count = 100000, ngets = 100000;
+    unsigned maxthreads = 8, nfanout = 0;
+    bool shared = false;
+    std::string modes("all");
+    MonitorConfig mconf;
+    mconf.nupdates = 10000;
+    mconf.rate = 0.0;
+    mconf.nelements = 0;
+    mconf.nsubscribers = 10;
+    mconf.queueSize = 4;
+    mconf.drainEvery = 0;
+    int opt;
+
+    while((opt=getopt(argc, argv, "jm:n:c:t:u:r:e:S:q:d:w:xg:h"))!=-1) {
+        switch(opt) {
+        case 'j': jsonout = true; break;
+        case 'm': modes = optarg; break;
+        case 'n': nnames = strtoul(optarg, NULL, 0); break;
+        case 'c': count = strtoul(optarg, NULL, 0); break;
+        case 't': maxthreads = strtoul(optarg, NULL, 0); break;
+        case 'u': mconf.nupdates = strtoul(optarg, NULL, 0); break;
+        case 'r': mconf.rate = strtod(optarg, NULL); break;
+        case 'e': mconf.nelements = strtoul(optarg, NULL, 0); break;
+        case 'S': mconf.nsubscribers = strtoul(optarg, NULL, 0); break;
+        case 'q': mconf.queueSize = strtoul(optarg, NULL, 0); break;
+        case 'd': mconf.drainEvery = strtoul(optarg, NULL, 0); break;
+        case 'w': nfanout = strtoul(optarg, NULL, 0); break;
+        case 'x': shared = true; break;
+        case 'g': ngets = strtoul(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(nnames==0 || maxthreads==0 || mconf.queueSize==0) {
+        fprintf(stderr, "-n, -t and -q must be positive\n");
+        return 1;
+    }
+
+    testUtilQuiet = true;
+
+    TestProvider::shared_pointer upstream(new TestProvider());
+    std::vector<TestPV::shared_pointer> pvs;
+    std::vector<std::string> names;
+
+    pvd::StructureConstPtr type(pvd::getFieldCreate()->createFieldBuilder()
+                                ->add("value", pvd::pvInt)
+                                ->createStructure());
+
+    for(size_t i=0; i<nnames; i++) {
+        char name[32];
+        sprintf(name, "bench:%lu", (unsigned long)i);
+        names.push_back(name);
+        pvs.push_back(upstream->addPV(name, type));
+    }
+
+    TestPV::shared_pointer monpv(upstream->addPV("bench:monitor", pvd::getFieldCreate()->createFieldBuilder()
+                                                 ->add("value", pvd::pvInt)
+                                                 ->createStructure()));
+    TestPV::shared_pointer arrpv(upstream->addPV("bench:array", pvd::getFieldCreate()->createFieldBuilder()
+                                                 ->addArray("value", pvd::pvDouble)
+                                                 ->createStructure()));
+
+    GWServerChannelProvider::shared_pointer gateway(new GWServerChannelProvider(upstream));
+    gateway->cache.sharedSnapshots = shared;
+    if(nfanout)
+        gateway->cache.fanout = new FanoutPool(nfanout);
+
+    // populate cache, so that we measure the search hot path (cache hits)
+    {
+        BenchFindRequester::shared_pointer req(new BenchFindRequester);
+        FOREACH(std::vector<std::string>::const_iterator, it, end, names)
+            gateway->channelFind(*it, req);
+        gateway->channelFind(monpv->name, req);
+        gateway->channelFind(arrpv->name, req);
+    }
+    while(true) {
+        {
+            Guard G(gateway->cache.creator.lock);
+            if(gateway->cache.creator.queue.empty())
+                break;
+        }
+        epicsThreadSleep(0.01);
+    }
+
+    if(hasMode(modes, "search")) {
+        for(unsigned nthreads=1; nthreads<=maxthreads; nthreads*=2)
+            benchSearch(gateway, names, count, nthreads);
+    }
+
+    if(hasMode(modes, "create"))
+        benchCreate(gateway, names, count);
+
+    if(hasMode(modes, "monitor"))
+        benchMonitor(gateway, upstream, mconf.nelements ? arrpv : monpv, mconf);
+
+    if(hasMode(modes, "get")) {
+        TestPV::shared_pointer pv(mconf.nelements ? arrpv : monpv);
+        benchGet(gateway, upstream, pv, ngets, mconf.nsubscribers, false);
+        benchGet(gateway, upstream, pv, ngets, mconf.nsubscribers, true);
+    }
+
+    return 0;
+}
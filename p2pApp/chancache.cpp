@@ -1,12 +1,18 @@
 #include <stdio.h>
 
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
 #include <epicsAtomic.h>
 #include <errlog.h>
 
 #include <epicsMutex.h>
 #include <epicsTimer.h>
+#include <epicsEndian.h>
 
 #include <pv/epicsException.h>
+#include <pv/createRequest.h>
 #include <pv/serverContext.h>
 #include <pv/pvAccess.h>
 
@@ -15,6 +21,7 @@
 #include "helper.h"
 #include "chancache.h"
 #include "channel.h"
+#include "pvrequest.h"
 
 namespace pvd = epics::pvData;
 namespace pva = epics::pvAccess;
@@ -22,7 +29,8 @@ namespace pva = epics::pvAccess;
 size_t ChannelCacheEntry::num_instances;
 
 ChannelCacheEntry::ChannelCacheEntry(ChannelCache* c, const std::string& n)
-    :channelName(n), cache(c), dropPoke(true)
+    :channelName(n), cache(c), created(epicsTime::getCurrent()), lastused(created), held(false)
+    ,putUpstream(0), putCoalesced(0), idlequeued(false), fieldsgen(0)
 {
     epicsAtomicIncrSizeT(&num_instances);
 }
@@ -35,6 +43,93 @@ ChannelCacheEntry::~ChannelCacheEntry()
     epicsAtomicDecrSizeT(&num_instances);
 }
 
+pva::Channel::shared_pointer
+ChannelCacheEntry::upstream() const
+{
+    Guard G(mutex());
+    return channel;
+}
+
+void
+ChannelCacheEntry::retainOp(const std::tr1::shared_ptr<void>& op)
+{
+    if(cache->opRetain<=0.0)
+        return;
+    epicsTime expire(epicsTime::getCurrent() + cache->opRetain);
+
+    ChannelCache::Shard& shard = cache->shardFor(channelName);
+    Guard G(shard.lock);
+
+    // only while we are still cached
+    ChannelCache::entries_t::const_iterator it(shard.entries.find(channelName));
+    if(it==shard.entries.end() || it->second.get()!=this)
+        return;
+
+    {
+        Guard G2(mutex());
+        IdleOp& idle = idleops[op.get()];
+        idle.op = op;
+        idle.expire = expire;
+    }
+
+    if(!idlequeued) {
+        idlequeued = true;
+        shard.idle.push_back(std::make_pair(ChannelCacheEntry::weak_pointer(it->second), expire));
+    }
+}
+
+bool
+ChannelCacheEntry::expireOps(const epicsTime& now, std::vector<std::tr1::shared_ptr<void> >& expired, epicsTime& next)
+{
+    bool more = false;
+    for(idleops_t::iterator it(idleops.begin()), end(idleops.end()); it!=end;)
+    {
+        idleops_t::iterator cur(it++);
+        if(now >= cur->second.expire) {
+            expired.push_back(cur->second.op);
+            idleops.erase(cur);
+        } else if(!more || cur->second.expire < next) {
+            next = cur->second.expire;
+            more = true;
+        }
+    }
+    return more;
+}
+
+void
+ChannelCacheEntry::clearFields()
+{
+    fields.clear();
+    fieldsgen++;
+}
+
+void
+ChannelCacheEntry::notifyState(pva::Channel::ConnectionState state)
+{
+    interested_t::vector_type interested(this->interested.lock_vector()); // Copy
+
+    FOREACH(interested_t::vector_type::const_iterator, it, end, interested)
+    {
+        GWChannel *chan = it->get();
+        pva::ChannelRequester::shared_pointer req(chan->requester.lock());
+        if(req)
+            req->channelStateChange(*it, state);
+    }
+}
+
+void
+ChannelCacheEntry::expirePending(const epicsTime& now, pending_t& expired)
+{
+    pending_t::iterator cur(pending.begin()), keep(pending.begin()), end(pending.end());
+    for(; cur!=end; ++cur) {
+        if(cur->expire <= now)
+            expired.push_back(*cur);
+        else
+            *keep++ = *cur;
+    }
+    pending.erase(keep, end);
+}
+
 std::string
 ChannelCacheEntry::CRequester::getRequesterName()
 {
@@ -68,34 +163,85 @@ ChannelCacheEntry::CRequester::channelStateChange(pva::Channel::shared_pointer c
     if(!chan)
         return;
 
+    // downstream doesn't see a disconnect held for reconnectHold, or the reconnect which ends it
+    bool quiet = false;
+    bool removed = false;
     {
-        Guard G(chan->cache->cacheLock);
+        ChannelCache::Shard& shard = chan->cache->shardFor(chan->channelName);
+        Guard G(shard.lock);
 
-        assert(chan->channel.get()==channel.get());
+        {
+            Guard G2(chan->mutex());
+            if(!chan->channel)
+                chan->channel = channel; // state change during upstream createChannel()
+
+            assert(chan->channel.get()==channel.get());
+        }
 
         switch(connectionState)
         {
         case pva::Channel::DISCONNECTED:
+            if(chan->cache->reconnectHold>0.0) {
+                if(!chan->held) {
+                    chan->held = true;
+                    chan->disconnected = epicsTime::getCurrent();
+                    shard.held.push_back(std::make_pair(ChannelCacheEntry::weak_pointer(chan), chan->disconnected)); // cleaner will expire
+                    epicsAtomicIncrSizeT(&chan->cache->reconnectHeld);
+                }
+                quiet = true;
+                break;
+            }
+            // fall through
         case pva::Channel::DESTROYED:
             // Drop from cache
-            chan->cache->entries.erase(chan->channelName);
-            // keep 'chan' as a reference so that actual destruction doesn't happen which cacheLock is held
+            chan->held = false;
+            shard.remove(chan);
+            removed = true;
+            // keep 'chan' as a reference so that actual destruction doesn't happen which shard.lock is held
+            break;
+        case pva::Channel::CONNECTED:
+            if(chan->held) {
+                chan->held = false;
+                epicsAtomicIncrSizeT(&chan->cache->reconnectResumed);
+                quiet = true;
+            }
             break;
         default:
             break;
         }
     }
 
-    // fanout notification
-    ChannelCacheEntry::interested_t::vector_type interested(chan->interested.lock_vector()); // Copy
+    ChannelCacheEntry::pending_t pending, expired;
+    if(connectionState==pva::Channel::CONNECTED) {
+        Guard G(chan->mutex());
+        pending.swap(chan->pending);
+    } else {
+        // upstream type may change on reconnect
+        Guard G(chan->mutex());
+        chan->clearFields();
+        if(removed)
+            expired.swap(chan->pending); // no longer cached, so nothing else will answer
+    }
+    ChannelCache::replyExpired(expired);
 
-    FOREACH(ChannelCacheEntry::interested_t::vector_type::const_iterator, it, end, interested)
-    {
-        GWChannel *chan = it->get();
-        pva::ChannelRequester::shared_pointer req(chan->requester.lock());
-        if(req)
-            req->channelStateChange(*it, connectionState);
+    // reply to searches received while upstream was connecting
+    if(!pending.empty()) {
+        epicsTime now(epicsTime::getCurrent());
+        FOREACH(ChannelCacheEntry::pending_t::const_iterator, it, end, pending)
+        {
+            pva::ChannelFind::shared_pointer find(it->find.lock());
+            if(!find || it->expire <= now) {
+                it->requester->channelFindResult(pvd::Status::Ok, find, false);
+            } else {
+                it->requester->channelFindResult(pvd::Status::Ok, find, true);
+                epicsAtomicIncrSizeT(&chan->cache->deferReplies);
+            }
+        }
     }
+
+    // fanout notification
+    if(!quiet)
+        chan->notifyState(connectionState);
 }
 
 
@@ -106,104 +252,920 @@ struct ChannelCache::cacheClean : public epicsTimerNotify
     epicsTimerNotify::expireStatus expire(const epicsTime &currentTime)
     {
         // keep a reference to any cache entrys being removed so they
-        // aren't destroyed while cacheLock is held
-        std::set<ChannelCacheEntry::shared_pointer> cleaned;
+        // aren't destroyed while a shard lock is held
+        std::vector<ChannelCacheEntry::shared_pointer> cleaned;
+        ChannelCacheEntry::pending_t expired;
+        // upstream disconnected for longer than reconnectHold
+        std::vector<ChannelCacheEntry::shared_pointer> torndown;
+        // idle get/put operations, destroyed after all locks are released
+        std::vector<std::tr1::shared_ptr<void> > expiredops;
+
+        epicsAtomicIncrSizeT(&cache->cleanerRuns);
 
+        epicsTime now(epicsTime::getCurrent());
+        size_t shardMax = cache->cacheMax ? std::max(size_t(1u), cache->cacheMax/ChannelCache::NShards) : 0u;
+
+        // visit one shard at a time so that searches are only ever
+        // blocked for the duration of one shard
+        for(size_t i=0; i<ChannelCache::NShards; i++)
         {
-            Guard G(cache->cacheLock);
-            cache->cleanerRuns++;
-
-            ChannelCache::entries_t::iterator cur=cache->entries.begin(), next, end=cache->entries.end();
-            while(cur!=end) {
-                next = cur;
-                ++next;
-
-                if(!cur->second->dropPoke && cur->second->interested.empty()) {
-                    cleaned.insert(cur->second);
-                    cache->entries.erase(cur);
-                    cache->cleanerDust++;
+            ChannelCache::Shard& shard = cache->shards[i];
+            Guard G(shard.lock);
+
+            // Each list is in deadline order, so stop at the first not yet due.
+
+            // expire held searches
+            while(!shard.deferred.empty() && shard.deferred.front().second <= now) {
+                ChannelCacheEntry::shared_pointer ent(shard.deferred.front().first.lock());
+                shard.deferred.pop_front();
+                if(!ent)
+                    continue;
+                {
+                    Guard G2(ent->mutex());
+                    ent->expirePending(now, expired);
+                }
+                cleaned.push_back(ent); // may be last ref.
+            }
+
+            // expire held disconnects
+            while(!shard.held.empty() && now - shard.held.front().second > cache->reconnectHold) {
+                ChannelCacheEntry::shared_pointer ent(shard.held.front().first.lock());
+                epicsTime disconnected(shard.held.front().second);
+                shard.held.pop_front();
+                if(!ent)
+                    continue;
+                // not reconnected, or disconnected again since
+                if(ent->held && ent->disconnected==disconnected) {
+                    ent->held = false;
+                    shard.remove(ent);
+                    {
+                        Guard G2(ent->mutex());
+                        expired.insert(expired.end(), ent->pending.begin(), ent->pending.end());
+                        ent->pending.clear();
+                    }
+                    torndown.push_back(ent);
+                    epicsAtomicIncrSizeT(&cache->reconnectExpired);
+                }
+                cleaned.push_back(ent); // may be last ref.
+            }
+
+            // expire idle get/put operations
+            while(!shard.idle.empty() && shard.idle.front().second <= now) {
+                ChannelCacheEntry::shared_pointer ent(shard.idle.front().first.lock());
+                shard.idle.pop_front();
+                if(!ent)
+                    continue;
+                epicsTime next;
+                bool more;
+                {
+                    Guard G2(ent->mutex());
+                    more = ent->expireOps(now, expiredops, next);
+                }
+                if(more) {
+                    // look again when the next expires, but not ahead of those already listed
+                    if(!shard.idle.empty() && next < shard.idle.back().second)
+                        next = shard.idle.back().second;
+                    shard.idle.push_back(std::make_pair(ChannelCacheEntry::weak_pointer(ent), next));
                 } else {
-                    cur->second->dropPoke = false;
+                    ent->idlequeued = false;
                 }
+                cleaned.push_back(ent); // may be last ref.
+            }
+
+            // oldest (least recently used) entries are at the back
+            for(size_t n=0; n<cache->cleanBudget && !shard.lru.empty(); n++)
+            {
+                ChannelCacheEntry *ent = shard.lru.back();
+
+                bool idle = now - ent->lastused > cache->cacheTTL,
+                     over = shardMax && shard.entries.size() > shardMax;
+                if(!idle && !over)
+                    break; // all others used more recently
+
+                if(!ent->interested.empty() || !ent->mon_entries.empty()) {
+                    // in use by some downstream channel, or has retained monitors
+                    shard.touch(*ent, now);
+                    continue;
+                }
+
+                entries_t::iterator it(shard.entries.find(ent->channelName));
+                assert(it!=shard.entries.end() && it->second.get()==ent);
+                cleaned.push_back(it->second);
+                shard.remove(it);
+                {
+                    Guard G2(ent->mutex());
+                    expired.insert(expired.end(), ent->pending.begin(), ent->pending.end());
+                    ent->pending.clear();
+                }
+                epicsAtomicIncrSizeT(idle ? &cache->evictIdle : &cache->evictSize);
+            }
+
+            cache->expireNegative(shard, now);
+        }
+
+        ChannelCache::replyExpired(expired);
+        FOREACH(std::vector<ChannelCacheEntry::shared_pointer>::const_iterator, it, end, torndown)
+            (*it)->notifyState(pva::Channel::DISCONNECTED);
+        cache->expireRetained(now);
+        return epicsTimerNotify::expireStatus(epicsTimerNotify::restart, cache->cleanInterval);
+    }
+};
 
-                cur = next;
+void
+ChannelCache::Shard::add(const ChannelCacheEntry::shared_pointer& ent, const epicsTime& now)
+{
+    entries[ent->channelName] = ent;
+    lru.push_front(ent.get());
+    ent->lrupos = lru.begin();
+    ent->lastused = now;
+}
+
+void
+ChannelCache::Shard::remove(entries_t::iterator it)
+{
+    lru.erase(it->second->lrupos);
+    entries.erase(it);
+}
+
+void
+ChannelCache::Shard::remove(const ChannelCacheEntry::shared_pointer& ent)
+{
+    entries_t::iterator it(entries.find(ent->channelName));
+    if(it!=entries.end() && it->second==ent)
+        remove(it);
+}
+
+void
+ChannelCache::Shard::touch(ChannelCacheEntry& ent, const epicsTime& now)
+{
+    lru.splice(lru.begin(), lru, ent.lrupos);
+    ent.lastused = now;
+}
+
+ChannelCache::Creator::Creator(ChannelCache *cache)
+    :cache(cache)
+    ,running(true)
+    ,maxDepth(10000)
+    ,peakDepth(0)
+    ,ncreated(0)
+    ,nrejected(0)
+    ,totalLatency(0.0)
+    ,maxLatency(0.0)
+    ,worker(*this, "p2pCreate",
+            epicsThreadGetStackSize(epicsThreadStackSmall),
+            epicsThreadPriorityCAServerLow-2)
+{
+    worker.start();
+}
+
+ChannelCache::Creator::~Creator()
+{
+    close();
+}
+
+bool
+ChannelCache::Creator::add(const ChannelCacheEntry::shared_pointer& ent)
+{
+    bool wake;
+    {
+        Guard G(lock);
+        if(!running)
+            return false;
+        if(queue.size()>=maxDepth) {
+            nrejected++;
+            return false;
+        }
+        wake = queue.empty();
+        queue.push_back(std::make_pair(ChannelCacheEntry::weak_pointer(ent), epicsTime::getCurrent()));
+        if(queue.size()>peakDepth)
+            peakDepth = queue.size();
+    }
+    if(wake)
+        wakeup.signal();
+    return true;
+}
+
+void
+ChannelCache::Creator::close()
+{
+    {
+        Guard G(lock);
+        if(!running)
+            return;
+        running = false;
+        queue.clear();
+    }
+    wakeup.signal();
+    worker.exitWait();
+}
+
+void
+ChannelCache::Creator::run()
+{
+    Guard G(lock);
+
+    while(running) {
+        if(queue.empty()) {
+            UnGuard U(G);
+            wakeup.wait();
+            continue;
+        }
+
+        ChannelCacheEntry::shared_pointer ent(queue.front().first.lock());
+        epicsTime queued(queue.front().second);
+        queue.pop_front();
+
+        if(!ent)
+            continue; // cleaned before we got to it
+
+        pva::Channel::shared_pointer M;
+        {
+            UnGuard U(G);
+            ChannelCacheEntry::pending_t expired;
+
+            try {
+                M = cache->providerFor(ent->channelName)->createChannel(ent->channelName, ent->requester);
+            }catch(std::exception& e){
+                errlogPrintf("p2p upstream createChannel(\"%s\") error: %s\n", ent->channelName.c_str(), e.what());
+            }
+
+            {
+                ChannelCache::Shard& shard = cache->shardFor(ent->channelName);
+                Guard G2(shard.lock);
+                Guard G3(ent->mutex());
+                if(M) {
+                    if(!ent->channel)
+                        ent->channel = M;
+                } else {
+                    // forget so that a later search will try again
+                    shard.remove(ent);
+                    expired.swap(ent->pending);
+                }
             }
+            ChannelCache::replyExpired(expired);
+        }
+
+        double latency = epicsTime::getCurrent() - queued;
+        ncreated++;
+        totalLatency += latency;
+        if(latency>maxLatency)
+            maxLatency = latency;
+
+        {
+            UnGuard U(G);
+            ent.reset(); // may destroy, so not while holding our lock
         }
-        return epicsTimerNotify::expireStatus(epicsTimerNotify::restart, 30.0);
+    }
+}
+
+struct ChannelCache::warmSave : public epicsTimerNotify
+{
+    ChannelCache *cache;
+    warmSave(ChannelCache *c) : cache(c) {}
+    epicsTimerNotify::expireStatus expire(const epicsTime &currentTime)
+    {
+        // write a temporary, then replace, so a crash never leaves a partial file
+        std::string temp(cache->warmFile+".tmp");
+        bool ok;
+        {
+            std::ofstream strm(temp.c_str());
+            if(strm.is_open())
+                cache->saveWarm(strm);
+            ok = strm.good();
+        }
+#ifdef _WIN32
+        if(ok)
+            remove(cache->warmFile.c_str()); // rename() won't replace
+#endif
+        if(ok && rename(temp.c_str(), cache->warmFile.c_str())==0) {
+            epicsAtomicIncrSizeT(&cache->warmSaves);
+        } else {
+            errlogPrintf("p2p failed to write warm start file \"%s\"\n", cache->warmFile.c_str());
+        }
+        return epicsTimerNotify::expireStatus(epicsTimerNotify::restart, cache->warmPeriod);
     }
 };
 
+namespace {
+// remove from ChannelCache::retained into 'dropped'.  call with retainLock held
+void dropRetained(ChannelCache::retained_t& retained,
+                  ChannelCache::retained_t::iterator it,
+                  std::vector<MonitorCacheEntry::shared_pointer>& dropped,
+                  std::vector<ChannelCacheEntry::shared_pointer>& chans)
+{
+    MonitorCacheEntry::shared_pointer ment;
+    ment.swap(*it);
+    retained.erase(it);
+    ment->retained = false;
+    chans.push_back(ChannelCacheEntry::shared_pointer());
+    chans.back().swap(ment->retainchan);
+    dropped.push_back(ment);
+}
+}
+
+namespace {
+// Lamping and Veach, "A Fast, Minimal Memory, Consistent Hash Algorithm"
+size_t jumpHash(epicsUInt64 key, size_t nbuckets)
+{
+    epicsInt64 b = -1, j = 0;
+    while(j < epicsInt64(nbuckets)) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = epicsInt64((b + 1) * (double(1LL << 31) / double((key >> 33) + 1)));
+    }
+    return size_t(b);
+}
+
+// 64-bit FNV-1a
+epicsUInt64 nameHash(const std::string& name)
+{
+    epicsUInt64 H = 14695981039346656037ULL;
+    for(size_t i=0, N=name.size(); i<N; i++) {
+        H ^= epicsUInt8(name[i]);
+        H *= 1099511628211ULL;
+    }
+    return H;
+}
+}
+
+bool
+ChannelCache::coalescePut(const std::string& name) const
+{
+    FOREACH(std::vector<std::string>::const_iterator, it, end, putCoalesce)
+    {
+        if(epicsStrGlobMatch(name.c_str(), it->c_str()))
+            return true;
+    }
+    return false;
+}
+
+const pva::ChannelProvider::shared_pointer&
+ChannelCache::providerFor(const std::string& name) const
+{
+    if(contexts.size()<=1)
+        return provider;
+    return contexts[jumpHash(nameHash(name), contexts.size())];
+}
+
 ChannelCache::ChannelCache(const pva::ChannelProvider::shared_pointer& prov)
     :provider(prov)
     ,timerQueue(&epicsTimerQueueActive::allocate(1, epicsThreadPriorityCAServerLow-2))
     ,cleaner(new cacheClean(this))
     ,cleanerRuns(0)
-    ,cleanerDust(0)
+    ,cacheTTL(60.0)
+    ,cacheMax(0)
+    ,cleanInterval(1.0)
+    ,cleanBudget(256)
+    ,evictIdle(0)
+    ,evictSize(0)
+    ,negativeDelay(10.0)
+    ,negativeTTL(0.0)
+    ,negativeMax(10000)
+    ,negativeHits(0)
+    ,deferTimeout(5.0)
+    ,deferMax(64)
+    ,deferReplies(0)
+    ,fieldHits(0)
+    ,fieldMisses(0)
+    ,getUpstream(0)
+    ,getCoalesced(0)
+    ,getMonitor(0)
+    ,putUpstream(0)
+    ,putCoalesced(0)
+    ,opRetain(0.0)
+    ,opReused(0)
+    ,monProjected(0)
+    ,monSliced(0)
+    ,pool(new ElementPool)
+    ,sharedSnapshots(false)
+    ,flowControl(false)
+    ,reconnectHold(0.0)
+    ,reconnectHeld(0)
+    ,reconnectResumed(0)
+    ,reconnectExpired(0)
+    ,reconnectRetyped(0)
+    ,monitorRetain(0.0)
+    ,monitorRetainMax(1000)
+    ,nretained(0)
+    ,retainHits(0)
+    ,retainExpired(0)
+    ,retainEvicted(0)
+    ,warmPeriod(60.0)
+    ,warmTimeout(10.0)
+    ,warmMonitors(false)
+    ,warmer(0)
+    ,warmTimer(0)
+    ,warmSaves(0)
+    ,fanout(0)
+    ,creator(this)
 {
     if(!provider)
         throw std::logic_error("Missing 'pva' provider");
+    contexts.push_back(provider);
     assert(timerQueue);
     cleanTimer = &timerQueue->createTimer();
-    cleanTimer->start(*cleaner, 30.0);
+    cleanTimer->start(*cleaner, cleanInterval);
 }
 
 ChannelCache::~ChannelCache()
 {
-    entries_t E;
-    {
-        Guard G(cacheLock);
+    creator.close();
+    cleanTimer->destroy();
+    if(warmTimer)
+        warmTimer->destroy();
+    timerQueue->release();
+    delete cleaner;
+    delete warmer;
 
-        cleanTimer->destroy();
-        timerQueue->release();
-        delete cleaner;
+    // drop retained monitors before the channels they reference
+    {
+        std::vector<ChannelCacheEntry::shared_pointer> chans;
+        std::vector<MonitorCacheEntry::shared_pointer> dropped;
+        {
+            Guard G(retainLock);
+            monitorRetain = 0.0; // no more
+            while(!retained.empty())
+                dropRetained(retained, retained.begin(), dropped, chans);
+            nretained = 0;
+        }
+    }
 
+    // entries are destroyed when E goes out of scope, with no shard lock held
+    {
         entries_t E;
-        E.swap(entries);
+        for(size_t i=0; i<NShards; i++)
+        {
+            Guard G(shards[i].lock);
+            E.insert(shards[i].entries.begin(), shards[i].entries.end());
+            shards[i].entries.clear();
+            shards[i].lru.clear();
+        }
     }
+
+    // upstream monitors may call fanoutUpdate() and unlisten() until their channels are destroyed above
+    FanoutPool *pool = fanout;
+    fanout = NULL;
+    delete pool;
 }
 
 ChannelCacheEntry::shared_pointer
-ChannelCache::lookup(const std::string& newName)
+ChannelCache::lookup(const std::string& newName, bool async)
 {
-    ChannelCacheEntry::shared_pointer ret;
+    ChannelCacheEntry::shared_pointer ret, dropped; // 'dropped' free'd after unlock
+    ChannelCacheEntry::pending_t expired; // held searches of 'dropped', answered after unlock
+    {
+        Shard& shard = shardFor(newName);
+        Guard G(shard.lock);
+
+        entries_t::iterator it = shard.entries.find(newName);
+        // NULL while queued to the Creator
+        pva::Channel::shared_pointer chan(it!=shard.entries.end() ? it->second->upstream() : pva::Channel::shared_pointer());
+
+        if(it==shard.entries.end() && !shard.negative.empty()) {
+            negative_t::iterator nit = shard.negative.find(newName);
+            if(nit!=shard.negative.end()) {
+                if(epicsTime::getCurrent() < nit->second) {
+                    // known missing, no upstream search
+                    epicsAtomicIncrSizeT(&negativeHits);
+                    return ret;
+                }
+                shard.negative.erase(nit); // expired, try again
+            }
+        }
 
-    Guard G(cacheLock);
+        if(it==shard.entries.end() && async) {
+            // first request, queue creation of ChannelCacheEntry.
+            // not connected, so return NULL.
 
-    entries_t::const_iterator it = entries.find(newName);
+            ChannelCacheEntry::shared_pointer ent(new ChannelCacheEntry(this, newName));
+            ent->requester.reset(new ChannelCacheEntry::CRequester(ent));
 
-    if(it==entries.end()) {
-        // first request, create ChannelCacheEntry
-        //TODO: async lookup
+            if(creator.add(ent))
+                shard.add(ent, epicsTime::getCurrent());
+            else
+                dropped = ent; // queue full.  client will retry
 
-        ChannelCacheEntry::shared_pointer ent(new ChannelCacheEntry(this, newName));
-        ent->requester.reset(new ChannelCacheEntry::CRequester(ent));
+        } else if(it==shard.entries.end()) {
+            // first request, create ChannelCacheEntry
 
-        entries[newName] = ent;
+            ChannelCacheEntry::shared_pointer ent(new ChannelCacheEntry(this, newName));
+            ent->requester.reset(new ChannelCacheEntry::CRequester(ent));
 
-        pva::Channel::shared_pointer M;
-        {
-            // unlock to call createChannel()
-            epicsGuardRelease<epicsMutex> U(G);
+            shard.add(ent, epicsTime::getCurrent());
+
+            pva::Channel::shared_pointer M;
+            {
+                // unlock to call createChannel()
+                epicsGuardRelease<epicsMutex> U(G);
+
+                M = providerFor(newName)->createChannel(newName, ent->requester);
+                if(!M)
+                    THROW_EXCEPTION2(std::runtime_error, "Failed to createChannel");
+            }
+            {
+                Guard G2(ent->mutex());
+                ent->channel = M;
+            }
+
+            if(M->isConnected())
+                ret = ent; // immediate connect, mostly for unit-tests (thus delayed connect not covered)
+
+        } else if(chan && chan->isConnected()) {
+            // another request, and hey we're connected this time
 
-            M = provider->createChannel(newName, ent->requester);
-            if(!M)
-                THROW_EXCEPTION2(std::runtime_error, "Failed to createChannel");
+            ret = it->second;
+            shard.touch(*it->second, epicsTime::getCurrent());
+
+        } else if(negativeTTL>0.0
+                  && chan
+                  && chan->getConnectionState()==pva::Channel::NEVER_CONNECTED
+                  && epicsTime::getCurrent() - it->second->created > negativeDelay) {
+            // upstream search has gone unanswered for too long.
+            // stop searching, and remember that this name is missing.
+            dropped = it->second;
+            shard.remove(it);
+            addNegative(shard, newName);
+            {
+                Guard G2(dropped->mutex());
+                expired.swap(dropped->pending);
+            }
+
+        } else {
+            // not connected yet, but a client is still interested
+            shard.touch(*it->second, epicsTime::getCurrent());
         }
-        ent->channel = M;
+    }
 
-        if(M->isConnected())
-            ret = ent; // immediate connect, mostly for unit-tests (thus delayed connect not covered)
+    replyExpired(expired);
+    return ret;
+}
+
+// call with shard.lock held
+void
+ChannelCache::addNegative(Shard& shard, const std::string& name)
+{
+    epicsTime expire(epicsTime::getCurrent() + negativeTTL);
+    size_t limit = negativeMax/NShards;
+    if(limit==0)
+        limit = 1;
+
+    while(shard.negative.size()>=limit && !shard.negative_order.empty()) {
+        // evict oldest
+        negative_t::iterator it = shard.negative.find(shard.negative_order.front().first);
+        if(it!=shard.negative.end() && it->second==shard.negative_order.front().second)
+            shard.negative.erase(it);
+        shard.negative_order.pop_front();
+    }
 
-    } else if(it->second->channel && it->second->channel->isConnected()) {
-        // another request, and hey we're connected this time
+    shard.negative[name] = expire;
+    shard.negative_order.push_back(std::make_pair(name, expire));
+}
+
+// call with shard.lock held
+void
+ChannelCache::expireNegative(Shard& shard, const epicsTime& now)
+{
+    while(!shard.negative_order.empty() && shard.negative_order.front().second <= now) {
+        negative_t::iterator it = shard.negative.find(shard.negative_order.front().first);
+        // only erase if not re-added since
+        if(it!=shard.negative.end() && it->second==shard.negative_order.front().second)
+            shard.negative.erase(it);
+        shard.negative_order.pop_front();
+    }
+}
+
+ChannelCache::defer_t
+ChannelCache::deferSearch(const std::string& name,
+                          const pva::ChannelFindRequester::shared_pointer& requester,
+                          const pva::ChannelFind::shared_pointer& find)
+{
+    if(deferTimeout<=0.0)
+        return NotDeferred;
+
+    ChannelCacheEntry::pending_t expired;
+    defer_t ret = NotDeferred;
+    {
+        Shard& shard = shardFor(name);
+        Guard G(shard.lock);
 
+        entries_t::const_iterator it = shard.entries.find(name);
+        if(it==shard.entries.end())
+            return NotDeferred; // rejected, or in negative cache
+
+        ChannelCacheEntry& ent = *it->second;
+        Guard G2(ent.mutex());
+
+        if(ent.channel && ent.channel->isConnected()) {
+            ret = Connected;
+
+        } else {
+            epicsTime now(epicsTime::getCurrent());
+            ent.expirePending(now, expired);
+
+            if(ent.pending.size()<deferMax) {
+                ChannelCacheEntry::PendingSearch P;
+                P.requester = requester;
+                P.find = find;
+                P.expire = now + deferTimeout;
+                ent.pending.push_back(P);
+                shard.deferred.push_back(std::make_pair(ChannelCacheEntry::weak_pointer(it->second), P.expire)); // cleaner will expire
+                ret = Deferred;
+            }
+        }
+    }
+
+    replyExpired(expired);
+    return ret;
+}
+
+void
+ChannelCache::replyExpired(ChannelCacheEntry::pending_t& expired)
+{
+    FOREACH(ChannelCacheEntry::pending_t::const_iterator, it, end, expired)
+    {
+        it->requester->channelFindResult(pvd::Status::Ok, pva::ChannelFind::shared_pointer(it->find.lock()), false);
+    }
+    expired.clear();
+}
+
+ChannelCacheEntry::shared_pointer
+ChannelCache::find(const std::string& name)
+{
+    ChannelCacheEntry::shared_pointer ret;
+    Shard& shard = shardFor(name);
+    Guard G(shard.lock);
+
+    entries_t::const_iterator it = shard.entries.find(name);
+    if(it!=shard.entries.end())
         ret = it->second;
-        it->second->dropPoke = true;
+    return ret;
+}
 
-    } else {
-        // not connected yet, but a client is still interested
-        it->second->dropPoke = true;
+ChannelCacheEntry::shared_pointer
+ChannelCache::erase(const std::string& name)
+{
+    ChannelCacheEntry::shared_pointer ret;
+    ChannelCacheEntry::pending_t expired;
+    {
+        Shard& shard = shardFor(name);
+        Guard G(shard.lock);
+
+        entries_t::iterator it = shard.entries.find(name);
+        if(it!=shard.entries.end()) {
+            ret = it->second;
+            shard.remove(it);
+            Guard G2(ret->mutex());
+            expired.swap(ret->pending);
+        }
+    }
+    replyExpired(expired);
+    return ret;
+}
+
+void
+ChannelCache::retain(const MonitorCacheEntry::shared_pointer& ment, bool warm)
+{
+    if(monitorRetain<=0.0)
+        return;
+    if(!warm) {
+        Guard G(ment->mutex());
+        if(!ment->havedata || !ment->mon || !ment->startresult.isSuccess())
+            return; // nothing to offer a new subscriber
+    }
+
+    ChannelCacheEntry::shared_pointer chan(find(ment->chan->channelName));
+    if(chan.get()!=ment->chan)
+        return; // no longer cached (eg. disconnected)
+
+    // free'd after unlock.  monitors before channels
+    std::vector<ChannelCacheEntry::shared_pointer> chans;
+    std::vector<MonitorCacheEntry::shared_pointer> dropped;
+    {
+        Guard G(retainLock);
+        if(ment->retained) {
+            retained.erase(ment->retainpos);
+            nretained--;
+        }
+        retained.push_front(ment);
+        ment->retainpos = retained.begin();
+        ment->retained = true;
+        ment->idleSince = epicsTime::getCurrent();
+        ment->retainchan = chan;
+        nretained++;
+
+        while(nretained>monitorRetainMax) {
+            dropRetained(retained, --retained.end(), dropped, chans);
+            nretained--;
+            retainEvicted++;
+        }
+    }
+}
+
+void
+ChannelCache::unretain(const MonitorCacheEntry::shared_pointer& ment)
+{
+    std::vector<ChannelCacheEntry::shared_pointer> chans;
+    std::vector<MonitorCacheEntry::shared_pointer> dropped;
+    {
+        Guard G(retainLock);
+        if(!ment->retained)
+            return;
+        dropRetained(retained, ment->retainpos, dropped, chans);
+        nretained--;
+        retainHits++;
+    }
+}
+
+void
+ChannelCache::expireRetained(const epicsTime& now)
+{
+    std::vector<ChannelCacheEntry::shared_pointer> chans;
+    std::vector<MonitorCacheEntry::shared_pointer> dropped;
+    {
+        Guard G(retainLock);
+        // oldest at the back
+        while(!retained.empty() && now - retained.back()->idleSince > monitorRetain) {
+            dropRetained(retained, --retained.end(), dropped, chans);
+            nretained--;
+            retainExpired++;
+        }
     }
+}
 
+void
+ChannelCache::teardown(ChannelCacheEntry *ent)
+{
+    ChannelCacheEntry::shared_pointer E;
+    ChannelCacheEntry::pending_t expired;
+    {
+        Shard& shard = shardFor(ent->channelName);
+        Guard G(shard.lock);
+
+        entries_t::iterator it = shard.entries.find(ent->channelName);
+        if(it!=shard.entries.end() && it->second.get()==ent) {
+            E = it->second;
+            E->held = false;
+            shard.remove(it);
+            Guard G2(E->mutex());
+            expired.swap(E->pending);
+        }
+    }
+    replyExpired(expired);
+    if(E)
+        E->notifyState(pva::Channel::DISCONNECTED);
+}
+
+size_t
+ChannelCache::size()
+{
+    size_t ret = 0;
+    for(size_t i=0; i<NShards; i++)
+    {
+        Guard G(shards[i].lock);
+        ret += shards[i].entries.size();
+    }
+    return ret;
+}
+
+size_t
+ChannelCache::negativeSize()
+{
+    size_t ret = 0;
+    for(size_t i=0; i<NShards; i++)
+    {
+        Guard G(shards[i].lock);
+        ret += shards[i].negative.size();
+    }
     return ret;
 }
+
+void
+ChannelCache::snapshot(entries_t& entries)
+{
+    for(size_t i=0; i<NShards; i++)
+    {
+        Guard G(shards[i].lock);
+        entries.insert(shards[i].entries.begin(), shards[i].entries.end());
+    }
+}
+
+void
+ChannelCache::startWarm()
+{
+    if(warmFile.empty() || warmTimer)
+        return;
+    warmer = new warmSave(this);
+    warmTimer = &timerQueue->createTimer();
+    warmTimer->start(*warmer, warmPeriod);
+}
+
+void
+ChannelCache::saveWarm(std::ostream& strm)
+{
+    entries_t entries;
+    snapshot(entries);
+
+    strm<<"# p2p warm start.  channel name, then optional TAB and monitor pvRequest\n";
+
+    FOREACH(entries_t::const_iterator, it, end, entries)
+    {
+        ChannelCacheEntry& E = *it->second;
+        if(E.interested.empty() && E.mon_entries.empty())
+            continue; // not in use
+        pva::Channel::shared_pointer chan(E.upstream());
+        if(!chan || !chan->isConnected())
+            continue;
+
+        strm<<E.channelName<<"\n";
+
+        if(!warmMonitors)
+            continue;
+
+        ChannelCacheEntry::mon_entries_t::lock_vector_type mons(E.mon_entries.lock_vector());
+        FOREACH(ChannelCacheEntry::mon_entries_t::lock_vector_type::const_iterator, it2, end2, mons)
+        {
+            strm<<E.channelName<<"\t"<<requestString(it2->second->request)<<"\n";
+        }
+    }
+}
+
+void
+ChannelCache::loadWarm(std::istream& strm, WarmProgress& progress)
+{
+    typedef std::map<std::string, ChannelCacheEntry::shared_pointer> seen_t;
+    seen_t seen;
+
+    std::string line;
+    while(std::getline(strm, line)) {
+        if(line.empty() || line[0]=='#')
+            continue;
+
+        size_t sep = line.find('\t');
+        std::string name(line.substr(0, sep));
+
+        ChannelCacheEntry::shared_pointer ent;
+        {
+            seen_t::const_iterator it(seen.find(name));
+            if(it!=seen.end()) {
+                ent = it->second;
+            } else {
+                lookup(name); // begin connecting
+                ent = find(name);
+                if(ent)
+                    progress.chans.push_back(ent);
+                seen[name] = ent;
+            }
+        }
+        if(!ent) {
+            progress.nerrors++;
+            continue;
+        }
+
+        if(sep==std::string::npos || monitorRetain<=0.0)
+            continue; // nothing would keep a monitor
+
+        pvd::PVStructurePtr request;
+        try {
+            request = requestCanonical(pvd::createRequest(line.substr(sep+1)));
+        } catch(std::exception& e) {
+            errlogPrintf("p2p warm start \"%s\" ignore invalid pvRequest: %s\n", name.c_str(), e.what());
+            progress.nerrors++;
+            continue;
+        }
+
+        ChannelCacheEntry::pvrequest_t ser;
+        pvd::serializeToVector(request.get(), EPICS_BYTE_ORDER, ser);
+
+        MonitorCacheEntry::shared_pointer ment;
+        {
+            Guard G(ent->mutex());
+            if(!ent->channel) {
+                progress.nerrors++;
+                continue;
+            }
+            ment = ent->mon_entries.find(ser);
+            if(!ment)
+                ment = ent->addMonitor(G, request, ser);
+        }
+        progress.mons.push_back(ment);
+        retain(ment, true);
+    }
+}
+
+void
+ChannelCache::WarmProgress::count(size_t& nconnected, size_t& nhavedata) const
+{
+    nconnected = nhavedata = 0u;
+    FOREACH(std::vector<ChannelCacheEntry::shared_pointer>::const_iterator, it, end, chans)
+    {
+        pva::Channel::shared_pointer chan((*it)->upstream());
+        if(chan && chan->isConnected())
+            nconnected++;
+    }
+    FOREACH(std::vector<MonitorCacheEntry::shared_pointer>::const_iterator, it, end, mons)
+    {
+        Guard G((*it)->mutex());
+        if((*it)->havedata)
+            nhavedata++;
+    }
+}
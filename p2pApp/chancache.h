@@ -2,23 +2,93 @@
 #define CHANCACHE_H
 
 #include <string>
+#include <list>
 #include <map>
 #include <set>
 #include <deque>
+#include <vector>
+#include <ostream>
 
 #include <epicsMutex.h>
+#include <epicsString.h>
+#include <epicsTime.h>
 #include <epicsTimer.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
 
 #include <pv/pvAccess.h>
 
 #include "weakmap.h"
 #include "weakset.h"
+#include "pvrequest.h"
 
 struct ChannelCache;
 struct ChannelCacheEntry;
 struct MonitorUser;
 struct GWChannel;
 
+// define to cross check MonitorUser::release() against a std::set of elements poll()'d
+//#define P2P_TRACK_INUSE
+
+/** log2 histogram of latencies.  Bin 0 counts less than 1us, bin i counts [2**(i-1), 2**i) us,
+ *  and the last bin also counts anything longer.
+ *  Updated with atomic increments, so needs no lock.
+ */
+struct LatencyHist
+{
+    enum { NBins = 24 };
+    typedef size_t bins_t[NBins];
+    bins_t bins;
+
+    LatencyHist();
+    //! count one interval in nanoseconds, as from epicsMonotonicGet()
+    void add(epicsUInt64 ns);
+    //! copy current counts
+    void get(bins_t& out) const;
+
+    //! upper bound of bin i in seconds
+    static double upper(size_t i);
+    //! upper bound of the bin containing the 'frac' quantile.  zero if empty.
+    static double quantile(const bins_t& bins, double frac);
+};
+
+//! Time spent by monitor updates inside the gateway
+struct MonitorLatency
+{
+    LatencyHist enqueue; //!< upstream poll() to MonitorUser queue
+    LatencyHist poll;    //!< MonitorUser queue to downstream poll()
+    LatencyHist release; //!< downstream poll() to release()
+
+    //! print non-empty bins
+    void show(std::ostream& strm, const char *indent) const;
+};
+
+/** Free MonitorElements by type, so that subscribers to a PV which come and go
+ *  don't allocate a full PVStructure for each queue slot each time.
+ *  Only MonitorUser queue elements are pooled.  They are returned when
+ *  MonitorUsers are destroyed, and only if no one else holds a reference.
+ *  Array and union values are dropped when returned to the pool.
+ */
+struct ElementPool
+{
+    POINTER_DEFINITIONS(ElementPool);
+
+    epicsMutex lock;
+
+    typedef std::map<epics::pvData::StructureConstPtr, std::vector<epics::pvData::MonitorElementPtr> > free_t;
+    free_t free;
+    size_t nfree;    // total of all free lists
+    size_t maxFree;  // limit of nfree.  set before use
+    size_t nhits, nmisses, ndiscards;
+
+    ElementPool();
+
+    //! A recycled element, or a new one.  With empty changed and overrun masks.
+    epics::pvData::MonitorElementPtr get(const epics::pvData::StructureConstPtr& type);
+    //! Return an element no longer used.  May be NULL.
+    void put(epics::pvData::MonitorElementPtr& elem);
+};
+
 struct MonitorCacheEntry : public epics::pvData::MonitorRequester
 {
     POINTER_DEFINITIONS(MonitorCacheEntry);
@@ -26,8 +96,23 @@ struct MonitorCacheEntry : public epics::pvData::MonitorRequester
     weak_pointer weakref;
 
     ChannelCacheEntry * const chan;
+    //! from ChannelCache::pool.  May outlive the ChannelCache
+    const ElementPool::shared_pointer pool;
 
-    const size_t bufferSize; // DS requested buffer size
+    /** When set, all MonitorUsers queue references to one snapshot of each update,
+     *  which is never modified once queued.  Otherwise each MonitorUser has private copies.
+     */
+    const bool shared;
+    //! When set, stop poll()ing upstream while all started MonitorUsers are full
+    const bool flowcontrol;
+    //! pvRequest selects all fields, so typedesc is the full upstream type
+    const bool fulltype;
+    //! canonical pvRequest.  (see requestCanonical())
+    const epics::pvData::PVStructurePtr request;
+    //! "record" of request, or NULL.  Subscribers with a sub-set of fields must have equal options
+    const epics::pvData::PVStructurePtr recordopts;
+    //! may subscribers selecting a sub-set of our fields attach?  (request has no field options)
+    const bool projectable;
 
     // to avoid yet another mutex borrow interested.mutex() for our members
     inline epicsMutex& mutex() const { return interested.mutex(); }
@@ -38,18 +123,36 @@ struct MonitorCacheEntry : public epics::pvData::MonitorRequester
     bool done;     // set when unlisten() is received
     size_t nwakeups; // # of upstream monitorEvent() calls
     size_t nevents;  // # of upstream events poll()'d
+    size_t npauses;  // # of times upstream poll() was paused by flowcontrol
+    size_t nreconnects; // # of upstream monitorConnect() after reconnect with the same type
+
+    //! flowcontrol has stopped poll()ing pausedmon.  resume() to continue.
+    bool paused;
+    epics::pvData::MonitorPtr pausedmon;
 
     epics::pvData::StructureConstPtr typedesc;
     /** value of upstream monitor (accumulation of all deltas)
      *  changed/overflow bit masks of last delta
      */
     epics::pvData::MonitorElement::shared_pointer lastelem;
+    //! When 'shared', snapshot of lastelem as of the last update
+    epics::pvData::PVStructurePtr lastsnap;
     epics::pvData::MonitorPtr mon;
     epics::pvData::Status startresult;
 
     typedef weak_set<MonitorUser> interested_t;
     interested_t interested;
 
+    //! decimated arrays shared by MonitorUsers with equal slices.  guarded by mutex()
+    typedef std::map<ArraySlice, SliceCache> slices_t;
+    slices_t slices;
+
+    // guarded by ChannelCache::retainLock.  (see ChannelCache::retain())
+    bool retained;
+    std::list<shared_pointer>::iterator retainpos;
+    epicsTime idleSince;
+    std::tr1::shared_ptr<ChannelCacheEntry> retainchan; // keeps 'chan' valid while retained
+
     MonitorCacheEntry(ChannelCacheEntry *ent, const epics::pvData::PVStructure::shared_pointer& pvr);
     virtual ~MonitorCacheEntry();
 
@@ -58,8 +161,21 @@ struct MonitorCacheEntry : public epics::pvData::MonitorRequester
                                 epics::pvData::StructureConstPtr const & structure);
     virtual void monitorEvent(epics::pvData::MonitorPtr const & monitor);
     virtual void unlisten(epics::pvData::MonitorPtr const & monitor);
+    //! with ChannelCache::reconnectHold, subscribers are sent an INVALID alarm
+    virtual void channelDisconnect(bool destroy);
 
     virtual std::string getRequesterName();
+
+    bool allFull();
+    void resume();
+
+    typedef std::vector<std::tr1::shared_ptr<MonitorUser> > dsnotify_t;
+    /** queue lastelem to interested MonitorUsers, or to FanoutPool.  call with mutex() held.
+     *  @param dsnotify MonitorUsers to be notified after unlock
+     */
+    void fanoutUpdate(epicsUInt64 arrival, dsnotify_t& dsnotify);
+    //! call with no locks held
+    static void notifyUsers(const dsnotify_t& dsnotify);
 };
 
 struct MonitorUser : public epics::pvData::Monitor
@@ -74,20 +190,80 @@ struct MonitorUser : public epics::pvData::Monitor
     epics::pvData::MonitorRequester::weak_pointer req;
     std::tr1::weak_ptr<GWChannel> srvchan;
 
-    // guards queues and member variables
+    const size_t bufferSize; // DS requested buffer size
+    //! When attached to an entry with more fields, our canonical pvRequest.  Otherwise NULL.
+    const epics::pvData::PVStructurePtr fieldsel;
+    //! from record._options.arrayStart/arrayCount/arrayStride.  Applied to our copy of each update
+    const ArraySlice slice;
+    //! entry->shared, except with fieldsel or slice where we always copy
+    const bool shared;
+
+    // guarded by mutex()
+    //! type seen by downstream.  entry->typedesc, or a projection of it with fieldsel
+    epics::pvData::StructureConstPtr typedesc;
+    //! with fieldsel, masks of the last update projected to our type
+    epics::pvData::BitSet pchanged, poverrun;
     bool initial;
     bool running;
-    bool inoverflow;
     size_t nwakeups; // # of monitorEvent() calls to req
     size_t nevents;  // total # events queued
     size_t ndropped; // # of events drop because our queue was full
 
-    std::deque<epics::pvData::MonitorElementPtr> filled, empty;
+    /** Guards the ring, and overflow state.  When both are needed, taken after mutex().
+     *  Downstream poll() and release() take only qlock, so they don't contend with
+     *  other subscribers, or with the upstream except while an update is queued to us.
+     */
+    epicsMutex qlock;
+
+    /** Fixed ring of bufferSize elements.  The upstream side fills at 'tail',
+     *  and downstream poll()s from 'head'.  A slot is free once release()'d.
+     *  Filled slots are always [head, head+nfilled).  Slots behind head are in use or free.
+     *  While any slot is free, one is kept at tail (see freeTail()).
+     */
+    struct Slot {
+        epics::pvData::MonitorElementPtr elem;
+        epicsUInt64 stamp; // epicsMonotonicGet() when queued, then when poll()'d
+        enum state_t {Free, Filled, InUse} state;
+        Slot() :stamp(0u), state(Free) {}
+    };
+    typedef std::vector<Slot> ring_t;
+    ring_t ring;
+    size_t head, tail, nfilled, ninuse;
+#ifdef P2P_TRACK_INUSE
+    // debug cross check of release()
     std::set<epics::pvData::MonitorElementPtr> inuse;
+#endif
 
+    bool inoverflow;
     epics::pvData::MonitorElementPtr overflowElement;
-
-    MonitorUser(const MonitorCacheEntry::shared_pointer&);
+    //! with entry->shared, latest snapshot while inoverflow.  (overflowElement only holds masks)
+    epics::pvData::PVStructurePtr overflowSnap;
+    //! arrival of the oldest update accumulated in overflowElement
+    epicsUInt64 overflowArrival;
+
+    // With a FanoutPool.  guarded by mutex()
+    //! true while in a worker queue, which we are at most once.
+    bool fanoutQueued;
+    //! next update for the worker to queue, with masks merged from any before it.  May be NULL
+    epics::pvData::MonitorElementPtr fanoutPending;
+    //! arrival of the oldest update merged into fanoutPending
+    epicsUInt64 fanoutArrival;
+    //! the worker calls notifyUnlisten() after fanoutPending
+    bool fanoutUnlisten;
+
+    // from record._options.maxRate.  Updates are queued at most once per period seconds,
+    // with changes in between accumulated in overflowElement.  period<=0 disables.
+    double period;
+    epicsTime nextsend; // earliest time to queue the next update
+    struct RateTimer;
+    RateTimer *ratenotify; // created on first use
+    epicsTimer *ratetimer;
+    bool timerarmed;
+
+    MonitorUser(const MonitorCacheEntry::shared_pointer&,
+                const epics::pvData::PVStructurePtr& pvRequest,
+                const epics::pvData::PVStructurePtr& fieldsel,
+                const ArraySlice& slice = ArraySlice());
     virtual ~MonitorUser();
 
     virtual void destroy();
@@ -98,6 +274,247 @@ struct MonitorUser : public epics::pvData::Monitor
     virtual void release(epics::pvData::MonitorElementPtr const & monitorElement);
 
     virtual std::string getRequesterName();
+
+    //! set typedesc from entry->typedesc.  call with mutex() held
+    void setType(const epics::pvData::StructureConstPtr& full);
+    bool queueUpdate(const epics::pvData::MonitorElementPtr& update, epicsUInt64 arrival);
+    void pushOverflow();
+    //! tell downstream that no more updates will come.  call with no locks held
+    void notifyUnlisten();
+    //! apply slice to arrays of 'dest' marked in destMask after copying from 'src'.  call with mutex() held
+    void sliceUpdate(epics::pvData::PVStructure& dest, const epics::pvData::PVStructure& src,
+                     const epics::pvData::BitSet* destMask);
+
+    //! The tail slot is free to fill.  call with qlock held
+    inline bool canQueue() const { return !ring.empty() && ring[tail].state==Slot::Free; }
+    //! mark the tail slot filled.  call with qlock held and canQueue()
+    void pushSlot(epicsUInt64 stamp);
+    //! if tail is in use, swap a free slot (if any) into it.  call with qlock held
+    void freeTail();
+    //! count in channel and global histograms
+    void addLatency(LatencyHist MonitorLatency::*stage, epicsUInt64 ns);
+};
+
+/** Worker threads which copy upstream monitor updates into MonitorUser queues,
+ *  and notify downstream, instead of the upstream client RX thread.
+ *  Each MonitorUser is always handled by the same worker to preserve ordering.
+ *  A MonitorUser is queued to its worker at most once (see MonitorUser::fanoutQueued),
+ *  so a queue never holds more entries than there are MonitorUsers.
+ */
+struct FanoutPool
+{
+    struct Worker : public epicsThreadRunable
+    {
+        epicsMutex lock;
+        epicsEvent wakeup;
+        bool running;
+
+        //! MonitorUsers with fanoutQueued set
+        typedef std::deque<MonitorUser::weak_pointer> queue_t;
+        queue_t queue;
+        size_t peak;       // largest queue.size() seen
+        size_t nprocessed; // # of MonitorUsers processed
+
+        epicsThread thread;
+
+        Worker();
+        virtual ~Worker();
+        virtual void run();
+    };
+
+    typedef std::vector<Worker*> workers_t;
+    workers_t workers;
+
+    explicit FanoutPool(unsigned nworkers);
+    ~FanoutPool();
+
+    //! hand an update to usr's worker, or merge into one not yet queued.  call with usr->mutex() held
+    void push(const MonitorUser::shared_pointer& usr, const epics::pvData::MonitorElementPtr& update,
+              epicsUInt64 arrival);
+    //! notifyUnlisten() after any pending update.  call with usr->mutex() held
+    void unlisten(const MonitorUser::shared_pointer& usr);
+private:
+    void schedule(const MonitorUser::shared_pointer& usr);
+
+    FanoutPool(const FanoutPool&);
+    FanoutPool& operator=(const FanoutPool&);
+};
+
+struct GetUser;
+
+/** One upstream ChannelGet, shared by all downstream ChannelGets
+ *  of a Channel with the same pvRequest.
+ *  Downstream get()s which arrive while an upstream get() is in progress
+ *  share its result.
+ */
+struct GetCacheEntry : public epics::pvAccess::ChannelGetRequester
+{
+    POINTER_DEFINITIONS(GetCacheEntry);
+    static size_t num_instances;
+    weak_pointer weakref;
+
+    ChannelCacheEntry * const chan;
+
+    //! pvRequest selects all fields, so may be answered from a monitor
+    const bool fulltype;
+
+    // to avoid yet another mutex borrow interested.mutex() for our members
+    inline epicsMutex& mutex() const { return interested.mutex(); }
+
+    epics::pvAccess::ChannelGet::shared_pointer op; // upstream
+    bool connected; // set after successful channelGetConnect()
+    epics::pvData::Status connectresult;
+    epics::pvData::StructureConstPtr typedesc;
+
+    bool inprog; // upstream get() in progress
+    typedef std::vector<std::tr1::shared_ptr<GetUser> > waiting_t;
+    waiting_t waiting; // downstream get()s waiting for upstream getDone()
+
+    typedef weak_set<GetUser> interested_t;
+    interested_t interested;
+
+    GetCacheEntry(ChannelCacheEntry *ent, const epics::pvData::PVStructure::shared_pointer& pvr);
+    virtual ~GetCacheEntry();
+
+    virtual void channelGetConnect(const epics::pvData::Status& status,
+                                   epics::pvAccess::ChannelGet::shared_pointer const & channelGet,
+                                   epics::pvData::StructureConstPtr const & structure);
+    virtual void getDone(const epics::pvData::Status& status,
+                         epics::pvAccess::ChannelGet::shared_pointer const & channelGet,
+                         epics::pvData::PVStructure::shared_pointer const & pvStructure,
+                         epics::pvData::BitSet::shared_pointer const & bitSet);
+    virtual void channelDisconnect(bool destroy);
+
+    virtual std::string getRequesterName();
+
+    //! current value of a monitor with the same type, or NULL
+    epics::pvData::PVStructurePtr fromMonitor();
+};
+
+struct GetUser : public epics::pvAccess::ChannelGet
+{
+    POINTER_DEFINITIONS(GetUser);
+    static size_t num_instances;
+    weak_pointer weakref;
+
+    inline epicsMutex& mutex() const { return entry->mutex(); }
+
+    GetCacheEntry::shared_pointer entry;
+    epics::pvAccess::ChannelGetRequester::weak_pointer req;
+    std::tr1::weak_ptr<GWChannel> srvchan;
+
+    bool destroyed; // guarded by mutex()
+
+    GetUser(const GetCacheEntry::shared_pointer&);
+    virtual ~GetUser();
+
+    virtual void destroy();
+
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> getChannel();
+    virtual void cancel();
+    virtual void lastRequest();
+    virtual void get();
+};
+
+struct PutUser;
+
+/** One upstream ChannelPut, shared by the downstream ChannelPuts of a Channel
+ *  with the same pvRequest which ask for put coalescing, or which share
+ *  a pooled upstream operation (see ChannelCache::opRetain).
+ *  At most one upstream put() is in progress.  With coalescing, downstream put()s which
+ *  arrive meanwhile are merged into 'nextval', later values replacing earlier, and sent together
+ *  by one put() when it completes.  Otherwise they are queued, and sent one by one in order.
+ *  Each downstream put() gets a putDone() with the result of the upstream put()
+ *  which carried its value.
+ */
+struct PutCacheEntry : public epics::pvAccess::ChannelPutRequester
+{
+    POINTER_DEFINITIONS(PutCacheEntry);
+    static size_t num_instances;
+    weak_pointer weakref;
+
+    ChannelCacheEntry * const chan;
+    const bool coalesce;
+
+    // to avoid yet another mutex borrow interested.mutex() for our members
+    inline epicsMutex& mutex() const { return interested.mutex(); }
+
+    epics::pvAccess::ChannelPut::shared_pointer op; // upstream
+    bool connected; // set after successful channelPutConnect()
+    epics::pvData::Status connectresult;
+    epics::pvData::StructureConstPtr typedesc;
+
+    bool inprog; // upstream put() in progress
+    // value being sent by the upstream put() in progress, and merged value for the next.
+    // only fields marked in the changed mask are meaningful.
+    epics::pvData::PVStructurePtr sendval, nextval;
+    epics::pvData::BitSet::shared_pointer sendchanged, nextchanged;
+    typedef std::vector<std::tr1::shared_ptr<PutUser> > waiting_t;
+    waiting_t sending; // downstream put()s carried by the upstream put() in progress
+    waiting_t waiting; // downstream put()s merged into nextval
+
+    // without coalescing, downstream put()s waiting to be sent, with a copy of their values
+    struct Queued {
+        std::tr1::shared_ptr<PutUser> user;
+        epics::pvData::PVStructurePtr value;
+        epics::pvData::BitSet::shared_pointer changed;
+    };
+    typedef std::deque<Queued> queue_t;
+    queue_t queue;
+    //! is a put() waiting to be sent?  call with mutex() held
+    inline bool havenext() const { return coalesce ? !waiting.empty() : !queue.empty(); }
+
+    bool getinprog; // upstream get() in progress
+    waiting_t getting; // downstream get()s waiting for upstream getDone()
+
+    typedef weak_set<PutUser> interested_t;
+    interested_t interested;
+
+    PutCacheEntry(ChannelCacheEntry *ent, bool coalesce);
+    virtual ~PutCacheEntry();
+
+    //! start the next upstream put().  call with mutex() held, as G, !inprog, and havenext()
+    void sendNext(epicsGuard<epicsMutex>& G);
+
+    virtual void channelPutConnect(const epics::pvData::Status& status,
+                                   epics::pvAccess::ChannelPut::shared_pointer const & channelPut,
+                                   epics::pvData::StructureConstPtr const & structure);
+    virtual void putDone(const epics::pvData::Status& status,
+                         epics::pvAccess::ChannelPut::shared_pointer const & channelPut);
+    virtual void getDone(const epics::pvData::Status& status,
+                         epics::pvAccess::ChannelPut::shared_pointer const & channelPut,
+                         epics::pvData::PVStructure::shared_pointer const & pvStructure,
+                         epics::pvData::BitSet::shared_pointer const & bitSet);
+    virtual void channelDisconnect(bool destroy);
+
+    virtual std::string getRequesterName();
+};
+
+struct PutUser : public epics::pvAccess::ChannelPut
+{
+    POINTER_DEFINITIONS(PutUser);
+    static size_t num_instances;
+    weak_pointer weakref;
+
+    inline epicsMutex& mutex() const { return entry->mutex(); }
+
+    PutCacheEntry::shared_pointer entry;
+    epics::pvAccess::ChannelPutRequester::weak_pointer req;
+    std::tr1::weak_ptr<GWChannel> srvchan;
+
+    bool destroyed; // guarded by mutex()
+
+    PutUser(const PutCacheEntry::shared_pointer&);
+    virtual ~PutUser();
+
+    virtual void destroy();
+
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> getChannel();
+    virtual void cancel();
+    virtual void lastRequest();
+    virtual void put(epics::pvData::PVStructure::shared_pointer const & pvPutStructure,
+                     epics::pvData::BitSet::shared_pointer const & putBitSet);
+    virtual void get();
 };
 
 struct ChannelCacheEntry
@@ -111,11 +528,21 @@ struct ChannelCacheEntry
     // to avoid yet another mutex borrow interested.mutex() for our members
     inline epicsMutex& mutex() const { return interested.mutex(); }
 
-    // clientChannel
+    /** clientChannel.  guarded by mutex().  NULL while lookup(name, true) has queued its
+     *  creation to the Creator, then never changed.  Use upstream() unless mutex() is held.
+     */
     epics::pvAccess::Channel::shared_pointer channel;
+    //! copy of 'channel', which may be NULL
+    epics::pvAccess::Channel::shared_pointer upstream() const;
     epics::pvAccess::ChannelRequester::shared_pointer requester;
 
-    bool dropPoke;
+    const epicsTime created;
+    // guarded by shard lock.  position in Shard::lru, and time of last lookup()
+    std::list<ChannelCacheEntry*>::iterator lrupos;
+    epicsTime lastused;
+    // guarded by shard lock.  upstream disconnected, but kept for up to ChannelCache::reconnectHold
+    bool held;
+    epicsTime disconnected;
 
     typedef weak_set<GWChannel> interested_t;
     interested_t interested;
@@ -124,6 +551,64 @@ struct ChannelCacheEntry
     typedef weak_value_map<pvrequest_t, MonitorCacheEntry> mon_entries_t;
     mon_entries_t mon_entries;
 
+    typedef weak_value_map<pvrequest_t, GetCacheEntry> get_entries_t;
+    get_entries_t get_entries;
+
+    typedef weak_value_map<pvrequest_t, PutCacheEntry> put_entries_t;
+    put_entries_t put_entries;
+    // atomic.  upstream put()s by PutCacheEntry, and downstream put()s merged into another
+    size_t putUpstream, putCoalesced;
+
+    // GetCacheEntry and PutCacheEntry no longer used by any downstream operation,
+    // kept for re-use for ChannelCache::opRetain seconds.  guarded by mutex()
+    struct IdleOp {
+        std::tr1::shared_ptr<void> op;
+        epicsTime expire;
+    };
+    typedef std::map<void*, IdleOp> idleops_t;
+    idleops_t idleops;
+    bool idlequeued; // guarded by shard lock.  listed in Shard::idle
+
+    //! keep an upstream operation for re-use.  call with no locks held
+    void retainOp(const std::tr1::shared_ptr<void>& op);
+    /** remove expired idleops into 'expired'.  call with mutex() held
+     *  @returns true, with 'next' set to the earliest remaining expiry, if any idleops remain.
+     */
+    bool expireOps(const epicsTime& now, std::vector<std::tr1::shared_ptr<void> >& expired, epicsTime& next);
+
+    // searches which arrived before the upstream channel connected.
+    // answered when it does, or when they expire.
+    struct PendingSearch {
+        epics::pvAccess::ChannelFindRequester::shared_pointer requester;
+        epics::pvAccess::ChannelFind::weak_pointer find;
+        epicsTime expire;
+    };
+    typedef std::vector<PendingSearch> pending_t;
+    pending_t pending; // guarded by mutex()
+
+    // cache of upstream getField() results by sub-field.  guarded by mutex()
+    // cleared on disconnect, or when a monitor sees a different type.
+    typedef std::map<std::string, epics::pvData::FieldConstPtr> fields_t;
+    fields_t fields;
+    size_t fieldsgen; // incremented when 'fields' is cleared
+    void clearFields(); // call with mutex() held
+
+    //! pass upstream connection state to downstream channels.  call with no locks held
+    void notifyState(epics::pvAccess::Channel::ConnectionState state);
+
+    /** Create a MonitorCacheEntry for a canonical pvRequest, and its upstream monitor.
+     *  Call with mutex() held, as G, which is unlocked to create the upstream monitor.
+     */
+    MonitorCacheEntry::shared_pointer addMonitor(epicsGuard<epicsMutex>& G,
+                                                 const epics::pvData::PVStructurePtr& request,
+                                                 const pvrequest_t& ser);
+
+    //! of monitor updates for this channel
+    MonitorLatency latency;
+
+    //! remove expired PendingSearch into 'expired'.  call with mutex() held
+    void expirePending(const epicsTime& now, pending_t& expired);
+
     ChannelCacheEntry(ChannelCache*, const std::string& n);
     virtual ~ChannelCacheEntry();
 
@@ -147,29 +632,271 @@ struct ChannelCacheEntry
 };
 
 /** Holds the set of channels the GW is searching for, or has found.
+ *
+ * Entries are spread over NShards independently locked maps by a hash of
+ * the channel name.  Searches for unrelated names don't contend,
+ * and the cleaner only ever holds one shard lock at a time.
  */
 struct ChannelCache
 {
     typedef std::map<std::string, ChannelCacheEntry::shared_pointer > entries_t;
 
-    // cacheLock should not be held while calling *Requester methods
-    epicsMutex cacheLock;
+    // names which were searched for, but never connected, and when to forget them
+    typedef std::map<std::string, epicsTime> negative_t;
+    typedef std::deque<std::pair<std::string, epicsTime> > negative_order_t;
+
+    // entries, and when the cleaner should next look at each.  earliest first
+    typedef std::deque<std::pair<ChannelCacheEntry::weak_pointer, epicsTime> > deadlines_t;
+
+    struct Shard {
+        // lock should not be held while calling *Requester methods
+        epicsMutex lock;
+        entries_t entries;
+        // all of 'entries', most recently used first
+        typedef std::list<ChannelCacheEntry*> lru_t;
+        lru_t lru;
+        // entries with held searches, and when each search expires
+        deadlines_t deferred;
+        // entries which have been held through an upstream disconnect, and when it happened
+        deadlines_t held;
+        // entries which have idle get/put operations, and when the earliest might expire
+        deadlines_t idle;
+        negative_t negative;
+        negative_order_t negative_order; // oldest first
+
+        // call with lock held
+        void add(const ChannelCacheEntry::shared_pointer& ent, const epicsTime& now);
+        void remove(entries_t::iterator it);
+        //! remove 'ent' if it is still the entry for its name
+        void remove(const ChannelCacheEntry::shared_pointer& ent);
+        void touch(ChannelCacheEntry& ent, const epicsTime& now);
+    };
+
+    enum {NShards = 64};
+    Shard shards[NShards];
 
-    entries_t entries;
+    inline Shard& shardFor(const std::string& name) {
+        return shards[epicsStrHash(name.c_str(), 0)%NShards];
+    }
 
     epics::pvAccess::ChannelProvider::shared_pointer provider; // client Provider
 
+    /** All independent client contexts, each with its own connections and receive threads.
+     *  contexts[0]==provider.  Each upstream channel is created through the context chosen
+     *  by a jump consistent hash of its name, so adding contexts moves as few names as possible.
+     *  set before use.
+     */
+    typedef std::vector<epics::pvAccess::ChannelProvider::shared_pointer> contexts_t;
+    contexts_t contexts;
+
+    const epics::pvAccess::ChannelProvider::shared_pointer& providerFor(const std::string& name) const;
+
     epicsTimerQueueActive *timerQueue;
     epicsTimer *cleanTimer;
     struct cacheClean;
     cacheClean *cleaner;
-    size_t cleanerRuns;
-    size_t cleanerDust;
+    size_t cleanerRuns; // atomic
+
+    // Entries not used by any downstream channel are removed when not
+    // looked up for cacheTTL seconds, or least recently used first
+    // when there are more than cacheMax entries (zero for no limit).
+    // The cleaner runs each cleanInterval seconds, and examines at most
+    // cleanBudget entries of each shard.  set before use.
+    double cacheTTL;
+    size_t cacheMax;
+    double cleanInterval;
+    size_t cleanBudget;
+    size_t evictIdle, evictSize; // atomic
+
+    // Negative search cache configuration, set before use.
+    // names which remain NEVER_CONNECTED for longer than negativeDelay seconds
+    // are remembered for negativeTTL seconds, during which searches for them
+    // are answered w/o any upstream action.  negativeTTL<=0 disables.
+    double negativeDelay;
+    double negativeTTL;
+    size_t negativeMax; // limit on number of names remembered (over all shards)
+    size_t negativeHits; // atomic
+
+    // Searches for names not yet connected are held for up to deferTimeout seconds
+    // and answered as soon as the upstream channel connects.  deferTimeout<=0 disables.
+    double deferTimeout;
+    size_t deferMax;     // limit on searches held per name
+    size_t deferReplies; // atomic. # of held searches answered positively
+
+    size_t fieldHits, fieldMisses; // atomic.  getField() answered from ChannelCacheEntry::fields, or forwarded upstream
+    // atomic.  downstream get()s answered by: a new upstream get(), one already in progress, or from a monitor
+    size_t getUpstream, getCoalesced, getMonitor;
+    // atomic.  totals of ChannelCacheEntry::putUpstream and putCoalesced
+    size_t putUpstream, putCoalesced;
+    /** Seconds to keep an upstream get or put operation after its last downstream user goes away.
+     *  A new downstream operation with an equivalent pvRequest then re-uses it without an
+     *  upstream round trip.  When >0, puts which are not coalesced also share upstream operations,
+     *  and are sent one at a time, unless "record[passthrough=true]".  <=0 disables.  set before use.
+     */
+    double opRetain;
+    size_t opReused; // atomic.  downstream gets and puts which found an upstream operation
+    //! glob patterns of channel names whose puts are coalesced by default.  set before use
+    std::vector<std::string> putCoalesce;
+    bool coalescePut(const std::string& name) const;
+    size_t monProjected; // atomic.  downstream monitors attached to an upstream monitor with more fields
+    size_t monSliced; // atomic.  downstream monitors with an array slice
+
+    //! of monitor updates for all channels
+    MonitorLatency latency;
+
+    //! for MonitorUsers which don't use sharedSnapshots
+    const ElementPool::shared_pointer pool;
+
+    // MonitorCacheEntry::shared for new upstream monitors
+    bool sharedSnapshots;
+    // MonitorCacheEntry::flowcontrol for new upstream monitors
+    bool flowControl;
+
+    /** When an upstream channel disconnects, keep its entry, downstream channels and monitors
+     *  for up to reconnectHold seconds.  Downstream is told of the disconnect only if it lasts longer.
+     *  Upstream monitors are re-subscribed by the client on reconnect, and continue
+     *  unless the type has changed.  reconnectHold<=0 disables.  set before use.
+     */
+    double reconnectHold;
+    size_t reconnectHeld, reconnectResumed, reconnectExpired, reconnectRetyped; // atomic
+
+    /** Upstream monitors are kept for monitorRetain seconds after their last subscriber
+     *  goes away, so that a new subscriber is sent the last value without waiting on upstream.
+     *  At most monitorRetainMax are kept, dropping the least recently used first.
+     *  monitorRetain<=0 disables.  set before use.
+     */
+    double monitorRetain;
+    size_t monitorRetainMax;
+    epicsMutex retainLock;
+    typedef std::list<MonitorCacheEntry::shared_pointer> retained_t;
+    // guarded by retainLock
+    retained_t retained; // most recently idle first
+    size_t nretained;    // retained.size()
+    size_t retainHits, retainExpired, retainEvicted;
+
+    /** When warmFile is set, the names of connected channels which are in use, and with warmMonitors
+     *  the pvRequests of their upstream monitors, are written to warmFile each warmPeriod seconds.
+     *  A restarted gateway re-creates these with loadWarm() before starting its servers.
+     *  set before startWarm().
+     */
+    std::string warmFile;
+    double warmPeriod;
+    double warmTimeout; // seconds to wait for loadWarm() connections before starting servers
+    bool warmMonitors;
+    struct warmSave;
+    warmSave *warmer;
+    epicsTimer *warmTimer;
+    size_t warmSaves; // atomic.  # of times warmFile was written
+
+    // when not NULL, monitor updates are copied to subscribers by these workers.
+    // set before use.
+    FanoutPool *fanout;
+
+    /** Creates upstream channels on behalf of lookup() so that the
+     *  (UDP) search thread never waits on the upstream client.
+     *  FIFO, bounded by maxDepth.  Names are de-duplicated as
+     *  an entry already in the cache is never queued twice.
+     */
+    struct Creator : public epicsThreadRunable
+    {
+        ChannelCache * const cache;
+
+        epicsMutex lock;
+        epicsEvent wakeup;
+        bool running;
+
+        typedef std::deque<std::pair<ChannelCacheEntry::weak_pointer, epicsTime> > queue_t;
+        queue_t queue;
+
+        size_t maxDepth;   // limit on queue.size()
+        size_t peakDepth;  // largest queue.size() seen
+        size_t ncreated;   // # of upstream createChannel() calls
+        size_t nrejected;  // # of names not queued as the queue was full
+        double totalLatency, maxLatency; // seconds from queued to created
+
+        epicsThread worker;
+
+        Creator(ChannelCache *cache);
+        virtual ~Creator();
+
+        //! queue creation of upstream channel.  call with shard lock held.
+        //! @returns false if the queue is full
+        bool add(const ChannelCacheEntry::shared_pointer& ent);
+        void close();
+
+        virtual void run();
+    };
+    Creator creator;
 
     ChannelCache(const epics::pvAccess::ChannelProvider::shared_pointer& prov);
     ~ChannelCache();
 
-    ChannelCacheEntry::shared_pointer lookup(const std::string& name);
+    /** Find, or begin searching for, a channel.
+     *
+     * @param name channel name
+     * @param async When false, a new upstream channel is created before returning.
+     *              When true, creation is queued to creator, and a new name is
+     *              never reported as connected.
+     * @returns connected cache entry, or NULL if not (yet) connected.
+     */
+    ChannelCacheEntry::shared_pointer lookup(const std::string& name, bool async=false);
+
+    enum defer_t {
+        NotDeferred, // no entry for this name (or deferral disabled).  reply now
+        Deferred,    // requester will be answered later
+        Connected,   // upstream has connected since lookup().  reply found now
+    };
+    //! Hold a search for a name which lookup() reported as not connected
+    defer_t deferSearch(const std::string& name,
+                        const epics::pvAccess::ChannelFindRequester::shared_pointer& requester,
+                        const epics::pvAccess::ChannelFind::shared_pointer& find);
+    //! answer any held searches for 'ent' which have expired
+    static void replyExpired(ChannelCacheEntry::pending_t& expired);
+
+    //! Find an existing entry w/o side-effects (no upstream search, not marked as used)
+    ChannelCacheEntry::shared_pointer find(const std::string& name);
+    //! Remove from cache.
+    //! @returns the removed entry, which the caller should release with no locks held
+    ChannelCacheEntry::shared_pointer erase(const std::string& name);
+    //! Remove 'ent', if still cached, and tell downstream channels it is disconnected.  call with no locks held
+    void teardown(ChannelCacheEntry *ent);
+    //! total number of entries at this moment
+    size_t size();
+    //! total number of names in the negative search cache at this moment
+    size_t negativeSize();
+    //! copy of all entries at this moment
+    void snapshot(entries_t& entries);
+
+    /** keep 'ment', which no longer has any subscribers.  call with no locks held
+     *  @param warm when true, keep even if no update has been received.  (see loadWarm())
+     */
+    void retain(const MonitorCacheEntry::shared_pointer& ment, bool warm=false);
+    //! 'ment' has a new subscriber.  call with no locks held
+    void unretain(const MonitorCacheEntry::shared_pointer& ment);
+    //! drop retained monitors idle for longer than monitorRetain.  call with no locks held
+    void expireRetained(const epicsTime& now);
+
+    //! begin periodically writing warmFile
+    void startWarm();
+    //! write names and pvRequests of channels in use, in the format read by loadWarm()
+    void saveWarm(std::ostream& strm);
+
+    //! channels and monitors created by loadWarm()
+    struct WarmProgress {
+        std::vector<ChannelCacheEntry::shared_pointer> chans;
+        std::vector<MonitorCacheEntry::shared_pointer> mons;
+        size_t nerrors; // # of lines ignored
+        WarmProgress() :nerrors(0u) {}
+        //! count connected chans, and mons which have received an update
+        void count(size_t& nconnected, size_t& nhavedata) const;
+    };
+    /** Create the upstream channels listed by saveWarm(), and their monitors if monitorRetain>0.
+     *  Monitors are then retain()ed.  Returns immediately, check progress to wait for connections.
+     */
+    void loadWarm(std::istream& strm, WarmProgress& progress);
+
+    void addNegative(Shard& shard, const std::string& name);
+    void expireNegative(Shard& shard, const epicsTime& now);
 };
 
 #endif // CHANCACHE_H
@@ -14,6 +14,7 @@
 #include "helper.h"
 #include "pva2pva.h"
 #include "channel.h"
+#include "pvrequest.h"
 
 namespace pva = epics::pvAccess;
 namespace pvd = epics::pvData;
@@ -22,6 +23,41 @@ int p2pReadOnly = 0;
 
 size_t GWChannel::num_instances;
 
+namespace {
+// populates ChannelCacheEntry::fields with the upstream reply
+struct FieldCacheRequester : public pva::GetFieldRequester
+{
+    POINTER_DEFINITIONS(FieldCacheRequester);
+
+    const ChannelCacheEntry::weak_pointer entry;
+    const pva::GetFieldRequester::shared_pointer requester;
+    const std::string subField;
+    const size_t generation;
+
+    FieldCacheRequester(const ChannelCacheEntry::shared_pointer& entry,
+                        const pva::GetFieldRequester::shared_pointer& requester,
+                        const std::string& subField,
+                        size_t generation)
+        :entry(entry), requester(requester), subField(subField), generation(generation)
+    {}
+    virtual ~FieldCacheRequester() {}
+
+    virtual std::string getRequesterName() { return requester->getRequesterName(); }
+
+    virtual void getDone(const pvd::Status& status, pvd::FieldConstPtr const & field)
+    {
+        ChannelCacheEntry::shared_pointer E(entry.lock());
+        if(E && status.isSuccess() && field) {
+            Guard G(E->mutex());
+            if(E->fieldsgen==generation) // not invalidated while in progress
+                E->fields[subField] = field;
+        }
+        requester->getDone(status, field);
+    }
+};
+
+} // namespace
+
 GWChannel::GWChannel(const ChannelCacheEntry::shared_pointer& e,
                      const epics::pvAccess::ChannelProvider::weak_pointer& srvprov,
                      const epics::pvAccess::ChannelRequester::weak_pointer &r,
@@ -59,13 +95,13 @@ std::string
 GWChannel::getRemoteAddress()
 {
     // pass through address of origin server (information leak?)
-    return entry->channel->getRemoteAddress();
+    return entry->upstream()->getRemoteAddress();
 }
 
 pva::Channel::ConnectionState
 GWChannel::getConnectionState()
 {
-    return entry->channel->getConnectionState();
+    return entry->upstream()->getConnectionState();
 }
 
 std::string
@@ -85,14 +121,30 @@ void
 GWChannel::getField(pva::GetFieldRequester::shared_pointer const & requester,
                             std::string const & subField)
 {
-    //TODO: cache for top level field?
-    entry->channel->getField(requester, subField);
+    pvd::FieldConstPtr field;
+    size_t generation;
+    {
+        Guard G(entry->mutex());
+        ChannelCacheEntry::fields_t::const_iterator it(entry->fields.find(subField));
+        if(it!=entry->fields.end())
+            field = it->second;
+        generation = entry->fieldsgen;
+    }
+
+    if(field) {
+        epicsAtomicIncrSizeT(&entry->cache->fieldHits);
+        requester->getDone(pvd::Status::Ok, field);
+    } else {
+        epicsAtomicIncrSizeT(&entry->cache->fieldMisses);
+        pva::GetFieldRequester::shared_pointer wrapper(new FieldCacheRequester(entry, requester, subField, generation));
+        entry->upstream()->getField(wrapper, subField);
+    }
 }
 
 pva::AccessRights
 GWChannel::getAccessRights(pvd::PVField::shared_pointer const & pvField)
 {
-    return entry->channel->getAccessRights(pvField);
+    return entry->upstream()->getAccessRights(pvField);
 }
 
 pva::ChannelProcess::shared_pointer
@@ -101,7 +153,7 @@ GWChannel::createChannelProcess(
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
     if(!p2pReadOnly)
-        return entry->channel->createChannelProcess(channelProcessRequester, pvRequest);
+        return entry->upstream()->createChannelProcess(channelProcessRequester, pvRequest);
     else
         return Channel::createChannelProcess(channelProcessRequester, pvRequest);
 }
@@ -111,7 +163,75 @@ GWChannel::createChannelGet(
         pva::ChannelGetRequester::shared_pointer const & channelGetRequester,
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
-    return entry->channel->createChannelGet(channelGetRequester, pvRequest);
+    // "record._options.passthrough=true" bypasses the cache.  So do other record options,
+    // eg. "process", as each get() must then reach upstream.
+    if(requestOption(pvRequest, "passthrough", false) || requestRecordOptions(pvRequest, "passthrough"))
+        return entry->upstream()->createChannelGet(channelGetRequester, pvRequest);
+
+    ChannelCacheEntry::pvrequest_t ser;
+    // serialize canonical request struct to string using host byte order (only used for local comparison)
+    // so that equivalent requests from different clients share
+    pvd::serializeToVector(requestCanonical(pvRequest).get(), EPICS_BYTE_ORDER, ser);
+
+    GetCacheEntry::shared_pointer gent;
+    GetUser::shared_pointer op;
+
+    bool connected;
+    pvd::Status connectresult;
+    pvd::StructureConstPtr typedesc;
+
+    try {
+        {
+            Guard G(entry->mutex());
+
+            gent = entry->get_entries.find(ser);
+            if(!gent) {
+                gent.reset(new GetCacheEntry(entry.get(), pvRequest));
+                entry->get_entries[ser] = gent; // ref. wrapped
+                gent->weakref = gent;
+
+                // as with MonitorCacheEntry, this entry is incomplete until channelGetConnect()
+                pva::ChannelGet::shared_pointer upstream;
+                {
+                    UnGuard U(G);
+
+                    upstream = entry->upstream()->createChannelGet(gent, pvRequest);
+                }
+                Guard G2(gent->mutex());
+                gent->op = upstream;
+            } else {
+                epicsAtomicIncrSizeT(&entry->cache->opReused);
+            }
+        }
+
+        Guard G(gent->mutex());
+
+        op.reset(new GetUser(gent));
+        gent->interested.insert(op);
+        op->weakref = op;
+        op->srvchan = shared_pointer(weakref);
+        op->req = channelGetRequester;
+
+        connected = gent->connected;
+        connectresult = gent->connectresult;
+        typedesc = gent->typedesc;
+
+    } catch(std::exception& e) {
+        op.reset();
+        std::cerr<<"Exception in GWChannel::createChannelGet()\n"
+                   "is "<<e.what()<<"\n";
+        connected = false;
+        connectresult = pvd::Status(pvd::Status::STATUSTYPE_FATAL, "Error during GWChannel setup");
+    }
+
+    // unlock for callback
+
+    if(connected || !connectresult.isSuccess()) {
+        // upstream get already connected, or never will be.
+        channelGetRequester->channelGetConnect(connectresult, op, typedesc);
+    }
+
+    return op;
 }
 
 pva::ChannelPut::shared_pointer
@@ -119,11 +239,79 @@ GWChannel::createChannelPut(
         pva::ChannelPutRequester::shared_pointer const & channelPutRequester,
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
-    //TODO: allow ChannelPut::get()
-    if(!p2pReadOnly)
-        return entry->channel->createChannelPut(channelPutRequester, pvRequest);
-    else
+    if(p2pReadOnly)
         return Channel::createChannelPut(channelPutRequester, pvRequest);
+
+    // "record._options.coalesce=true", or a name matching the client "putcoalesce" patterns.
+    // otherwise each put() goes upstream, through a shared operation if opRetain is set.
+    bool coalesce = requestOption(pvRequest, "coalesce", entry->cache->coalescePut(entry->channelName));
+    if(!coalesce && (entry->cache->opRetain<=0.0 || requestOption(pvRequest, "passthrough", false)))
+        return entry->upstream()->createChannelPut(channelPutRequester, pvRequest);
+
+    ChannelCacheEntry::pvrequest_t ser;
+    // serialize canonical request struct to string using host byte order (only used for local comparison)
+    pvd::serializeToVector(requestCanonical(pvRequest).get(), EPICS_BYTE_ORDER, ser);
+    ser.push_back(coalesce ? 'C' : 'S'); // coalescing and queuing entries are never shared
+
+    PutCacheEntry::shared_pointer pent;
+    PutUser::shared_pointer op;
+
+    bool connected;
+    pvd::Status connectresult;
+    pvd::StructureConstPtr typedesc;
+
+    try {
+        {
+            Guard G(entry->mutex());
+
+            pent = entry->put_entries.find(ser);
+            if(!pent) {
+                pent.reset(new PutCacheEntry(entry.get(), coalesce));
+                entry->put_entries[ser] = pent; // ref. wrapped
+                pent->weakref = pent;
+
+                // as with GetCacheEntry, this entry is incomplete until channelPutConnect()
+                pva::ChannelPut::shared_pointer upstream;
+                {
+                    UnGuard U(G);
+
+                    upstream = entry->upstream()->createChannelPut(pent, pvRequest);
+                }
+                Guard G2(pent->mutex());
+                pent->op = upstream;
+            } else {
+                epicsAtomicIncrSizeT(&entry->cache->opReused);
+            }
+        }
+
+        Guard G(pent->mutex());
+
+        op.reset(new PutUser(pent));
+        pent->interested.insert(op);
+        op->weakref = op;
+        op->srvchan = shared_pointer(weakref);
+        op->req = channelPutRequester;
+
+        connected = pent->connected;
+        connectresult = pent->connectresult;
+        typedesc = pent->typedesc;
+
+    } catch(std::exception& e) {
+        op.reset();
+        std::cerr<<"Exception in GWChannel::createChannelPut()\n"
+                   "is "<<e.what()<<"\n";
+        connected = false;
+        connectresult = pvd::Status(pvd::Status::STATUSTYPE_FATAL, "Error during GWChannel setup");
+    }
+
+    // unlock for callback
+
+    if(connected || !connectresult.isSuccess()) {
+        // upstream put already connected, or never will be.
+        channelPutRequester->channelPutConnect(connectresult, op, typedesc);
+    }
+
+    return op;
 }
 
 pva::ChannelPutGet::shared_pointer
@@ -132,7 +320,7 @@ GWChannel::createChannelPutGet(
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
     if(!p2pReadOnly)
-        return entry->channel->createChannelPutGet(channelPutGetRequester, pvRequest);
+        return entry->upstream()->createChannelPutGet(channelPutGetRequester, pvRequest);
     else
         return Channel::createChannelPutGet(channelPutGetRequester, pvRequest);
 }
@@ -143,7 +331,7 @@ GWChannel::createChannelRPC(
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
     if(!p2pReadOnly)
-        return entry->channel->createChannelRPC(channelRPCRequester, pvRequest);
+        return entry->upstream()->createChannelRPC(channelRPCRequester, pvRequest);
     else
         return Channel::createChannelRPC(channelRPCRequester, pvRequest);
 }
@@ -159,9 +347,27 @@ GWChannel::createMonitor(
         pvd::MonitorRequester::shared_pointer const & monitorRequester,
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
+    // maxRate, queueSize, and array slices are applied to each MonitorUser, so subscribers with
+    // different options may share one upstream monitor.  pipeline is our choice (see flowcontrol).
+    double maxRate = requestOption(pvRequest, "maxRate", 0.0);
+    const ArraySlice slice(requestSlice(pvRequest));
+    pvd::PVStructurePtr request(requestRemoveOption(pvRequest, "maxRate"));
+    request = requestRemoveOption(request, "queueSize");
+    request = requestRemoveOption(request, "pipeline");
+    request = requestRemoveOption(request, "arrayStart");
+    request = requestRemoveOption(request, "arrayCount");
+    request = requestRemoveOption(request, "arrayStride");
+    request = requestCanonical(request);
+
     ChannelCacheEntry::pvrequest_t ser;
     // serialize request struct to string using host byte order (only used for local comparison)
-    pvd::serializeToVector(pvRequest.get(), EPICS_BYTE_ORDER, ser);
+    pvd::serializeToVector(request.get(), EPICS_BYTE_ORDER, ser);
+
+    const bool projectable = !requestFieldOptions(request);
+    pvd::PVStructurePtr fieldsel; // set when attaching to an entry with more fields
+
+    // candidates for sharing.  free'd after unlock
+    ChannelCacheEntry::mon_entries_t::lock_vector_type others;
 
     MonitorCacheEntry::shared_pointer ment;
     MonitorUser::shared_pointer mon;
@@ -176,34 +382,43 @@ GWChannel::createMonitor(
             // TODO: no-cache/no-share flag in pvRequest
 
             ment = entry->mon_entries.find(ser);
-            if(!ment) {
-                ment.reset(new MonitorCacheEntry(entry.get(), pvRequest));
-                entry->mon_entries[ser] = ment; // ref. wrapped
-                ment->weakref = ment;
-
-                // We've added an incomplete entry (no Monitor)
-                // so MonitorUser must check validity before de-ref.
-                // in this case we use !!typedesc as this also indicates
-                // that the upstream monitor is connected
-                pvd::MonitorPtr M;
-                {
-                    UnGuard U(G);
-
-                    M = entry->channel->createMonitor(ment, pvRequest);
+            if(!ment && projectable) {
+                // look for an entry with the same options, selecting at least our fields
+                others = entry->mon_entries.lock_vector();
+                FOREACH(ChannelCacheEntry::mon_entries_t::lock_vector_type::const_iterator, it, end, others) {
+                    const MonitorCacheEntry::shared_pointer& other = it->second;
+                    if(!other->projectable)
+                        continue;
+                    pvd::PVStructurePtr reqopts(request->getSubField<pvd::PVStructure>("record"));
+                    if(!other->recordopts != !reqopts || (reqopts && *other->recordopts != *reqopts))
+                        continue;
+                    if(!requestCovers(other->request, request))
+                        continue;
+                    ment = other;
+                    fieldsel = request;
+                    epicsAtomicIncrSizeT(&entry->cache->monProjected);
+                    break;
                 }
-                ment->mon = M;
             }
+            if(!ment)
+                ment = entry->addMonitor(G, request, ser);
         }
 
         Guard G(ment->mutex());
 
-        mon.reset(new MonitorUser(ment));
+        mon.reset(new MonitorUser(ment, pvRequest, fieldsel, slice));
         ment->interested.insert(mon);
         mon->weakref = mon;
         mon->srvchan = shared_pointer(weakref);
         mon->req = monitorRequester;
-
-        typedesc = ment->typedesc;
+        if(maxRate>0.0)
+            mon->period = 1.0/maxRate;
+        if(slice.active())
+            epicsAtomicIncrSizeT(&entry->cache->monSliced);
+
+        if(ment->typedesc)
+            mon->setType(ment->typedesc);
+        typedesc = mon->typedesc;
         startresult = ment->startresult;
 
     } catch(std::exception& e) {
@@ -215,6 +430,9 @@ GWChannel::createMonitor(
 
     // unlock for callback
 
+    if(mon)
+        entry->cache->unretain(ment);
+
     if(typedesc || !startresult.isSuccess()) {
         // upstream monitor already connected, or never will be.
         monitorRequester->monitorConnect(startresult, mon, typedesc);
@@ -228,7 +446,7 @@ GWChannel::createChannelArray(
         pva::ChannelArrayRequester::shared_pointer const & channelArrayRequester,
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
-    return entry->channel->createChannelArray(channelArrayRequester, pvRequest);
+    return entry->upstream()->createChannelArray(channelArrayRequester, pvRequest);
 }
 
 
@@ -0,0 +1,271 @@
+#include <epicsAtomic.h>
+#include <errlog.h>
+
+#include <epicsMutex.h>
+
+#include <pv/pvAccess.h>
+
+#define epicsExportSharedSymbols
+#include "helper.h"
+#include "pva2pva.h"
+#include "chancache.h"
+#include "pvrequest.h"
+#include "channel.h"
+
+namespace pva = epics::pvAccess;
+namespace pvd = epics::pvData;
+
+size_t GetCacheEntry::num_instances;
+size_t GetUser::num_instances;
+
+GetCacheEntry::GetCacheEntry(ChannelCacheEntry *ent, const pvd::PVStructure::shared_pointer& pvr)
+    :chan(ent)
+    ,fulltype(requestSelectsAll(pvr))
+    ,connected(false)
+    ,inprog(false)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+GetCacheEntry::~GetCacheEntry()
+{
+    pva::ChannelGet::shared_pointer G;
+    G.swap(op);
+    if(G) {
+        G->destroy();
+    }
+    epicsAtomicDecrSizeT(&num_instances);
+    const_cast<ChannelCacheEntry*&>(chan) = NULL; // spoil to fault use after free
+}
+
+void
+GetCacheEntry::channelGetConnect(const pvd::Status& status,
+                                 pva::ChannelGet::shared_pointer const & channelGet,
+                                 pvd::StructureConstPtr const & structure)
+{
+    interested_t::vector_type tonotify;
+    {
+        Guard G(mutex());
+        if(!op)
+            op = channelGet; // connect during upstream createChannelGet()
+        connected = status.isSuccess();
+        connectresult = status;
+        typedesc = structure;
+
+        tonotify = interested.lock_vector();
+    }
+
+    shared_pointer self(weakref); // keeps us alive all GetUsers are destroy()ed
+
+    FOREACH(interested_t::vector_type::const_iterator, it, end, tonotify)
+    {
+        pva::ChannelGetRequester::shared_pointer req((*it)->req.lock());
+        if(req) {
+            req->channelGetConnect(status, *it, structure);
+        }
+    }
+}
+
+void
+GetCacheEntry::getDone(const pvd::Status& status,
+                       pva::ChannelGet::shared_pointer const & channelGet,
+                       pvd::PVStructure::shared_pointer const & pvStructure,
+                       pvd::BitSet::shared_pointer const & bitSet)
+{
+    waiting_t waiting;
+    {
+        Guard G(mutex());
+        waiting.swap(this->waiting);
+        inprog = false;
+    }
+
+    // upstream may re-use pvStructure for the next reply, so downstream gets a copy.
+    // one copy is shared by all waiting downstream
+    pvd::PVStructurePtr value;
+    pvd::BitSet::shared_pointer changed;
+    if(status.isSuccess() && pvStructure) {
+        value = pvd::getPVDataCreate()->createPVStructure(pvStructure->getStructure());
+        value->copyUnchecked(*pvStructure);
+        changed.reset(new pvd::BitSet(*bitSet));
+    }
+
+    FOREACH(waiting_t::const_iterator, it, end, waiting)
+    {
+        GetUser::shared_pointer usr(*it);
+        pva::ChannelGetRequester::shared_pointer req(usr->req.lock());
+        if(req) {
+            req->getDone(status, usr, value, changed);
+        }
+    }
+}
+
+void
+GetCacheEntry::channelDisconnect(bool destroy)
+{
+    waiting_t waiting;
+    interested_t::vector_type tonotify;
+    {
+        Guard G(mutex());
+        waiting.swap(this->waiting);
+        inprog = false;
+        connected = false;
+        tonotify = interested.lock_vector();
+    }
+
+    // upstream getDone() won't come now
+    pvd::Status err(pvd::Status::STATUSTYPE_ERROR, "Upstream disconnect");
+    FOREACH(waiting_t::const_iterator, it, end, waiting)
+    {
+        pva::ChannelGetRequester::shared_pointer req((*it)->req.lock());
+        if(req) {
+            req->getDone(err, *it, pvd::PVStructurePtr(), pvd::BitSet::shared_pointer());
+        }
+    }
+
+    FOREACH(interested_t::vector_type::const_iterator, it, end, tonotify)
+    {
+        pva::ChannelGetRequester::shared_pointer req((*it)->req.lock());
+        if(req) {
+            req->channelDisconnect(destroy);
+        }
+    }
+}
+
+std::string
+GetCacheEntry::getRequesterName()
+{
+    return "GetCacheEntry";
+}
+
+pvd::PVStructurePtr
+GetCacheEntry::fromMonitor()
+{
+    pvd::PVStructurePtr ret;
+    pvd::StructureConstPtr type;
+    {
+        Guard G(mutex());
+        if(!fulltype || !connected)
+            return ret;
+        type = typedesc;
+    }
+
+    ChannelCacheEntry::mon_entries_t::lock_vector_type mons(chan->mon_entries.lock_vector());
+
+    FOREACH(ChannelCacheEntry::mon_entries_t::lock_vector_type::const_iterator, it, end, mons)
+    {
+        MonitorCacheEntry& ME = *it->second;
+
+        Guard G(ME.mutex());
+        // monitor must have an equal type (not necessarily the same instance), be current, and not paused by flowcontrol.
+        // record options (eg. DBE masks or filters) may leave lastelem behind the current value.
+        if(!ME.fulltype || ME.recordopts || !ME.havedata || ME.done || ME.paused
+                || !ME.typedesc || *ME.typedesc!=*type)
+            continue;
+
+        if(ME.shared) {
+            ret = ME.lastsnap; // never modified, no need to copy
+        } else {
+            ret = pvd::getPVDataCreate()->createPVStructure(type);
+            ret->copyUnchecked(*ME.lastelem->pvStructurePtr);
+        }
+        break;
+    }
+
+    return ret;
+}
+
+GetUser::GetUser(const GetCacheEntry::shared_pointer& e)
+    :entry(e)
+    ,destroyed(false)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+GetUser::~GetUser()
+{
+    epicsAtomicDecrSizeT(&num_instances);
+}
+
+// downstream server closes get
+void
+GetUser::destroy()
+{
+    entry->chan->retainOp(entry);
+
+    Guard G(mutex());
+    destroyed = true;
+}
+
+std::tr1::shared_ptr<pva::Channel>
+GetUser::getChannel()
+{
+    return srvchan.lock();
+}
+
+void
+GetUser::cancel()
+{
+    // other downstream may be waiting for the upstream get(), so only stop waiting ourselves
+    Guard G(mutex());
+    for(GetCacheEntry::waiting_t::iterator it(entry->waiting.begin()), end(entry->waiting.end());
+        it!=end; ++it)
+    {
+        if(it->get()==this) {
+            entry->waiting.erase(it);
+            break;
+        }
+    }
+}
+
+void
+GetUser::lastRequest()
+{}
+
+void
+GetUser::get()
+{
+    pva::ChannelGetRequester::shared_pointer req(this->req.lock());
+    if(!req)
+        return;
+    shared_pointer self(weakref);
+
+    {
+        Guard G(mutex());
+        if(destroyed)
+            return;
+        if(!entry->connected) {
+            UnGuard U(G);
+            req->getDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Not connected"),
+                         self, pvd::PVStructurePtr(), pvd::BitSet::shared_pointer());
+            return;
+        }
+    }
+
+    pvd::PVStructurePtr value(entry->fromMonitor());
+    if(value) {
+        // the upstream monitor already has the current value
+        pvd::BitSet::shared_pointer changed(new pvd::BitSet(1));
+        changed->set(0); // indicate all changed
+
+        epicsAtomicIncrSizeT(&entry->chan->cache->getMonitor);
+        req->getDone(pvd::Status::Ok, self, value, changed);
+        return;
+    }
+
+    bool doget;
+    pva::ChannelGet::shared_pointer op;
+    {
+        Guard G(mutex());
+        entry->waiting.push_back(self);
+        doget = !entry->inprog;
+        entry->inprog = true;
+        op = entry->op;
+    }
+
+    if(doget) {
+        epicsAtomicIncrSizeT(&entry->chan->cache->getUpstream);
+        op->get();
+    } else {
+        epicsAtomicIncrSizeT(&entry->chan->cache->getCoalesced);
+    }
+}
@@ -3,6 +3,7 @@
 #include <fstream>
 #include <stdexcept>
 #include <map>
+#include <algorithm>
 
 #if !defined(_WIN32)
 #include <signal.h>
@@ -27,6 +28,7 @@
 #include <pv/logger.h>
 
 #include "server.h"
+#include "statuspv.h"
 #include "pva2pva.h"
 
 namespace pvd = epics::pvData;
@@ -46,6 +48,27 @@ pvd::StructureConstPtr schema(pvd::getFieldCreate()->createFieldBuilder()
                                  ->add("autoaddrlist", pvd::pvBoolean)
                                  ->add("serverport", pvd::pvUShort)
                                  ->add("bcastport", pvd::pvUShort)
+                                 ->add("negcachettl", pvd::pvDouble)
+                                 ->add("negcachedelay", pvd::pvDouble)
+                                 ->add("negcachemax", pvd::pvUInt)
+                                 ->add("createqueuemax", pvd::pvUInt)
+                                 ->add("searchdefer", pvd::pvDouble)
+                                 ->add("fanoutworkers", pvd::pvUInt)
+                                 ->add("sharedsnapshots", pvd::pvBoolean)
+                                 ->add("flowcontrol", pvd::pvBoolean)
+                                 ->add("cachettl", pvd::pvDouble)
+                                 ->add("cachemax", pvd::pvUInt)
+                                 ->add("elementpoolmax", pvd::pvUInt)
+                                 ->add("monitorretain", pvd::pvDouble)
+                                 ->add("monitorretainmax", pvd::pvUInt)
+                                 ->add("warmfile", pvd::pvString)
+                                 ->add("warmperiod", pvd::pvDouble)
+                                 ->add("warmtimeout", pvd::pvDouble)
+                                 ->add("warmmonitors", pvd::pvBoolean)
+                                 ->add("reconnecthold", pvd::pvDouble)
+                                 ->add("contexts", pvd::pvUInt)
+                                 ->add("putcoalesce", pvd::pvString)
+                                 ->add("opretain", pvd::pvDouble)
                               ->endNested()
                               ->addNestedStructureArray("servers")
                                  ->add("name", pvd::pvString)
@@ -56,6 +79,10 @@ pvd::StructureConstPtr schema(pvd::getFieldCreate()->createFieldBuilder()
                                  ->add("serverport", pvd::pvUShort)
                                  ->add("bcastport", pvd::pvUShort)
                                  ->add("control_prefix", pvd::pvString)
+                                 ->add("searchrate", pvd::pvDouble)
+                                 ->add("searchburst", pvd::pvDouble)
+                                 ->add("searchtotalrate", pvd::pvDouble)
+                                 ->add("searchtotalburst", pvd::pvDouble)
                               ->endNested()
                               ->createStructure());
 
@@ -151,6 +178,90 @@ GWServerChannelProvider::shared_pointer configure_client(ServerConfig& arg, cons
         throw std::runtime_error("Can't create ChannelProvider");
 
     GWServerChannelProvider::shared_pointer ret(new GWServerChannelProvider(base));
+
+    // each additional context has its own upstream connections and receive threads
+    pvd::uint32 ncontexts = conf->getSubFieldT<pvd::PVScalar>("contexts")->getAs<pvd::uint32>();
+    for(pvd::uint32 i=1; i<ncontexts; i++) {
+        pva::ChannelProvider::shared_pointer extra(pva::ChannelProviderRegistry::clients()->createProvider(provider, C));
+        if(!extra)
+            throw std::runtime_error("Can't create ChannelProvider");
+        ret->cache.contexts.push_back(extra);
+    }
+
+    // zero (aka. not set) keeps defaults
+    double negttl = conf->getSubFieldT<pvd::PVScalar>("negcachettl")->getAs<double>(),
+           negdelay = conf->getSubFieldT<pvd::PVScalar>("negcachedelay")->getAs<double>();
+    pvd::uint32 negmax = conf->getSubFieldT<pvd::PVScalar>("negcachemax")->getAs<pvd::uint32>();
+    if(negttl>0.0)
+        ret->cache.negativeTTL = negttl;
+    if(negdelay>0.0)
+        ret->cache.negativeDelay = negdelay;
+    if(negmax>0)
+        ret->cache.negativeMax = negmax;
+
+    double cachettl = conf->getSubFieldT<pvd::PVScalar>("cachettl")->getAs<double>();
+    pvd::uint32 cachemax = conf->getSubFieldT<pvd::PVScalar>("cachemax")->getAs<pvd::uint32>();
+    if(cachettl>0.0)
+        ret->cache.cacheTTL = cachettl;
+    ret->cache.cacheMax = cachemax;
+
+    pvd::uint32 createmax = conf->getSubFieldT<pvd::PVScalar>("createqueuemax")->getAs<pvd::uint32>();
+    if(createmax>0)
+        ret->cache.creator.maxDepth = createmax;
+
+    // negative disables
+    double defer = conf->getSubFieldT<pvd::PVScalar>("searchdefer")->getAs<double>();
+    if(defer!=0.0)
+        ret->cache.deferTimeout = defer;
+
+    ret->cache.sharedSnapshots = conf->getSubFieldT<pvd::PVBoolean>("sharedsnapshots")->get();
+    ret->cache.flowControl = conf->getSubFieldT<pvd::PVBoolean>("flowcontrol")->get();
+
+    double retain = conf->getSubFieldT<pvd::PVScalar>("monitorretain")->getAs<double>();
+    pvd::uint32 retainmax = conf->getSubFieldT<pvd::PVScalar>("monitorretainmax")->getAs<pvd::uint32>();
+    if(retain>0.0)
+        ret->cache.monitorRetain = retain;
+    if(retainmax>0)
+        ret->cache.monitorRetainMax = retainmax;
+
+    pvd::uint32 poolmax = conf->getSubFieldT<pvd::PVScalar>("elementpoolmax")->getAs<pvd::uint32>();
+    if(poolmax>0)
+        ret->cache.pool->maxFree = poolmax;
+
+    double warmperiod = conf->getSubFieldT<pvd::PVScalar>("warmperiod")->getAs<double>(),
+           warmtimeout = conf->getSubFieldT<pvd::PVScalar>("warmtimeout")->getAs<double>();
+    ret->cache.warmFile = conf->getSubFieldT<pvd::PVString>("warmfile")->get();
+    ret->cache.warmMonitors = conf->getSubFieldT<pvd::PVBoolean>("warmmonitors")->get();
+    if(warmperiod>0.0)
+        ret->cache.warmPeriod = warmperiod;
+    if(warmtimeout>0.0)
+        ret->cache.warmTimeout = warmtimeout;
+
+    // glob patterns seperated by spaces or commas
+    {
+        std::string patterns(conf->getSubFieldT<pvd::PVString>("putcoalesce")->get());
+        const char *sep = " \t,";
+        size_t start = patterns.find_first_not_of(sep);
+        while(start!=std::string::npos) {
+            size_t end = patterns.find_first_of(sep, start);
+            ret->cache.putCoalesce.push_back(patterns.substr(start, end==std::string::npos ? end : end-start));
+            start = patterns.find_first_not_of(sep, end);
+        }
+    }
+
+    double opretain = conf->getSubFieldT<pvd::PVScalar>("opretain")->getAs<double>();
+    if(opretain>0.0)
+        ret->cache.opRetain = opretain;
+
+    double hold = conf->getSubFieldT<pvd::PVScalar>("reconnecthold")->getAs<double>();
+    if(hold>0.0)
+        ret->cache.reconnectHold = hold;
+
+    // zero keeps fanout on the upstream client RX thread
+    pvd::uint32 nfanout = conf->getSubFieldT<pvd::PVScalar>("fanoutworkers")->getAs<pvd::uint32>();
+    if(nfanout>0)
+        ret->cache.fanout = new FanoutPool(nfanout);
+
     return ret;
 }
 
@@ -174,12 +285,46 @@ pva::ServerContext::shared_pointer configure_server(ServerConfig& arg, const pvd
     pvd::PVStringArray::const_svector names(clients->view());
     std::vector<pva::ChannelProvider::shared_pointer> providers;
 
+    ServerConfig::clients_t used;
     for(pvd::PVStringArray::const_svector::const_iterator it(names.begin()), end(names.end()); it!=end; ++it)
     {
         ServerConfig::clients_t::const_iterator it2(arg.clients.find(*it));
         if(it2==arg.clients.end())
             throw std::runtime_error("Server references non-existant client");
-        providers.push_back(it2->second);
+        used[*it] = it2->second;
+    }
+
+    // zero disables
+    double searchrate = conf->getSubFieldT<pvd::PVScalar>("searchrate")->getAs<double>(),
+           searchtotalrate = conf->getSubFieldT<pvd::PVScalar>("searchtotalrate")->getAs<double>();
+    ServerConfig::limiters_t limiters;
+    if(searchrate>0.0 || searchtotalrate>0.0) {
+        SearchLimit::shared_pointer limit(new SearchLimit(searchrate,
+                                                          conf->getSubFieldT<pvd::PVScalar>("searchburst")->getAs<double>(),
+                                                          searchtotalrate,
+                                                          conf->getSubFieldT<pvd::PVScalar>("searchtotalburst")->getAs<double>()));
+        for(ServerConfig::clients_t::const_iterator it(used.begin()), end(used.end()); it!=end; ++it)
+        {
+            limiters[it->first].reset(new GWSearchLimiter(it->second, limit));
+        }
+        arg.limiters[name] = limiters;
+    }
+
+    // ahead of the clients, so that status PV names are never searched for upstream
+    std::string prefix(conf->getSubFieldT<pvd::PVString>("control_prefix")->get());
+    if(!prefix.empty()) {
+        GWStatus::shared_pointer status(new GWStatus(name, prefix, used, limiters));
+        arg.statuses[name] = status;
+        providers.push_back(status->provider.provider());
+    }
+
+    for(pvd::PVStringArray::const_svector::const_iterator it(names.begin()), end(names.end()); it!=end; ++it)
+    {
+        ServerConfig::limiters_t::const_iterator it2(limiters.find(*it));
+        if(it2!=limiters.end())
+            providers.push_back(it2->second);
+        else
+            providers.push_back(used[*it]);
     }
 
     pva::ServerContext::shared_pointer ret(pva::ServerContext::create(pva::ServerContext::Config()
@@ -188,6 +333,69 @@ pva::ServerContext::shared_pointer configure_server(ServerConfig& arg, const pvd
     return ret;
 }
 
+// re-create upstream channels, and monitors, in use before the last restart.
+// Waits for them to connect, or warmtimeout, before any server is started.
+void warm_start(ServerConfig& arg)
+{
+    typedef std::map<std::string, ChannelCache::WarmProgress> progress_t;
+    progress_t progress;
+    double timeout = 0.0;
+
+    epicsTime start(epicsTime::getCurrent());
+
+    for(ServerConfig::clients_t::const_iterator it(arg.clients.begin()), end(arg.clients.end()); it!=end; ++it)
+    {
+        ChannelCache& cache = it->second->cache;
+        if(cache.warmFile.empty())
+            continue;
+
+        std::ifstream strm(cache.warmFile.c_str());
+        if(!strm.is_open()) {
+            std::cout<<"Client '"<<it->first<<"' no warm start file \""<<cache.warmFile<<"\"\n";
+        } else {
+            ChannelCache::WarmProgress& P = progress[it->first];
+            cache.loadWarm(strm, P);
+            std::cout<<"Client '"<<it->first<<"' warm start "<<P.chans.size()<<" channels, "
+                     <<P.mons.size()<<" monitors";
+            if(P.nerrors)
+                std::cout<<", "<<P.nerrors<<" lines ignored";
+            std::cout<<"\n";
+            timeout = std::max(timeout, cache.warmTimeout);
+        }
+
+        cache.startWarm();
+    }
+
+    if(progress.empty())
+        return;
+
+    double elapsed;
+    for(unsigned n=0; true; n++) {
+        size_t nchan = 0u, nconn = 0u, nmon = 0u, ndata = 0u;
+        for(progress_t::const_iterator it(progress.begin()), end(progress.end()); it!=end; ++it)
+        {
+            size_t nc, nd;
+            it->second.count(nc, nd);
+            nchan += it->second.chans.size();
+            nmon += it->second.mons.size();
+            nconn += nc;
+            ndata += nd;
+        }
+        elapsed = epicsTime::getCurrent() - start;
+
+        bool complete = nconn==nchan && ndata==nmon;
+        if(complete || elapsed>=timeout) {
+            std::cout<<"Warm start "<<(complete ? "complete" : "timeout")<<" after "<<elapsed<<" seconds.  "
+                     <<nconn<<"/"<<nchan<<" channels connected, "<<ndata<<"/"<<nmon<<" monitors with data\n";
+            break;
+        } else if(arg.debug>0 && n%10u==0u) {
+            std::cout<<"Warm start "<<nconn<<"/"<<nchan<<" channels connected, "
+                     <<ndata<<"/"<<nmon<<" monitors with data\n";
+        }
+        epicsThreadSleep(0.1);
+    }
+}
+
 volatile int quit;
 epicsEvent done;
 
@@ -305,6 +513,9 @@ int main(int argc, char *argv[])
             arg.clients[name] = configure_client(arg, client);
         }
 
+        // before servers are started, so early searches find connected channels
+        warm_start(arg);
+
         arr = arg.conf->getSubFieldT<pvd::PVStructureArray>("servers")->view();
 
         for(size_t i=0; i<arr.size(); i++) {
@@ -1,3 +1,4 @@
+#include <algorithm>
 
 #include <epicsAtomic.h>
 #include <errlog.h>
@@ -6,11 +7,13 @@
 #include <epicsTimer.h>
 
 #include <pv/pvAccess.h>
+#include <pv/alarm.h>
 
 #define epicsExportSharedSymbols
 #include "helper.h"
 #include "pva2pva.h"
 #include "chancache.h"
+#include "pvrequest.h"
 
 namespace pva = epics::pvAccess;
 namespace pvd = epics::pvData;
@@ -29,15 +32,215 @@ T getS(const pvd::PVStructurePtr& s, const char* name, T dft)
         return dft;
     }
 }
+
+}
+
+LatencyHist::LatencyHist()
+{
+    for(size_t i=0; i<NBins; i++)
+        bins[i] = 0u;
+}
+
+void
+LatencyHist::add(epicsUInt64 ns)
+{
+    epicsUInt64 us = ns/1000u;
+    size_t bin = 0u;
+    while(us && bin<NBins-1u) {
+        us >>= 1;
+        bin++;
+    }
+    epicsAtomicIncrSizeT(&bins[bin]);
+}
+
+void
+LatencyHist::get(bins_t& out) const
+{
+    for(size_t i=0; i<NBins; i++)
+        out[i] = epicsAtomicGetSizeT(&bins[i]);
+}
+
+double
+LatencyHist::upper(size_t i)
+{
+    return double(epicsUInt64(1u)<<i)*1e-6;
+}
+
+double
+LatencyHist::quantile(const bins_t& bins, double frac)
+{
+    size_t total = 0u;
+    for(size_t i=0; i<NBins; i++)
+        total += bins[i];
+    if(total==0u)
+        return 0.0;
+
+    double target = frac*total, sum = 0.0;
+    for(size_t i=0; i<NBins; i++) {
+        sum += bins[i];
+        if(sum>=target && bins[i])
+            return upper(i);
+    }
+    return upper(NBins-1u);
+}
+
+namespace {
+void showHist(std::ostream& strm, const char *indent, const char *name, const LatencyHist& H)
+{
+    LatencyHist::bins_t bins;
+    H.get(bins);
+
+    strm<<indent<<name;
+    for(size_t i=0; i<LatencyHist::NBins; i++) {
+        if(!bins[i])
+            continue;
+        double U = LatencyHist::upper(i);
+        strm<<" "<<bins[i]<<(i==LatencyHist::NBins-1u ? "@>=" : "@<");
+        if(U<1e-3)
+            strm<<U*1e6<<"us";
+        else if(U<1.0)
+            strm<<U*1e3<<"ms";
+        else
+            strm<<U<<"s";
+    }
+    strm<<"\n";
+}
+}
+
+void
+MonitorLatency::show(std::ostream& strm, const char *indent) const
+{
+    showHist(strm, indent, "enqueue", enqueue);
+    showHist(strm, indent, "poll   ", poll);
+    showHist(strm, indent, "release", release);
+}
+
+namespace {
+// release array and union values held by a pooled element
+void dropValues(pvd::PVStructure& S)
+{
+    const pvd::PVFieldPtrArray& F = S.getPVFields();
+    for(size_t i=0; i<F.size(); i++) {
+        pvd::PVField *fld = F[i].get();
+        switch(fld->getField()->getType()) {
+        case pvd::structure:
+            dropValues(static_cast<pvd::PVStructure&>(*fld));
+            break;
+        case pvd::scalarArray:
+        case pvd::structureArray:
+        case pvd::unionArray:
+            static_cast<pvd::PVArray*>(fld)->setLength(0);
+            break;
+        case pvd::union_:
+            static_cast<pvd::PVUnion*>(fld)->set(pvd::PVFieldPtr());
+            break;
+        default:
+            break;
+        }
+    }
+}
+}
+
+ElementPool::ElementPool()
+    :nfree(0u)
+    ,maxFree(1024u)
+    ,nhits(0u)
+    ,nmisses(0u)
+    ,ndiscards(0u)
+{}
+
+pvd::MonitorElementPtr
+ElementPool::get(const pvd::StructureConstPtr& type)
+{
+    pvd::MonitorElementPtr ret;
+    {
+        Guard G(lock);
+        free_t::iterator it(free.find(type));
+        if(it!=free.end()) {
+            ret.swap(it->second.back());
+            it->second.pop_back();
+            if(it->second.empty())
+                free.erase(it); // don't keep unused types alive
+            nfree--;
+            nhits++;
+        } else {
+            nmisses++;
+        }
+    }
+    if(!ret) {
+        // allocate w/o lock
+        ret.reset(new pvd::MonitorElement(pvd::getPVDataCreate()->createPVStructure(type)));
+    }
+    return ret;
+}
+
+void
+ElementPool::put(pvd::MonitorElementPtr& elem)
+{
+    // only recycle if no one else (eg. downstream) can see
+    if(!elem || !elem.unique() || !elem->pvStructurePtr.unique()) {
+        elem.reset();
+        return;
+    }
+
+    dropValues(*elem->pvStructurePtr);
+    elem->changedBitSet->clear();
+    elem->overrunBitSet->clear();
+
+    pvd::MonitorElementPtr discard; // free w/o lock
+    {
+        Guard G(lock);
+        if(nfree>=maxFree) {
+            ndiscards++;
+            discard.swap(elem);
+        } else {
+            free[elem->pvStructurePtr->getStructure()].push_back(pvd::MonitorElementPtr());
+            free[elem->pvStructurePtr->getStructure()].back().swap(elem);
+            nfree++;
+        }
+    }
+}
+
+MonitorCacheEntry::shared_pointer
+ChannelCacheEntry::addMonitor(Guard& G, const pvd::PVStructurePtr& request, const pvrequest_t& ser)
+{
+    MonitorCacheEntry::shared_pointer ment(new MonitorCacheEntry(this, request));
+    mon_entries[ser] = ment; // ref. wrapped
+    ment->weakref = ment;
+
+    // We've added an incomplete entry (no Monitor)
+    // so MonitorUser must check validity before de-ref.
+    // in this case we use !!typedesc as this also indicates
+    // that the upstream monitor is connected
+    pvd::MonitorPtr M;
+    pva::Channel::shared_pointer chan(channel);
+    {
+        UnGuard U(G);
+
+        // flowcontrol relies on upstream server waiting for our release()
+        M = chan->createMonitor(ment, ment->flowcontrol ? requestSetOption(request, "pipeline", "true") : request);
+    }
+    ment->mon = M;
+    return ment;
 }
 
 MonitorCacheEntry::MonitorCacheEntry(ChannelCacheEntry *ent, const pvd::PVStructure::shared_pointer& pvr)
     :chan(ent)
-    ,bufferSize(getS<pvd::uint32>(pvr, "record._options.queueSize", 2)) // should be same default as pvAccess, but not required
+    ,pool(ent->cache->pool)
+    ,shared(ent->cache->sharedSnapshots)
+    ,flowcontrol(ent->cache->flowControl)
+    ,fulltype(requestSelectsAll(pvr))
+    ,request(pvr)
+    ,recordopts(pvr->getSubField<pvd::PVStructure>("record"))
+    ,projectable(!requestFieldOptions(pvr))
     ,havedata(false)
     ,done(false)
     ,nwakeups(0)
     ,nevents(0)
+    ,npauses(0)
+    ,nreconnects(0)
+    ,paused(false)
+    ,retained(false)
 {
     epicsAtomicIncrSizeT(&num_instances);
 }
@@ -58,45 +261,72 @@ MonitorCacheEntry::monitorConnect(pvd::Status const & status,
                                   pvd::MonitorPtr const & monitor,
                                   pvd::StructureConstPtr const & structure)
 {
+    shared_pointer self(weakref); // keeps us alive all MonitorUsers are destroy()ed
+
     interested_t::vector_type tonotify;
+    bool retyped = false;
     {
         Guard G(mutex());
-        if(typedesc) {
-            // we shouldn't have to deal with monitor type change since we
-            // destroy() Monitors on Channel disconnect.
-            std::cerr<<"monitorConnect() w/ new type.  Monitor has outlived it's connection.\n";
-            monitor->stop();
-            //TODO: unlisten()
+        if(typedesc && status.isSuccess() && structure && *typedesc==*structure) {
+            // upstream reconnect, re-subscribed by the client.  It also restores
+            // the started state, and the next update is complete.
+            epicsAtomicIncrSizeT(&nreconnects);
             return;
-        }
-        typedesc = structure;
 
-        if(status.isSuccess()) {
-            startresult = monitor->start();
+        } else if(typedesc) {
+            // type changed (or error) on reconnect.  existing subscribers can't continue
+            std::cerr<<"monitorConnect() w/ new type for "<<chan->channelName<<".  Closing.\n";
+            monitor->stop();
+            retyped = true;
+
         } else {
-            startresult = status;
-        }
+            typedesc = structure;
 
-        if(startresult.isSuccess()) {
-            lastelem.reset(new pvd::MonitorElement(pvd::getPVDataCreate()->createPVStructure(structure)));
+            if(status.isSuccess()) {
+                startresult = monitor->start();
+            } else {
+                startresult = status;
+            }
+
+            if(startresult.isSuccess()) {
+                // not from the pool.  Answers to get() are copied from lastelem,
+                // so it must never hold a value left by another PV.
+                lastelem.reset(new pvd::MonitorElement(pvd::getPVDataCreate()->createPVStructure(structure)));
+            }
+
+            // set typedesc and startresult for futured MonitorUsers
+            // and copy snapshot of already interested MonitorUsers
+            tonotify = interested.lock_vector();
+            FOREACH(interested_t::vector_type::const_iterator, it, end, tonotify)
+                (*it)->setType(structure);
         }
+    }
 
-        // set typedesc and startresult for futured MonitorUsers
-        // and copy snapshot of already interested MonitorUsers
-        tonotify = interested.lock_vector();
+    if(retyped) {
+        epicsAtomicIncrSizeT(&chan->cache->reconnectRetyped);
+        unlisten(monitor);
+        chan->cache->teardown(chan);
+        return;
     }
 
     if(!startresult.isSuccess())
         std::cout<<"upstream monitor start() fails\n";
 
-    shared_pointer self(weakref); // keeps us alive all MonitorUsers are destroy()ed
+    if(fulltype && status.isSuccess()) {
+        // answer getField("") without asking upstream
+        Guard G(chan->mutex());
+        ChannelCacheEntry::fields_t::const_iterator it(chan->fields.find(std::string()));
+        if(it!=chan->fields.end() && it->second!=structure)
+            chan->clearFields(); // type change
+        chan->fields[std::string()] = structure;
+    }
 
     for(interested_t::vector_type::const_iterator it = tonotify.begin(),
         end = tonotify.end(); it!=end; ++it)
     {
         pvd::MonitorRequester::shared_pointer req((*it)->req);
         if(req) {
-            req->monitorConnect(startresult, *it, structure);
+            req->monitorConnect(startresult, *it, (*it)->typedesc);
         }
     }
 }
@@ -124,7 +354,6 @@ MonitorCacheEntry::monitorEvent(pvd::MonitorPtr const & monitor)
 
     pva::MonitorElementPtr update;
 
-    typedef std::vector<MonitorUser::shared_pointer> dsnotify_t;
     dsnotify_t dsnotify;
 
     {
@@ -132,9 +361,22 @@ MonitorCacheEntry::monitorEvent(pvd::MonitorPtr const & monitor)
         if(!havedata)
             havedata = true;
 
-        //TODO: flow control, if all MU buffers are full, break before poll()==NULL
-        while((update=monitor->poll()))
+        while(true)
         {
+            if(flowcontrol && allFull()) {
+                // leave updates in the upstream queue, which will eventually
+                // stop the upstream server until some downstream release()s
+                paused = true;
+                pausedmon = monitor;
+                epicsAtomicIncrSizeT(&npauses);
+                break;
+            }
+
+            if(!(update=monitor->poll()))
+                break;
+
+            const epicsUInt64 arrival = epicsMonotonicGet();
+
             epicsAtomicIncrSizeT(&nevents);
 
             lastelem->pvStructurePtr->copyUnchecked(*update->pvStructurePtr,
@@ -144,64 +386,54 @@ MonitorCacheEntry::monitorEvent(pvd::MonitorPtr const & monitor)
             monitor->release(update);
             update.reset();
 
-            interested_t::iterator IIT(interested); // recursively locks interested.mutex() (assumes this->mutex() is interestd.mutex())
-            for(interested_t::value_pointer pusr = IIT.next(); pusr; pusr = IIT.next())
-            {
-                MonitorUser *usr = pusr.get();
-
-                {
-                    Guard G(usr->mutex());
-                    if(usr->initial)
-                        continue; // no start() yet
-                    // TODO: track overflow when !running (after stop())?
-                    if(!usr->running || usr->empty.empty()) {
-                        usr->inoverflow = true;
-
-                        /* overrun |= lastelem->overrun           // upstream overflows
-                         * overrun |= changed & lastelem->changed // downstream overflows
-                         * changed |= lastelem->changed           // accumulate changes
-                         */
-
-                        *usr->overflowElement->overrunBitSet |= *lastelem->overrunBitSet;
-                        usr->overflowElement->overrunBitSet->or_and(*usr->overflowElement->changedBitSet,
-                                                                    *lastelem->changedBitSet);
-                        *usr->overflowElement->changedBitSet |= *lastelem->changedBitSet;
-
-                        usr->overflowElement->pvStructurePtr->copyUnchecked(*lastelem->pvStructurePtr,
-                                                                            *lastelem->changedBitSet);
-
-                        epicsAtomicIncrSizeT(&usr->ndropped);
-                        continue;
-                    }
-                    // we only come out of overflow when downstream release()s an element to us
-                    // empty.empty() does not imply inoverflow,
-                    // however inoverflow does imply empty.empty()
-                    assert(!usr->inoverflow);
-
-                    if(usr->filled.empty())
-                        dsnotify.push_back(pusr);
-
-                    pvd::MonitorElementPtr elem(usr->empty.front());
-
-                    *elem->overrunBitSet = *lastelem->overrunBitSet;
-                    *elem->changedBitSet = *lastelem->changedBitSet;
-                    // Note: can't use changed mask to optimize this copy since we don't know
-                    //       the state of the free element
-                    elem->pvStructurePtr->copyUnchecked(*lastelem->pvStructurePtr);
-
-                    usr->filled.push_back(elem);
-                    usr->empty.pop_front();
-
-                    epicsAtomicIncrSizeT(&usr->nevents);
-                }
-            }
+            fanoutUpdate(arrival, dsnotify);
         }
     }
 
     // unlock here, race w/ stop(), unlisten()?
-    //TODO: notify from worker thread
 
-    FOREACH(dsnotify_t::iterator, it,end,dsnotify) {
+    notifyUsers(dsnotify);
+}
+
+void
+MonitorCacheEntry::fanoutUpdate(epicsUInt64 arrival, dsnotify_t& dsnotify)
+{
+    FanoutPool *fanout = chan->cache->fanout;
+
+    // With a fanout pool, or shared snapshots, take one private copy
+    // of this update which is not modified afterwards.
+    // Array values are not copied, but share the (frozen) shared_vector of lastelem.
+    pvd::MonitorElementPtr snap;
+    if(fanout || shared) {
+        snap.reset(new pvd::MonitorElement(pvd::getPVDataCreate()->createPVStructure(typedesc)));
+        snap->pvStructurePtr->copyUnchecked(*lastelem->pvStructurePtr);
+        *snap->changedBitSet = *lastelem->changedBitSet;
+        *snap->overrunBitSet = *lastelem->overrunBitSet;
+        if(shared)
+            lastsnap = snap->pvStructurePtr;
+    }
+
+    interested_t::iterator IIT(interested); // recursively locks interested.mutex() (assumes this->mutex() is interestd.mutex())
+    for(interested_t::value_pointer pusr = IIT.next(); pusr; pusr = IIT.next())
+    {
+        MonitorUser *usr = pusr.get();
+
+        if(usr->initial)
+            continue; // no start() yet
+
+        if(fanout) {
+            fanout->push(pusr, snap, arrival);
+
+        } else if(usr->queueUpdate(snap ? snap : lastelem, arrival)) {
+            dsnotify.push_back(pusr);
+        }
+    }
+}
+
+void
+MonitorCacheEntry::notifyUsers(const dsnotify_t& dsnotify)
+{
+    FOREACH(dsnotify_t::const_iterator, it,end,dsnotify) {
         MonitorUser *usr = (*it).get();
         pvd::MonitorRequester::shared_pointer req(usr->req);
         epicsAtomicIncrSizeT(&usr->nwakeups);
@@ -209,10 +441,57 @@ MonitorCacheEntry::monitorEvent(pvd::MonitorPtr const & monitor)
     }
 }
 
+// notification from upstream client that its channel has disconnected (or is destroyed)
+void
+MonitorCacheEntry::channelDisconnect(bool destroy)
+{
+    if(destroy || chan->cache->reconnectHold<=0.0)
+        return; // downstream will be told of the channel disconnect
+
+    shared_pointer self(weakref); // keeps us alive in case all MonitorUsers are destroy()ed
+
+    dsnotify_t dsnotify;
+    {
+        Guard G(mutex());
+        if(!havedata)
+            return;
+
+        // flag the last value as INVALID until upstream reconnects with a complete update
+        pvd::PVStructurePtr alarm(lastelem->pvStructurePtr->getSubField<pvd::PVStructure>("alarm"));
+        pvd::PVScalarPtr sevr, stat, msg;
+        if(alarm) {
+            sevr = alarm->getSubField<pvd::PVScalar>("severity");
+            stat = alarm->getSubField<pvd::PVScalar>("status");
+            msg = alarm->getSubField<pvd::PVScalar>("message");
+        }
+        if(!sevr)
+            return; // no alarm to set
+
+        lastelem->changedBitSet->clear();
+        lastelem->overrunBitSet->clear();
+
+        sevr->putFrom<pvd::int32>(pvd::invalidAlarm);
+        lastelem->changedBitSet->set(sevr->getFieldOffset());
+        if(stat) {
+            stat->putFrom<pvd::int32>(pvd::clientStatus);
+            lastelem->changedBitSet->set(stat->getFieldOffset());
+        }
+        if(msg) {
+            msg->putFrom<std::string>("Upstream Disconnected");
+            lastelem->changedBitSet->set(msg->getFieldOffset());
+        }
+
+        fanoutUpdate(epicsMonotonicGet(), dsnotify);
+    }
+
+    notifyUsers(dsnotify);
+}
+
 // notificaton from upstream client that no more monitor updates will come, ever
 void
 MonitorCacheEntry::unlisten(pvd::MonitorPtr const & monitor)
 {
+    FanoutPool *fanout = chan->cache->fanout;
     pvd::Monitor::shared_pointer M;
     interested_t::vector_type tonotify;
     {
@@ -223,37 +502,300 @@ MonitorCacheEntry::unlisten(pvd::MonitorPtr const & monitor)
 
         // cause future downstream start() to error
         startresult = pvd::Status(pvd::Status::STATUSTYPE_ERROR, "upstream unlisten()");
+
+        if(fanout) {
+            // after any update still waiting for a worker
+            FOREACH(interested_t::vector_type::const_iterator, it, end, tonotify)
+                fanout->unlisten(*it);
+        }
     }
     if(M) {
         M->destroy();
     }
-    FOREACH(interested_t::vector_type::iterator, it, end, tonotify) {
-        MonitorUser *usr = it->get();
-        pvd::MonitorRequester::shared_pointer req(usr->req);
-        if(usr->inuse.empty()) // TODO: what about stopped?
-            req->unlisten(*it);
+    if(!fanout) {
+        FOREACH(interested_t::vector_type::const_iterator, it, end, tonotify)
+            (*it)->notifyUnlisten();
     }
 }
 
+FanoutPool::Worker::Worker()
+    :running(true)
+    ,peak(0)
+    ,nprocessed(0)
+    ,thread(*this, "p2pFanout",
+            epicsThreadGetStackSize(epicsThreadStackSmall),
+            epicsThreadPriorityCAServerLow-1)
+{
+    thread.start();
+}
+
+FanoutPool::Worker::~Worker()
+{
+    {
+        Guard G(lock);
+        running = false;
+        queue.clear();
+    }
+    wakeup.signal();
+    thread.exitWait();
+}
+
+void
+FanoutPool::Worker::run()
+{
+    Guard G(lock);
+
+    while(running) {
+        if(queue.empty()) {
+            UnGuard U(G);
+            wakeup.wait();
+            continue;
+        }
+
+        MonitorUser::weak_pointer wusr;
+        wusr.swap(queue.front());
+        queue.pop_front();
+        nprocessed++;
+
+        UnGuard U(G);
+
+        // ensure 'usr' is released with no locks held
+        MonitorUser::shared_pointer usr(wusr.lock());
+        if(!usr)
+            continue; // downstream already gone
+
+        pvd::MonitorElementPtr update;
+        bool notify = false, unlisten;
+        {
+            Guard G2(usr->mutex());
+            usr->fanoutQueued = false;
+            update.swap(usr->fanoutPending);
+            if(update)
+                notify = usr->queueUpdate(update, usr->fanoutArrival);
+            unlisten = usr->fanoutUnlisten;
+            usr->fanoutUnlisten = false;
+        }
+
+        if(notify) {
+            pvd::MonitorRequester::shared_pointer req(usr->req.lock());
+            if(req) {
+                epicsAtomicIncrSizeT(&usr->nwakeups);
+                req->monitorEvent(usr);
+            }
+        }
+
+        if(unlisten)
+            usr->notifyUnlisten();
+        else if(usr->entry->flowcontrol)
+            usr->entry->resume(); // no longer counted as full by allFull()
+    }
+}
+
+FanoutPool::FanoutPool(unsigned nworkers)
+{
+    if(nworkers==0)
+        throw std::logic_error("FanoutPool requires at least one worker");
+    workers.reserve(nworkers);
+    for(unsigned i=0; i<nworkers; i++)
+        workers.push_back(new Worker());
+}
+
+FanoutPool::~FanoutPool()
+{
+    FOREACH(workers_t::iterator, it, end, workers)
+        delete *it;
+}
+
+void
+FanoutPool::push(const MonitorUser::shared_pointer& usr, const pvd::MonitorElementPtr& update,
+                 epicsUInt64 arrival)
+{
+    if(usr->fanoutPending) {
+        // the worker hasn't queued the previous update yet.  merge as queueUpdate() does
+        // into overflow.  Each update is a complete snapshot, so only the masks accumulate.
+        const pvd::MonitorElement& prev = *usr->fanoutPending;
+        pvd::MonitorElementPtr merged(new pvd::MonitorElement(update->pvStructurePtr));
+        *merged->overrunBitSet = *prev.overrunBitSet;
+        *merged->overrunBitSet |= *update->overrunBitSet;
+        merged->overrunBitSet->or_and(*prev.changedBitSet, *update->changedBitSet);
+        *merged->changedBitSet = *prev.changedBitSet;
+        *merged->changedBitSet |= *update->changedBitSet;
+        usr->fanoutPending = merged;
+        epicsAtomicIncrSizeT(&usr->ndropped);
+    } else {
+        usr->fanoutPending = update;
+        usr->fanoutArrival = arrival;
+    }
+    schedule(usr);
+}
+
+void
+FanoutPool::unlisten(const MonitorUser::shared_pointer& usr)
+{
+    usr->fanoutUnlisten = true;
+    schedule(usr);
+}
+
+// add to the worker queue, unless already there.  call with usr->mutex() held
+void
+FanoutPool::schedule(const MonitorUser::shared_pointer& usr)
+{
+    if(usr->fanoutQueued)
+        return;
+
+    // a MonitorUser is always handled by the same worker to preserve ordering
+    Worker& W = *workers[(size_t(usr.get())/sizeof(MonitorUser))%workers.size()];
+    bool wake;
+    {
+        Guard G(W.lock);
+        if(!W.running)
+            return;
+        wake = W.queue.empty();
+        W.queue.push_back(usr);
+        if(W.queue.size()>W.peak)
+            W.peak = W.queue.size();
+    }
+    usr->fanoutQueued = true;
+    if(wake)
+        W.wakeup.signal();
+}
+
+// true if at least one MonitorUser is started, and all started MonitorUsers have full queues.
+// call with mutex() held
+bool
+MonitorCacheEntry::allFull()
+{
+    size_t nstarted = 0;
+    interested_t::iterator IIT(interested);
+    for(interested_t::value_pointer pusr = IIT.next(); pusr; pusr = IIT.next())
+    {
+        MonitorUser *usr = pusr.get();
+        if(usr->initial || !usr->running)
+            continue;
+        nstarted++;
+        Guard Q(usr->qlock);
+        // an update waiting for a FanoutPool worker will take the free slot
+        if(usr->canQueue() && !usr->fanoutQueued)
+            return false;
+    }
+    return nstarted>0;
+}
+
+// continue poll()ing upstream after flowcontrol pause.
+// call with no locks held
+void
+MonitorCacheEntry::resume()
+{
+    pvd::MonitorPtr M;
+    {
+        Guard G(mutex());
+        if(!paused)
+            return;
+        paused = false;
+        M.swap(pausedmon);
+    }
+    if(M)
+        monitorEvent(M);
+}
+
 std::string
 MonitorCacheEntry::getRequesterName()
 {
     return "MonitorCacheEntry";
 }
 
-MonitorUser::MonitorUser(const MonitorCacheEntry::shared_pointer &e)
+// releases updates held by a rate limited MonitorUser
+struct MonitorUser::RateTimer : public epicsTimerNotify
+{
+    MonitorUser *usr;
+    RateTimer(MonitorUser *u) : usr(u) {}
+    epicsTimerNotify::expireStatus expire(const epicsTime &currentTime)
+    {
+        MonitorUser::shared_pointer self(usr->weakref.lock());
+        if(!self)
+            return epicsTimerNotify::expireStatus(epicsTimerNotify::noRestart);
+
+        bool notify = false;
+        {
+            Guard G(usr->mutex());
+            Guard Q(usr->qlock);
+
+            if(usr->inoverflow && usr->running) {
+                if(!usr->canQueue()) {
+                    // downstream queue full, try again later
+                    return epicsTimerNotify::expireStatus(epicsTimerNotify::restart, usr->period);
+                }
+                notify = usr->nfilled==0;
+                usr->pushOverflow();
+                usr->nextsend = currentTime + usr->period;
+            }
+            usr->timerarmed = false;
+        }
+
+        if(notify) {
+            pvd::MonitorRequester::shared_pointer req(usr->req.lock());
+            if(req) {
+                epicsAtomicIncrSizeT(&usr->nwakeups);
+                req->monitorEvent(self);
+            }
+        }
+        return epicsTimerNotify::expireStatus(epicsTimerNotify::noRestart);
+    }
+};
+
+MonitorUser::MonitorUser(const MonitorCacheEntry::shared_pointer &e,
+                         const pvd::PVStructurePtr& pvRequest,
+                         const pvd::PVStructurePtr& fieldsel,
+                         const ArraySlice& slice)
     :entry(e)
+    ,bufferSize(getS<pvd::uint32>(pvRequest, "record._options.queueSize", 2)) // should be same default as pvAccess, but not required
+    ,fieldsel(fieldsel)
+    ,slice(slice)
+    ,shared(e->shared && !fieldsel && !slice.active())
     ,initial(true)
     ,running(false)
-    ,inoverflow(false)
+    ,nwakeups(0)
     ,nevents(0)
     ,ndropped(0)
+    ,head(0u)
+    ,tail(0u)
+    ,nfilled(0u)
+    ,ninuse(0u)
+    ,inoverflow(false)
+    ,overflowArrival(0u)
+    ,fanoutQueued(false)
+    ,fanoutArrival(0u)
+    ,fanoutUnlisten(false)
+    ,period(0.0)
+    ,ratenotify(0)
+    ,ratetimer(0)
+    ,timerarmed(false)
 {
     epicsAtomicIncrSizeT(&num_instances);
 }
 
 MonitorUser::~MonitorUser()
 {
+    if(ratetimer)
+        ratetimer->destroy(); // waits for expire() to complete
+    delete ratenotify;
+    if(!shared) {
+        // with shared snapshots, elements reference values seen by others
+        for(size_t i=0; i<ring.size(); i++)
+            entry->pool->put(ring[i].elem);
+        entry->pool->put(overflowElement);
+    }
+    if(slice.active()) {
+        // drop shared results once no one else uses our slice.
+        MonitorCacheEntry::interested_t::vector_type others; // released after unlock
+        Guard G(mutex());
+        others = entry->interested.lock_vector();
+        bool inuse = false;
+        for(size_t i=0; !inuse && i<others.size(); i++)
+            inuse = !(others[i]->slice<slice) && !(slice<others[i]->slice);
+        if(!inuse)
+            entry->slices.erase(slice);
+    }
     epicsAtomicDecrSizeT(&num_instances);
 }
 
@@ -261,12 +803,213 @@ MonitorUser::~MonitorUser()
 void
 MonitorUser::destroy()
 {
+    shared_pointer self(weakref.lock());
+    bool last;
     {
         Guard G(mutex());
         running = false;
+        if(self)
+            entry->interested.erase(self); // no more updates
+        last = entry->interested.empty();
+    }
+    entry->resume(); // others may not be full
+    // here, and not from our destructor which may run with entry->mutex() held.
+    // retain() takes the shard lock, and may drop other entries.
+    if(last)
+        entry->chan->cache->retain(entry);
+}
+
+void
+MonitorUser::setType(const pvd::StructureConstPtr& full)
+{
+    typedesc = fieldsel ? requestProjectType(full, fieldsel) : full;
+}
+
+// Add one upstream update to our queue, or merge into overflowElement if full.
+// With 'shared', 'update' must not be modified afterwards as we keep a reference.
+// 'arrival' is epicsMonotonicGet() when the update was poll()'d from upstream.
+// call with mutex() held, and not qlock.
+// @returns true if downstream should be notified (our queue was empty)
+bool
+MonitorUser::queueUpdate(const pvd::MonitorElementPtr& update, epicsUInt64 arrival)
+{
+    if(initial)
+        return false; // no start() yet
+
+    if(fieldsel) {
+        // map masks to our fields.  (any element has our type)
+        const pvd::PVStructure& utype = *overflowElement->pvStructurePtr;
+        pchanged.clear();
+        poverrun.clear();
+        projectMask(utype, *update->pvStructurePtr, *update->changedBitSet, pchanged);
+        projectMask(utype, *update->pvStructurePtr, *update->overrunBitSet, poverrun);
+        if(pchanged.isEmpty())
+            return false; // none of our fields changed
+    }
+    const pvd::BitSet& changed = fieldsel ? pchanged : *update->changedBitSet,
+                     & overrun = fieldsel ? poverrun : *update->overrunBitSet;
+
+    // rate limited, and too soon after the last update?
+    bool limited = false;
+    epicsTime now;
+    if(period>0.0) {
+        now = epicsTime::getCurrent();
+        limited = now < nextsend;
+    }
+
+    Guard Q(qlock);
+
+    // TODO: track overflow when !running (after stop())?
+    if(!running || !canQueue() || inoverflow || limited) {
+        if(!inoverflow)
+            overflowArrival = arrival;
+        inoverflow = true;
+
+        /* overrun |= update->overrun           // upstream overflows
+         * overrun |= changed & update->changed // downstream overflows
+         * changed |= update->changed           // accumulate changes
+         */
+
+        *overflowElement->overrunBitSet |= overrun;
+        overflowElement->overrunBitSet->or_and(*overflowElement->changedBitSet,
+                                               changed);
+        *overflowElement->changedBitSet |= changed;
+
+        if(shared) {
+            // snapshot is complete, so the latest is the accumulation of all
+            overflowSnap = update->pvStructurePtr;
+        } else if(fieldsel) {
+            projectCopy(*overflowElement->pvStructurePtr, *update->pvStructurePtr, &changed);
+        } else {
+            overflowElement->pvStructurePtr->copyUnchecked(*update->pvStructurePtr,
+                                                           *update->changedBitSet);
+        }
+        // arrays not changed were already sliced
+        sliceUpdate(*overflowElement->pvStructurePtr, *update->pvStructurePtr, &changed);
+
+        epicsAtomicIncrSizeT(&ndropped);
+
+        if(period>0.0 && running && !timerarmed) {
+            // rate limited updates leave overflow from RateTimer
+            if(!ratetimer) {
+                ratenotify = new RateTimer(this);
+                ratetimer = &entry->chan->cache->timerQueue->createTimer();
+            }
+            ratetimer->start(*ratenotify, nextsend);
+            timerarmed = true;
+        }
+        return false;
+    }
+    // we only come out of overflow when downstream release()s an element to us,
+    // or when RateTimer expires.
+    // !canQueue() does not imply inoverflow,
+    // however inoverflow does imply !canQueue() unless rate limited
+    assert(!inoverflow);
+
+    if(period>0.0)
+        nextsend = now + period;
+
+    bool notify = nfilled==0;
+
+    pvd::MonitorElementPtr& elem = ring[tail].elem;
+
+    // Note: can't use changed mask to optimize copies since we don't know
+    //       the state of the free element
+    if(shared) {
+        // free elements are only placeholders, queue a reference to the snapshot instead
+        elem.reset(new pvd::MonitorElement(update->pvStructurePtr));
+    } else if(fieldsel) {
+        projectCopy(*elem->pvStructurePtr, *update->pvStructurePtr, 0);
+    } else {
+        elem->pvStructurePtr->copyUnchecked(*update->pvStructurePtr);
+    }
+    sliceUpdate(*elem->pvStructurePtr, *update->pvStructurePtr, 0);
+    *elem->overrunBitSet = overrun;
+    *elem->changedBitSet = changed;
+
+    const epicsUInt64 queued = epicsMonotonicGet();
+    pushSlot(queued);
+    addLatency(&MonitorLatency::enqueue, queued-arrival);
+
+    epicsAtomicIncrSizeT(&nevents);
+
+    return notify;
+}
+
+void
+MonitorUser::sliceUpdate(pvd::PVStructure& dest, const pvd::PVStructure& src, const pvd::BitSet* destMask)
+{
+    if(!slice.active())
+        return;
+    // copied arrays reference those of 'src', so only the selected elements are ever duplicated
+    sliceCopy(dest, src, destMask, slice, &entry->slices[slice]);
+}
+
+// move accumulated changes from overflowElement to the queue, using one free element.
+// call with qlock held, inoverflow, and canQueue()
+void
+MonitorUser::pushOverflow()
+{
+    pvd::MonitorElementPtr& elem = ring[tail].elem;
+
+    if(shared) {
+        // overflowElement only holds accumulated masks.  Queue the latest snapshot
+        elem.reset(new pvd::MonitorElement(overflowSnap));
+        *elem->changedBitSet = *overflowElement->changedBitSet;
+        *elem->overrunBitSet = *overflowElement->overrunBitSet;
+        overflowSnap.reset();
+
+    } else {
+        // to avoid copy, enqueue the current overflowElement
+        // and replace it with the free element
+        elem.swap(overflowElement);
+    }
+    overflowElement->changedBitSet->clear();
+    overflowElement->overrunBitSet->clear();
+
+    const epicsUInt64 queued = epicsMonotonicGet();
+    pushSlot(queued);
+    addLatency(&MonitorLatency::enqueue, queued-overflowArrival);
+
+    inoverflow = false;
+}
+
+void
+MonitorUser::pushSlot(epicsUInt64 stamp)
+{
+    Slot& S = ring[tail];
+    S.stamp = stamp;
+    S.state = Slot::Filled;
+    tail = (tail+1u)%ring.size();
+    nfilled++;
+    freeTail();
+}
+
+void
+MonitorUser::freeTail()
+{
+    const size_t N = ring.size();
+    if(nfilled+ninuse>=N || ring[tail].state!=Slot::InUse)
+        return;
+    // Slots from tail up to head are in use or free, in no particular order.
+    // release() finds in use slots by element.
+    for(size_t i=1u; i<N; i++) {
+        Slot& S = ring[(tail+i)%N];
+        if(S.state==Slot::Free) {
+            std::swap(S, ring[tail]);
+            return;
+        }
     }
 }
 
+void
+MonitorUser::addLatency(LatencyHist MonitorLatency::*stage, epicsUInt64 ns)
+{
+    ChannelCacheEntry *chan = entry->chan;
+    (chan->latency.*stage).add(ns);
+    (chan->cache->latency.*stage).add(ns);
+}
+
 pvd::Status
 MonitorUser::start()
 {
@@ -281,38 +1024,54 @@ MonitorUser::start()
         if(!entry->startresult.isSuccess())
             return entry->startresult;
 
+        Guard Q(qlock);
+
         pvd::PVStructurePtr lval;
         if(entry->havedata)
-            lval = entry->lastelem->pvStructurePtr;
-        pvd::StructureConstPtr typedesc(entry->typedesc);
+            lval = entry->shared ? entry->lastsnap : entry->lastelem->pvStructurePtr;
 
         if(initial) {
             initial = false;
 
-            empty.resize(entry->bufferSize);
-            pvd::PVDataCreatePtr fact(pvd::getPVDataCreate());
-            for(unsigned i=0; i<empty.size(); i++) {
-                empty[i].reset(new pvd::MonitorElement(fact->createPVStructure(typedesc)));
-            }
+            ring.resize(bufferSize);
+            if(shared) {
+                // with shared snapshots, elements only carry bit masks and
+                // a reference, so may start with the same placeholder value.
+                pvd::PVStructurePtr placeholder(pvd::getPVDataCreate()->createPVStructure(typedesc));
+                for(size_t i=0; i<ring.size(); i++)
+                    ring[i].elem.reset(new pvd::MonitorElement(placeholder));
+                overflowElement.reset(new pvd::MonitorElement(placeholder));
+
+            } else {
+                // each element is completely overwritten before being queued
+                for(size_t i=0; i<ring.size(); i++)
+                    ring[i].elem = entry->pool->get(typedesc);
 
-            // extra element to accumulate updates during overflow
-            overflowElement.reset(new pvd::MonitorElement(fact->createPVStructure(typedesc)));
+                // extra element to accumulate updates during overflow
+                overflowElement = entry->pool->get(typedesc);
+            }
         }
 
-        doEvt = filled.empty();
+        doEvt = nfilled==0;
 
-        if(lval && !empty.empty()) {
+        if(lval && canQueue()) {
             //already running, notify of initial element
 
-            const pva::MonitorElementPtr& elem(empty.front());
-            elem->pvStructurePtr->copy(*lval);
+            pva::MonitorElementPtr& elem = ring[tail].elem;
+            if(shared)
+                elem.reset(new pvd::MonitorElement(lval));
+            else if(fieldsel)
+                projectCopy(*elem->pvStructurePtr, *lval, 0);
+            else
+                elem->pvStructurePtr->copy(*lval);
+            sliceUpdate(*elem->pvStructurePtr, *lval, 0);
             elem->changedBitSet->set(0); // indicate all changed
             elem->overrunBitSet->clear();
-            filled.push_back(elem);
-            empty.pop_front();
+            pushSlot(epicsMonotonicGet());
+            fanoutPending.reset(); // older than the complete value just queued
         }
 
-        doEvt &= !filled.empty();
+        doEvt &= nfilled>0;
         running = true;
     }
     if(doEvt)
@@ -323,20 +1082,35 @@ MonitorUser::start()
 pvd::Status
 MonitorUser::stop()
 {
-    Guard G(mutex());
-    running = false;
+    {
+        Guard G(mutex());
+        running = false;
+    }
+    entry->resume(); // others may not be full
     return pvd::Status::Ok;
 }
 
 pva::MonitorElementPtr
 MonitorUser::poll()
 {
-    Guard G(mutex());
+    Guard Q(qlock);
     pva::MonitorElementPtr ret;
-    if(!filled.empty()) {
-        ret = filled.front();
-        inuse.insert(ret); // track which ones are out for client use
-        filled.pop_front();
+    if(nfilled) {
+        Slot& S = ring[head];
+        assert(S.state==Slot::Filled);
+
+        const epicsUInt64 now = epicsMonotonicGet();
+        addLatency(&MonitorLatency::poll, now-S.stamp);
+        S.stamp = now;
+        S.state = Slot::InUse; // track which ones are out for client use
+        ret = S.elem;
+
+        head = (head+1u)%ring.size();
+        nfilled--;
+        ninuse++;
+#ifdef P2P_TRACK_INUSE
+        inuse.insert(ret);
+#endif
         //TODO: track lost buffers w/ wrapped shared_ptr?
     }
     return ret;
@@ -345,33 +1119,60 @@ MonitorUser::poll()
 void
 MonitorUser::release(pva::MonitorElementPtr const & monitorElement)
 {
-    Guard G(mutex());
-    //TODO: ifdef DEBUG? (only track inuse when debugging?)
-    std::set<epics::pvData::MonitorElementPtr>::iterator it = inuse.find(monitorElement);
-    if(it!=inuse.end()) {
-        inuse.erase(it);
+    bool wasfull;
+    {
+        Guard Q(qlock);
 
-        if(inoverflow) { // leaving overflow condition
+        // usually released in poll() order, so start with the oldest in use
+        const size_t N = ring.size();
+        size_t idx = N;
+        for(size_t i=0, start=(head+N-ninuse)%(N ? N : 1u); i<N; i++) {
+            size_t j = (start+i)%N;
+            if(ring[j].state==Slot::InUse && ring[j].elem==monitorElement) {
+                idx = j;
+                break;
+            }
+        }
+#ifdef P2P_TRACK_INUSE
+        if((inuse.erase(monitorElement)==1) != (idx!=N))
+            throw std::logic_error("MonitorUser in use tracking inconsistent");
+#endif
+        if(idx==N) {
+            // oh no, we've been given an element which we didn't give to downstream
+            throw std::invalid_argument("Can't release MonitorElement not in use");
+        }
 
-            // to avoid copy, enqueue the current overflowElement
-            // and replace it with the element being release()d
+        wasfull = !canQueue();
 
-            filled.push_back(overflowElement);
-            overflowElement = monitorElement;
-            overflowElement->changedBitSet->clear();
-            overflowElement->overrunBitSet->clear();
+        Slot& S = ring[idx];
+        addLatency(&MonitorLatency::release, epicsMonotonicGet()-S.stamp);
+        S.state = Slot::Free;
+        ninuse--;
+        freeTail();
 
-            inoverflow = false;
-        } else {
-            // push_back empty element
-            empty.push_back(monitorElement);
-        }
-    } else {
-        // oh no, we've been given an element which we didn't give to downstream
-        //TODO: check empty and filled lists to see if this is one of ours, of from somewhere else
-        throw std::invalid_argument("Can't release MonitorElement not in use");
+        // rate limited MonitorUser leaves overflow from RateTimer
+        if(inoverflow && period<=0.0 && canQueue()) // leaving overflow condition
+            pushOverflow();
+    }
+    // upstream credit is returned as resume() poll()s and release()s upstream elements.
+    // flowcontrol only pauses while we are full.  resume() checks MonitorCacheEntry::paused
+    if(entry->flowcontrol && wasfull)
+        entry->resume();
+}
+
+void
+MonitorUser::notifyUnlisten()
+{
+    pvd::MonitorRequester::shared_pointer req(this->req.lock());
+    if(!req)
+        return;
+    bool idle;
+    {
+        Guard Q(qlock);
+        idle = ninuse==0;
     }
-    // TODO: pipeline window update?
+    if(idle) // TODO: what about stopped?
+        req->unlisten(shared_pointer(weakref));
 }
 
 std::string
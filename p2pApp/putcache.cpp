@@ -0,0 +1,352 @@
+#include <epicsAtomic.h>
+#include <errlog.h>
+
+#include <epicsMutex.h>
+
+#include <pv/pvAccess.h>
+
+#define epicsExportSharedSymbols
+#include "helper.h"
+#include "pva2pva.h"
+#include "chancache.h"
+#include "channel.h"
+
+namespace pva = epics::pvAccess;
+namespace pvd = epics::pvData;
+
+size_t PutCacheEntry::num_instances;
+size_t PutUser::num_instances;
+
+PutCacheEntry::PutCacheEntry(ChannelCacheEntry *ent, bool coalesce)
+    :chan(ent)
+    ,coalesce(coalesce)
+    ,connected(false)
+    ,inprog(false)
+    ,getinprog(false)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+PutCacheEntry::~PutCacheEntry()
+{
+    pva::ChannelPut::shared_pointer P;
+    P.swap(op);
+    if(P) {
+        P->destroy();
+    }
+    epicsAtomicDecrSizeT(&num_instances);
+    const_cast<ChannelCacheEntry*&>(chan) = NULL; // spoil to fault use after free
+}
+
+void
+PutCacheEntry::sendNext(epicsGuard<epicsMutex>& G)
+{
+    assert(!inprog && sending.empty() && havenext());
+
+    inprog = true;
+    if(coalesce) {
+        sending.swap(waiting);
+        // upstream owns sendval until putDone().  nextval keeps stale values, but only fields
+        // marked in nextchanged are ever sent.
+        sendval.swap(nextval);
+        sendchanged.swap(nextchanged);
+        nextchanged->clear();
+    } else {
+        Queued& Q = queue.front();
+        sending.push_back(Q.user);
+        sendval = Q.value;
+        sendchanged = Q.changed;
+        queue.pop_front();
+    }
+
+    epicsAtomicIncrSizeT(&chan->putUpstream);
+    epicsAtomicIncrSizeT(&chan->cache->putUpstream);
+    if(sending.size()>1) {
+        epicsAtomicAddSizeT(&chan->putCoalesced, sending.size()-1);
+        epicsAtomicAddSizeT(&chan->cache->putCoalesced, sending.size()-1);
+    }
+
+    pva::ChannelPut::shared_pointer P(op);
+    pvd::PVStructurePtr value(sendval);
+    pvd::BitSet::shared_pointer changed(sendchanged);
+
+    UnGuard U(G);
+    P->put(value, changed);
+}
+
+void
+PutCacheEntry::channelPutConnect(const pvd::Status& status,
+                                 pva::ChannelPut::shared_pointer const & channelPut,
+                                 pvd::StructureConstPtr const & structure)
+{
+    interested_t::vector_type tonotify;
+    {
+        Guard G(mutex());
+        if(!op)
+            op = channelPut; // connect during upstream createChannelPut()
+        connected = status.isSuccess();
+        connectresult = status;
+        if(connected && typedesc!=structure) {
+            typedesc = structure;
+            sendval = pvd::getPVDataCreate()->createPVStructure(structure);
+            nextval = pvd::getPVDataCreate()->createPVStructure(structure);
+            sendchanged.reset(new pvd::BitSet(sendval->getNumberFields()));
+            nextchanged.reset(new pvd::BitSet(nextval->getNumberFields()));
+        }
+
+        tonotify = interested.lock_vector();
+    }
+
+    shared_pointer self(weakref); // keeps us alive all PutUsers are destroy()ed
+
+    FOREACH(interested_t::vector_type::const_iterator, it, end, tonotify)
+    {
+        pva::ChannelPutRequester::shared_pointer req((*it)->req.lock());
+        if(req) {
+            req->channelPutConnect(status, *it, structure);
+        }
+    }
+}
+
+void
+PutCacheEntry::putDone(const pvd::Status& status,
+                       pva::ChannelPut::shared_pointer const & channelPut)
+{
+    shared_pointer self(weakref);
+    waiting_t done;
+    {
+        Guard G(mutex());
+        done.swap(sending);
+        inprog = false;
+        if(connected && havenext())
+            sendNext(G);
+    }
+
+    FOREACH(waiting_t::const_iterator, it, end, done)
+    {
+        pva::ChannelPutRequester::shared_pointer req((*it)->req.lock());
+        if(req) {
+            req->putDone(status, *it);
+        }
+    }
+}
+
+void
+PutCacheEntry::getDone(const pvd::Status& status,
+                       pva::ChannelPut::shared_pointer const & channelPut,
+                       pvd::PVStructure::shared_pointer const & pvStructure,
+                       pvd::BitSet::shared_pointer const & bitSet)
+{
+    waiting_t waiting;
+    {
+        Guard G(mutex());
+        waiting.swap(getting);
+        getinprog = false;
+    }
+
+    // as GetCacheEntry::getDone(), one copy shared by all waiting downstream
+    pvd::PVStructurePtr value;
+    pvd::BitSet::shared_pointer changed;
+    if(status.isSuccess() && pvStructure) {
+        value = pvd::getPVDataCreate()->createPVStructure(pvStructure->getStructure());
+        value->copyUnchecked(*pvStructure);
+        changed.reset(new pvd::BitSet(*bitSet));
+    }
+
+    FOREACH(waiting_t::const_iterator, it, end, waiting)
+    {
+        pva::ChannelPutRequester::shared_pointer req((*it)->req.lock());
+        if(req) {
+            req->getDone(status, *it, value, changed);
+        }
+    }
+}
+
+void
+PutCacheEntry::channelDisconnect(bool destroy)
+{
+    waiting_t failed, failedget;
+    interested_t::vector_type tonotify;
+    {
+        Guard G(mutex());
+        failed.swap(sending);
+        failed.insert(failed.end(), waiting.begin(), waiting.end());
+        waiting.clear();
+        FOREACH(queue_t::const_iterator, it, end, queue)
+            failed.push_back(it->user);
+        queue.clear();
+        failedget.swap(getting);
+        if(nextchanged)
+            nextchanged->clear();
+        inprog = getinprog = false;
+        connected = false;
+        tonotify = interested.lock_vector();
+    }
+
+    // upstream putDone() and getDone() won't come now
+    pvd::Status err(pvd::Status::STATUSTYPE_ERROR, "Upstream disconnect");
+    FOREACH(waiting_t::const_iterator, it, end, failed)
+    {
+        pva::ChannelPutRequester::shared_pointer req((*it)->req.lock());
+        if(req) {
+            req->putDone(err, *it);
+        }
+    }
+    FOREACH(waiting_t::const_iterator, it, end, failedget)
+    {
+        pva::ChannelPutRequester::shared_pointer req((*it)->req.lock());
+        if(req) {
+            req->getDone(err, *it, pvd::PVStructurePtr(), pvd::BitSet::shared_pointer());
+        }
+    }
+
+    FOREACH(interested_t::vector_type::const_iterator, it, end, tonotify)
+    {
+        pva::ChannelPutRequester::shared_pointer req((*it)->req.lock());
+        if(req) {
+            req->channelDisconnect(destroy);
+        }
+    }
+}
+
+std::string
+PutCacheEntry::getRequesterName()
+{
+    return "PutCacheEntry";
+}
+
+PutUser::PutUser(const PutCacheEntry::shared_pointer& e)
+    :entry(e)
+    ,destroyed(false)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+PutUser::~PutUser()
+{
+    epicsAtomicDecrSizeT(&num_instances);
+}
+
+// downstream server closes put
+void
+PutUser::destroy()
+{
+    entry->chan->retainOp(entry);
+
+    Guard G(mutex());
+    destroyed = true;
+}
+
+std::tr1::shared_ptr<pva::Channel>
+PutUser::getChannel()
+{
+    return srvchan.lock();
+}
+
+void
+PutUser::cancel()
+{
+    // stop waiting ourselves.  a value already merged may still be sent with those of others.
+    Guard G(mutex());
+    PutCacheEntry::waiting_t* lists[2] = {&entry->waiting, &entry->getting};
+    for(size_t i=0; i<2; i++) {
+        for(PutCacheEntry::waiting_t::iterator it(lists[i]->begin()), end(lists[i]->end());
+            it!=end; ++it)
+        {
+            if(it->get()==this) {
+                lists[i]->erase(it);
+                break;
+            }
+        }
+    }
+    if(entry->waiting.empty() && entry->nextchanged)
+        entry->nextchanged->clear();
+    for(PutCacheEntry::queue_t::iterator it(entry->queue.begin()), end(entry->queue.end());
+        it!=end; ++it)
+    {
+        if(it->user.get()==this) {
+            entry->queue.erase(it);
+            break;
+        }
+    }
+}
+
+void
+PutUser::lastRequest()
+{}
+
+void
+PutUser::put(pvd::PVStructure::shared_pointer const & pvPutStructure,
+             pvd::BitSet::shared_pointer const & putBitSet)
+{
+    pva::ChannelPutRequester::shared_pointer req(this->req.lock());
+    if(!req)
+        return;
+    shared_pointer self(weakref);
+
+    pvd::Status err;
+    {
+        Guard G(mutex());
+        if(destroyed)
+            return;
+
+        if(!entry->connected) {
+            err = pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Not connected");
+
+        } else if(pvPutStructure->getStructure()!=entry->typedesc) {
+            err = pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Put type changed");
+
+        } else {
+            if(entry->coalesce) {
+                // later puts replace the values of earlier puts not yet sent
+                entry->nextval->copyUnchecked(*pvPutStructure, *putBitSet);
+                *entry->nextchanged |= *putBitSet;
+                entry->waiting.push_back(self);
+            } else {
+                // downstream may re-use pvPutStructure after we return
+                PutCacheEntry::Queued Q;
+                Q.user = self;
+                Q.value = pvd::getPVDataCreate()->createPVStructure(entry->typedesc);
+                Q.value->copyUnchecked(*pvPutStructure, *putBitSet);
+                Q.changed.reset(new pvd::BitSet(*putBitSet));
+                entry->queue.push_back(Q);
+            }
+
+            if(!entry->inprog)
+                entry->sendNext(G);
+            return;
+        }
+    }
+
+    req->putDone(err, self);
+}
+
+void
+PutUser::get()
+{
+    pva::ChannelPutRequester::shared_pointer req(this->req.lock());
+    if(!req)
+        return;
+    shared_pointer self(weakref);
+
+    bool doget;
+    pva::ChannelPut::shared_pointer op;
+    {
+        Guard G(mutex());
+        if(destroyed)
+            return;
+        if(!entry->connected) {
+            UnGuard U(G);
+            req->getDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Not connected"),
+                         self, pvd::PVStructurePtr(), pvd::BitSet::shared_pointer());
+            return;
+        }
+        entry->getting.push_back(self);
+        doget = !entry->getinprog;
+        entry->getinprog = true;
+        op = entry->op;
+    }
+
+    if(doget)
+        op->get();
+}
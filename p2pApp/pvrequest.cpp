@@ -0,0 +1,527 @@
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <string.h>
+
+#include <pv/pvData.h>
+
+#define epicsExportSharedSymbols
+#include "pvrequest.h"
+
+namespace pvd = epics::pvData;
+
+bool requestSelectsAll(const pvd::PVStructurePtr& pvr)
+{
+    pvd::PVStructurePtr fld(pvr->getSubField<pvd::PVStructure>("field"));
+    return !fld || fld->getPVFields().empty();
+}
+
+bool requestOption(const pvd::PVStructurePtr& pvr, const std::string& name, bool dft)
+{
+    pvd::PVScalarPtr opt(pvr->getSubField<pvd::PVScalar>("record._options."+name));
+    if(!opt)
+        return dft;
+    try{
+        return opt->getAs<pvd::boolean>();
+    }catch(std::runtime_error& e){
+        return dft;
+    }
+}
+
+double requestOption(const pvd::PVStructurePtr& pvr, const std::string& name, double dft)
+{
+    pvd::PVScalarPtr opt(pvr->getSubField<pvd::PVScalar>("record._options."+name));
+    if(!opt)
+        return dft;
+    try{
+        return opt->getAs<double>();
+    }catch(std::runtime_error& e){
+        return dft;
+    }
+}
+
+bool requestRecordOptions(const pvd::PVStructurePtr& pvr, const std::string& except)
+{
+    pvd::PVStructurePtr opts(pvr->getSubField<pvd::PVStructure>("record._options"));
+    if(!opts)
+        return false;
+    const pvd::PVFieldPtrArray& F = opts->getPVFields();
+    for(size_t i=0; i<F.size(); i++) {
+        if(F[i]->getFieldName()!=except)
+            return true;
+    }
+    return false;
+}
+
+namespace {
+// copy of pvRequest with record._options.<name> set to *value, or removed if value==NULL
+pvd::PVStructurePtr rebuildOptions(const pvd::PVStructurePtr& pvRequest, const std::string& name, const std::string* value)
+{
+    pvd::FieldCreatePtr fcreate(pvd::getFieldCreate());
+
+    pvd::PVStructurePtr orecord(pvRequest->getSubField<pvd::PVStructure>("record")),
+                        ooptions(pvRequest->getSubField<pvd::PVStructure>("record._options"));
+
+    pvd::StructureConstPtr rtype(pvRequest->getStructure()),
+                           recordtype(orecord ? orecord->getStructure() : pvd::StructureConstPtr()),
+                           optionstype(ooptions ? ooptions->getStructure() : pvd::StructureConstPtr());
+
+    // rebuild, bottom up, types which include the changed field
+    if(!optionstype)
+        optionstype = fcreate->createFieldBuilder()->createStructure();
+    if(!value) {
+        pvd::StringArray names;
+        pvd::FieldConstPtrArray fields;
+        for(size_t i=0; i<optionstype->getNumberFields(); i++) {
+            if(optionstype->getFieldName(i)==name)
+                continue;
+            names.push_back(optionstype->getFieldName(i));
+            fields.push_back(optionstype->getField(i));
+        }
+        optionstype = fcreate->createStructure(optionstype->getID(), names, fields);
+    } else if(!optionstype->getField(name)) {
+        optionstype = fcreate->appendField(optionstype, name, fcreate->createScalar(pvd::pvString));
+    }
+
+    if(!recordtype)
+        recordtype = fcreate->createFieldBuilder()->createStructure();
+    if(recordtype->getField("_options")) {
+        pvd::StringArray names(recordtype->getFieldNames());
+        pvd::FieldConstPtrArray fields(recordtype->getFields());
+        for(size_t i=0; i<names.size(); i++) {
+            if(names[i]=="_options")
+                fields[i] = optionstype;
+        }
+        recordtype = fcreate->createStructure(recordtype->getID(), names, fields);
+    } else {
+        recordtype = fcreate->appendField(recordtype, "_options", optionstype);
+    }
+
+    if(rtype->getField("record")) {
+        pvd::StringArray names(rtype->getFieldNames());
+        pvd::FieldConstPtrArray fields(rtype->getFields());
+        for(size_t i=0; i<names.size(); i++) {
+            if(names[i]=="record")
+                fields[i] = recordtype;
+        }
+        rtype = fcreate->createStructure(rtype->getID(), names, fields);
+    } else {
+        rtype = fcreate->appendField(rtype, "record", recordtype);
+    }
+
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(rtype));
+
+    // copy all leaf values, which are unchanged
+    const pvd::PVFieldPtrArray& ofields(pvRequest->getPVFields());
+    for(size_t i=0; i<ofields.size(); i++) {
+        if(ofields[i]->getFieldName()!="record") {
+            ret->getSubFieldT(ofields[i]->getFieldName())->copy(*ofields[i]);
+            continue;
+        }
+        const pvd::PVFieldPtrArray& rfields(static_cast<const pvd::PVStructure&>(*ofields[i]).getPVFields());
+        for(size_t j=0; j<rfields.size(); j++) {
+            std::string rname("record."+rfields[j]->getFieldName());
+            if(rfields[j]->getFieldName()!="_options") {
+                ret->getSubFieldT(rname)->copy(*rfields[j]);
+                continue;
+            }
+            const pvd::PVFieldPtrArray& opts(static_cast<const pvd::PVStructure&>(*rfields[j]).getPVFields());
+            for(size_t k=0; k<opts.size(); k++) {
+                if(opts[k]->getFieldName()!=name)
+                    ret->getSubFieldT(rname+"."+opts[k]->getFieldName())->copy(*opts[k]);
+            }
+        }
+    }
+
+    if(value)
+        ret->getSubFieldT<pvd::PVScalar>("record._options."+name)->putFrom<std::string>(*value);
+    return ret;
+}
+} // namespace
+
+pvd::PVStructurePtr requestSetOption(const pvd::PVStructurePtr& pvRequest, const std::string& name, const std::string& value)
+{
+    return rebuildOptions(pvRequest, name, &value);
+}
+
+pvd::PVStructurePtr requestRemoveOption(const pvd::PVStructurePtr& pvRequest, const std::string& name)
+{
+    if(!pvRequest->getSubField("record._options."+name))
+        return pvRequest;
+    return rebuildOptions(pvRequest, name, 0);
+}
+
+namespace {
+bool isEmptyStruct(const pvd::FieldConstPtr& fld)
+{
+    return fld->getType()==pvd::structure
+            && static_cast<const pvd::Structure&>(*fld).getNumberFields()==0;
+}
+
+pvd::StructureConstPtr canonicalType(const pvd::PVStructure& S, unsigned depth)
+{
+    pvd::FieldCreatePtr fcreate(pvd::getFieldCreate());
+
+    typedef std::map<std::string, pvd::FieldConstPtr> fields_t;
+    fields_t fields;
+
+    const pvd::PVFieldPtrArray& F = S.getPVFields();
+    for(size_t i=0; i<F.size(); i++) {
+        const std::string& name = F[i]->getFieldName();
+        pvd::FieldConstPtr ftype;
+        switch(F[i]->getField()->getType()) {
+        case pvd::structure:
+            ftype = canonicalType(static_cast<const pvd::PVStructure&>(*F[i]), depth+1);
+            if(isEmptyStruct(ftype) && (name=="_options" || (depth==0 && name=="record")))
+                continue;
+            break;
+        case pvd::scalar:
+            ftype = fcreate->createScalar(pvd::pvString);
+            break;
+        default:
+            ftype = F[i]->getField();
+        }
+        fields[name] = ftype;
+    }
+
+    if(depth==0 && fields.find("field")==fields.end())
+        fields["field"] = fcreate->createFieldBuilder()->createStructure();
+
+    pvd::StringArray names;
+    pvd::FieldConstPtrArray types;
+    for(fields_t::const_iterator it(fields.begin()), end(fields.end()); it!=end; ++it) {
+        names.push_back(it->first);
+        types.push_back(it->second);
+    }
+    return fcreate->createStructure(names, types);
+}
+
+void canonicalCopy(pvd::PVStructure& dest, const pvd::PVStructure& src)
+{
+    const pvd::PVFieldPtrArray& F = dest.getPVFields();
+    for(size_t i=0; i<F.size(); i++) {
+        pvd::PVFieldPtr sfld(src.getSubField(F[i]->getFieldName()));
+        if(!sfld)
+            continue; // added "field"
+        switch(F[i]->getField()->getType()) {
+        case pvd::structure:
+            canonicalCopy(static_cast<pvd::PVStructure&>(*F[i]), static_cast<const pvd::PVStructure&>(*sfld));
+            break;
+        case pvd::scalar:
+            static_cast<pvd::PVScalar&>(*F[i]).putFrom<std::string>(static_cast<const pvd::PVScalar&>(*sfld).getAs<std::string>());
+            break;
+        default:
+            F[i]->copy(*sfld);
+        }
+    }
+}
+
+bool hasOptions(const pvd::PVStructure& S)
+{
+    const pvd::PVFieldPtrArray& F = S.getPVFields();
+    for(size_t i=0; i<F.size(); i++) {
+        if(F[i]->getFieldName()=="_options")
+            return true;
+        if(F[i]->getField()->getType()==pvd::structure && hasOptions(static_cast<const pvd::PVStructure&>(*F[i])))
+            return true;
+    }
+    return false;
+}
+
+// in a "field" selection, an empty sub-structure selects all of that field
+bool covers(const pvd::PVStructure& super, const pvd::PVStructure& sub)
+{
+    const pvd::PVFieldPtrArray& F = sub.getPVFields();
+    if(super.getPVFields().empty())
+        return true;
+    else if(F.empty())
+        return false;
+    for(size_t i=0; i<F.size(); i++) {
+        pvd::PVStructurePtr S(super.getSubField<pvd::PVStructure>(F[i]->getFieldName()));
+        if(!S || F[i]->getField()->getType()!=pvd::structure
+                || !covers(*S, static_cast<const pvd::PVStructure&>(*F[i])))
+            return false;
+    }
+    return true;
+}
+
+pvd::StructureConstPtr projectType(const pvd::StructureConstPtr& full, const pvd::PVStructure& sel)
+{
+    if(sel.getPVFields().empty())
+        return full;
+
+    pvd::StringArray names;
+    pvd::FieldConstPtrArray types;
+    for(size_t i=0, N=full->getNumberFields(); i<N; i++) {
+        const std::string& name = full->getFieldName(i);
+        pvd::PVStructurePtr S(sel.getSubField<pvd::PVStructure>(name));
+        if(!S)
+            continue;
+        pvd::FieldConstPtr ftype(full->getField(i));
+        if(ftype->getType()==pvd::structure)
+            ftype = projectType(std::tr1::static_pointer_cast<const pvd::Structure>(ftype), *S);
+        names.push_back(name);
+        types.push_back(ftype);
+    }
+    return pvd::getFieldCreate()->createStructure(names, types);
+}
+
+// is any bit in [fld.getFieldOffset(), fld.getNextFieldOffset()) set?
+inline bool anySet(const pvd::BitSet& mask, const pvd::PVField& fld)
+{
+    pvd::int32 n = mask.nextSetBit(fld.getFieldOffset());
+    return n>=0 && size_t(n)<fld.getNextFieldOffset();
+}
+} // namespace
+
+namespace {
+// "[name=value,...]"
+void optionString(std::ostream& strm, const pvd::PVStructure& opts)
+{
+    const pvd::PVFieldPtrArray& F = opts.getPVFields();
+    strm<<'[';
+    for(size_t i=0, n=0; i<F.size(); i++) {
+        pvd::PVScalar *S = dynamic_cast<pvd::PVScalar*>(F[i].get());
+        if(!S)
+            continue;
+        if(n++)
+            strm<<',';
+        strm<<F[i]->getFieldName()<<'='<<S->getAs<std::string>();
+    }
+    strm<<']';
+}
+
+// list selected leaves as dotted paths.  an empty sub-structure selects the whole field
+void fieldString(std::ostream& strm, const pvd::PVStructure& sel, const std::string& prefix, bool& first)
+{
+    const pvd::PVFieldPtrArray& F = sel.getPVFields();
+    for(size_t i=0; i<F.size(); i++) {
+        const std::string& name = F[i]->getFieldName();
+        const pvd::PVStructure *sub = dynamic_cast<const pvd::PVStructure*>(F[i].get());
+        if(name=="_options" || !sub)
+            continue;
+
+        pvd::PVStructurePtr opts(sub->getSubField<pvd::PVStructure>("_options"));
+        size_t nchild = sub->getPVFields().size() - (opts ? 1u : 0u);
+
+        if(nchild) {
+            fieldString(strm, *sub, prefix+name+".", first);
+        } else {
+            if(!first)
+                strm<<',';
+            first = false;
+            strm<<prefix<<name;
+            if(opts)
+                optionString(strm, *opts);
+        }
+    }
+}
+} // namespace
+
+std::string requestString(const pvd::PVStructurePtr& pvRequest)
+{
+    std::ostringstream strm;
+
+    pvd::PVStructurePtr opts(pvRequest->getSubField<pvd::PVStructure>("record._options"));
+    if(opts && !opts->getPVFields().empty()) {
+        strm<<"record";
+        optionString(strm, *opts);
+    }
+
+    strm<<"field(";
+    pvd::PVStructurePtr fld(pvRequest->getSubField<pvd::PVStructure>("field"));
+    if(fld) {
+        bool first = true;
+        fieldString(strm, *fld, std::string(), first);
+    }
+    strm<<')';
+    return strm.str();
+}
+
+pvd::PVStructurePtr requestCanonical(const pvd::PVStructurePtr& pvRequest)
+{
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(canonicalType(*pvRequest, 0)));
+    canonicalCopy(*ret, *pvRequest);
+    return ret;
+}
+
+bool requestFieldOptions(const pvd::PVStructurePtr& pvRequest)
+{
+    pvd::PVStructurePtr fld(pvRequest->getSubField<pvd::PVStructure>("field"));
+    return fld && hasOptions(*fld);
+}
+
+bool requestCovers(const pvd::PVStructurePtr& super, const pvd::PVStructurePtr& sub)
+{
+    if(requestSelectsAll(super))
+        return true;
+    else if(requestSelectsAll(sub))
+        return false;
+    return covers(*super->getSubFieldT<pvd::PVStructure>("field"), *sub->getSubFieldT<pvd::PVStructure>("field"));
+}
+
+pvd::StructureConstPtr requestProjectType(const pvd::StructureConstPtr& full, const pvd::PVStructurePtr& pvRequest)
+{
+    if(requestSelectsAll(pvRequest))
+        return full;
+    return projectType(full, *pvRequest->getSubFieldT<pvd::PVStructure>("field"));
+}
+
+void projectMask(const pvd::PVStructure& dest,
+                 const pvd::PVStructure& src,
+                 const pvd::BitSet& srcMask,
+                 pvd::BitSet& destMask)
+{
+    if(srcMask.get(src.getFieldOffset()))
+        destMask.set(dest.getFieldOffset());
+
+    // fields of dest are a sub-set of src, in the same order
+    const pvd::PVFieldPtrArray& D = dest.getPVFields(),
+                              & S = src.getPVFields();
+    for(size_t i=0, j=0; i<D.size(); i++) {
+        while(j<S.size() && S[j]->getFieldName()!=D[i]->getFieldName())
+            j++;
+        if(j==S.size())
+            throw std::logic_error("projectMask() dest not a projection of src");
+        const pvd::PVField& sfld = *S[j];
+
+        if(!anySet(srcMask, sfld))
+            continue;
+        else if(D[i]->getField()->getType()==pvd::structure)
+            projectMask(static_cast<const pvd::PVStructure&>(*D[i]), static_cast<const pvd::PVStructure&>(sfld),
+                        srcMask, destMask);
+        else
+            destMask.set(D[i]->getFieldOffset());
+    }
+}
+
+void projectCopy(pvd::PVStructure& dest,
+                 const pvd::PVStructure& src,
+                 const pvd::BitSet* destMask)
+{
+    if(destMask && destMask->get(dest.getFieldOffset()))
+        destMask = 0; // all sub-fields changed
+
+    if(!destMask && dest.getStructure()==src.getStructure()) {
+        dest.copyUnchecked(src);
+        return;
+    }
+
+    const pvd::PVFieldPtrArray& D = dest.getPVFields(),
+                              & S = src.getPVFields();
+    for(size_t i=0, j=0; i<D.size(); i++) {
+        while(j<S.size() && S[j]->getFieldName()!=D[i]->getFieldName())
+            j++;
+        if(j==S.size())
+            throw std::logic_error("projectCopy() dest not a projection of src");
+
+        if(destMask && !anySet(*destMask, *D[i]))
+            continue;
+        else if(D[i]->getField()->getType()==pvd::structure)
+            projectCopy(static_cast<pvd::PVStructure&>(*D[i]), static_cast<const pvd::PVStructure&>(*S[j]), destMask);
+        else
+            D[i]->copyUnchecked(*S[j]);
+    }
+}
+
+pvd::shared_vector<const void>
+ArraySlice::apply(const pvd::shared_vector<const void>& src, pvd::ScalarType type) const
+{
+    // untyped vectors count bytes
+    const size_t esize = pvd::ScalarTypeFunc::elementSize(type),
+                 nelem = src.size()/esize,
+                 first = std::min(start, nelem),
+                 avail = nelem-first,
+                 n = count ? std::min(count, avail) : avail;
+
+    if(stride<=1u) {
+        pvd::shared_vector<const void> ret(src);
+        ret.slice(first*esize, n*esize);
+        return ret;
+    }
+
+    const size_t nout = (n+stride-1u)/stride;
+
+    if(type==pvd::pvString) {
+        pvd::shared_vector<const std::string> in(pvd::static_shared_vector_cast<const std::string>(src));
+        pvd::shared_vector<std::string> out(nout);
+        for(size_t i=0; i<nout; i++)
+            out[i] = in[first+i*stride];
+        return pvd::static_shared_vector_cast<const void>(pvd::freeze(out));
+    }
+
+    pvd::shared_vector<void> out(pvd::ScalarTypeFunc::allocArray(type, nout));
+    const char *in = static_cast<const char*>(src.data());
+    char *o = static_cast<char*>(out.data());
+    for(size_t i=0; i<nout; i++)
+        memcpy(o+i*esize, in+(first+i*stride)*esize, esize);
+    return pvd::freeze(out);
+}
+
+ArraySlice requestSlice(const pvd::PVStructurePtr& pvRequest)
+{
+    ArraySlice ret;
+    double start = requestOption(pvRequest, "arrayStart", 0.0),
+           count = requestOption(pvRequest, "arrayCount", 0.0),
+           stride = requestOption(pvRequest, "arrayStride", 1.0);
+    if(start>0.0)
+        ret.start = size_t(start);
+    if(count>0.0)
+        ret.count = size_t(count);
+    if(stride>1.0)
+        ret.stride = size_t(stride);
+    return ret;
+}
+
+void sliceCopy(pvd::PVStructure& dest,
+               const pvd::PVStructure& src,
+               const pvd::BitSet* destMask,
+               const ArraySlice& slice,
+               SliceCache* cache)
+{
+    if(destMask && destMask->get(dest.getFieldOffset()))
+        destMask = 0; // all sub-fields changed
+
+    const pvd::PVFieldPtrArray& D = dest.getPVFields(),
+                              & S = src.getPVFields();
+    for(size_t i=0, j=0; i<D.size(); i++) {
+        while(j<S.size() && S[j]->getFieldName()!=D[i]->getFieldName())
+            j++;
+        if(j==S.size())
+            throw std::logic_error("sliceCopy() dest not a projection of src");
+
+        if(destMask && !anySet(*destMask, *D[i]))
+            continue;
+
+        switch(D[i]->getField()->getType()) {
+        case pvd::structure:
+            sliceCopy(static_cast<pvd::PVStructure&>(*D[i]), static_cast<const pvd::PVStructure&>(*S[j]),
+                      destMask, slice, cache);
+            break;
+        case pvd::scalarArray: {
+            pvd::PVScalarArray& darr = static_cast<pvd::PVScalarArray&>(*D[i]);
+            const pvd::PVScalarArray& sarr = static_cast<const pvd::PVScalarArray&>(*S[j]);
+
+            pvd::shared_vector<const void> full;
+            sarr._getAsVoid(full);
+
+            if(slice.stride<=1u || !cache) {
+                darr._putFromVoid(slice.apply(full, sarr.getScalarArray()->getElementType()));
+                break;
+            }
+
+            // decimated copies are shared while the source array is unchanged
+            SliceCache::Slot& slot = cache->slots[S[j]->getFieldOffset()];
+            if(slot.src.data()!=full.data() || slot.src.size()!=full.size()) {
+                slot.result = slice.apply(full, sarr.getScalarArray()->getElementType());
+                slot.src = full;
+            }
+            darr._putFromVoid(slot.result);
+        }
+            break;
+        default:
+            break; // already copied
+        }
+    }
+}
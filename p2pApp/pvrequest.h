@@ -0,0 +1,113 @@
+#ifndef PVREQUEST_H
+#define PVREQUEST_H
+
+#include <map>
+
+#include <pv/pvData.h>
+
+// Helpers for inspecting and modifying pvRequest structures
+
+//! does pvRequest select all fields?  (eg. "field()")
+bool requestSelectsAll(const epics::pvData::PVStructurePtr& pvRequest);
+
+//! value of record._options.<name> as a boolean, or 'dft' if not present or not valid
+bool requestOption(const epics::pvData::PVStructurePtr& pvRequest, const std::string& name, bool dft);
+//! value of record._options.<name> as a number, or 'dft' if not present or not valid
+double requestOption(const epics::pvData::PVStructurePtr& pvRequest, const std::string& name, double dft);
+
+//! does pvRequest have any record._options other than 'except'?
+bool requestRecordOptions(const epics::pvData::PVStructurePtr& pvRequest, const std::string& except = std::string());
+
+//! copy of pvRequest with record._options.<name> set to 'value'.  (PVA sends options as strings)
+epics::pvData::PVStructurePtr requestSetOption(const epics::pvData::PVStructurePtr& pvRequest,
+                                               const std::string& name,
+                                               const std::string& value);
+
+//! copy of pvRequest without record._options.<name>, or pvRequest itself if not present.
+epics::pvData::PVStructurePtr requestRemoveOption(const epics::pvData::PVStructurePtr& pvRequest,
+                                                  const std::string& name);
+
+/** Copy of pvRequest with fields, at every level, sorted by name, and leaf values as strings.
+ *  Empty "record" and "_options" are removed, and an empty "field" added if absent.
+ *  Requests which differ only in ordering, or in the type of option values, have equal canonical forms.
+ */
+epics::pvData::PVStructurePtr requestCanonical(const epics::pvData::PVStructurePtr& pvRequest);
+
+/** pvRequest string (eg. "record[queueSize=4]field(value,alarm)") which parses to a request
+ *  equivalent to pvRequest.  Leaf option values must be scalars.
+ */
+std::string requestString(const epics::pvData::PVStructurePtr& pvRequest);
+
+//! does the field selection of pvRequest include any field._options?
+bool requestFieldOptions(const epics::pvData::PVStructurePtr& pvRequest);
+
+/** Is every field selected by 'sub' also selected by 'super'?
+ *  Compares only the "field" selections, which should not include _options.
+ */
+bool requestCovers(const epics::pvData::PVStructurePtr& super, const epics::pvData::PVStructurePtr& sub);
+
+/** Type with those fields of 'full' selected by pvRequest, in the order of 'full'.
+ *  Partly selected sub-structures lose their type ID.
+ */
+epics::pvData::StructureConstPtr requestProjectType(const epics::pvData::StructureConstPtr& full,
+                                                    const epics::pvData::PVStructurePtr& pvRequest);
+
+// Helpers for copying between a structure and a projection (see requestProjectType()).
+// 'dest' is the projection, and 'src' the full structure.
+
+//! Set bits of destMask for fields of 'dest' corresponding to those marked in srcMask
+void projectMask(const epics::pvData::PVStructure& dest,
+                 const epics::pvData::PVStructure& src,
+                 const epics::pvData::BitSet& srcMask,
+                 epics::pvData::BitSet& destMask);
+
+//! Copy fields of 'dest' marked in destMask from 'src'.  destMask==NULL copies all.
+void projectCopy(epics::pvData::PVStructure& dest,
+                 const epics::pvData::PVStructure& src,
+                 const epics::pvData::BitSet* destMask);
+
+/** Selection of array elements [start, start+count), taking every stride'th.
+ *  count==0 selects to the end.  Applied to every scalar array field.
+ */
+struct ArraySlice
+{
+    size_t start, count, stride;
+    ArraySlice() :start(0u), count(0u), stride(1u) {}
+    //! selects less than all elements of some arrays
+    inline bool active() const { return start!=0u || count!=0u || stride>1u; }
+    inline bool operator<(const ArraySlice& o) const {
+        if(start!=o.start) return start<o.start;
+        if(count!=o.count) return count<o.count;
+        return stride<o.stride;
+    }
+    //! selected elements of 'src' with element type 'type'.  Shares storage with 'src' when stride==1
+    epics::pvData::shared_vector<const void> apply(const epics::pvData::shared_vector<const void>& src,
+                                                   epics::pvData::ScalarType type) const;
+};
+
+//! ArraySlice from record._options.arrayStart, arrayCount, and arrayStride
+ArraySlice requestSlice(const epics::pvData::PVStructurePtr& pvRequest);
+
+/** Results of one ArraySlice by field offset in the source, so that subscribers with
+ *  equal slices of an update share one copy of each decimated array.
+ */
+struct SliceCache
+{
+    struct Slot {
+        epics::pvData::shared_vector<const void> src, result;
+    };
+    typedef std::map<size_t, Slot> slots_t;
+    slots_t slots;
+};
+
+/** Replace scalar arrays of 'dest', marked in destMask, with a slice of the array in 'src'.
+ *  'dest' is a projection of 'src' (or the same type), with values already copied by projectCopy().
+ *  destMask==NULL slices all.  cache may be NULL.
+ */
+void sliceCopy(epics::pvData::PVStructure& dest,
+               const epics::pvData::PVStructure& src,
+               const epics::pvData::BitSet* destMask,
+               const ArraySlice& slice,
+               SliceCache* cache);
+
+#endif // PVREQUEST_H
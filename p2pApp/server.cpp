@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <algorithm>
 
 #include <epicsAtomic.h>
 #include <epicsString.h>
@@ -32,6 +33,8 @@ GWServerChannelProvider::getChannelProvider()
 
 // Called from UDP search thread with no locks held
 // Called from TCP threads (for search w/ TCP)
+// Never waits for upstream.  A new name is queued for creation, and the search is answered
+// when the upstream channel connects, or reported as not found after deferTimeout.
 pva::ChannelFind::shared_pointer
 GWServerChannelProvider::channelFind(std::string const & channelName,
                                      pva::ChannelFindRequester::shared_pointer const & channelFindRequester)
@@ -42,10 +45,22 @@ GWServerChannelProvider::channelFind(std::string const & channelName,
     if(!channelName.empty())
     {
         LOG(pva::logLevelDebug, "Searching for '%s'", channelName.c_str());
-        ChannelCacheEntry::shared_pointer ent(cache.lookup(channelName));
+        ChannelCacheEntry::shared_pointer ent(cache.lookup(channelName, true));
         if(ent) {
             found = true;
             ret = shared_from_this();
+
+        } else {
+            switch(cache.deferSearch(channelName, channelFindRequester, shared_from_this())) {
+            case ChannelCache::Deferred:
+                return ret; // answered when upstream connects, or times out
+            case ChannelCache::Connected:
+                found = true;
+                ret = shared_from_this();
+                break;
+            case ChannelCache::NotDeferred:
+                break;
+            }
         }
     }
 
@@ -68,9 +83,10 @@ GWServerChannelProvider::createChannel(std::string const & channelName,
 
     if(!channelName.empty())
     {
-        Guard G(cache.cacheLock);
+        // prevent the cleaner from removing the entry before we are added to 'interested'
+        Guard G(cache.shardFor(channelName).lock);
 
-        ChannelCacheEntry::shared_pointer ent(cache.lookup(channelName)); // recursively locks cacheLock
+        ChannelCacheEntry::shared_pointer ent(cache.lookup(channelName)); // recursively locks shard lock
 
         if(ent)
         {
@@ -93,6 +109,153 @@ GWServerChannelProvider::createChannel(std::string const & channelName,
 
 void GWServerChannelProvider::destroy() {}
 
+void SearchLimit::Bucket::refill(const epicsTime& now, double rate, double burst)
+{
+    double dT = now - last;
+    last = now;
+    if(dT>0.0)
+        tokens = std::min(burst, tokens + dT*rate);
+}
+
+SearchLimit::SearchLimit(double rate, double burst, double totalRate, double totalBurst)
+    :rate(rate)
+    ,burst(burst>=1.0 ? burst : std::max(1.0, rate))
+    ,totalRate(totalRate)
+    ,totalBurst(totalBurst>=1.0 ? totalBurst : std::max(1.0, totalRate))
+    ,maxSources(4096u)
+    ,total(this->totalBurst, epicsTime::getCurrent())
+    ,overflow(this->burst, total.last)
+    ,lastSweep(total.last)
+    ,recent(16u)
+    ,nextRecent(0u)
+{}
+
+SearchLimit::result_t
+SearchLimit::take(const std::string& source, const std::tr1::shared_ptr<void>& search)
+{
+    epicsTime now(epicsTime::getCurrent());
+    Guard G(lock);
+
+    if(search) {
+        for(size_t i=0; i<recent.size(); i++) {
+            if(recent[i].search.lock()==search)
+                return recent[i].result;
+        }
+    }
+
+    result_t ret = charge(now, source);
+
+    if(search) {
+        Recent& R = recent[nextRecent];
+        nextRecent = (nextRecent+1u)%recent.size();
+        R.search = search;
+        R.result = ret;
+    }
+    return ret;
+}
+
+SearchLimit::result_t
+SearchLimit::charge(const epicsTime& now, const std::string& source)
+{
+    Bucket *src = 0;
+    if(rate>0.0) {
+        sources_t::iterator it(sources.find(source));
+
+        if(it==sources.end() && sources.size()>=maxSources && now - lastSweep >= burst/rate) {
+            // forget sources which have been quiet long enough to refill.
+            // At most once for each time an empty bucket takes to refill.
+            lastSweep = now;
+            for(sources_t::iterator it2(sources.begin()), end(sources.end()); it2!=end;) {
+                sources_t::iterator cur(it2++);
+                cur->second.refill(now, rate, burst);
+                if(cur->second.tokens>=burst)
+                    sources.erase(cur);
+            }
+        }
+
+        if(it!=sources.end()) {
+            src = &it->second;
+            src->refill(now, rate, burst);
+        } else if(sources.size()<maxSources) {
+            src = &sources.insert(std::make_pair(source, Bucket(burst, now))).first->second;
+        } else {
+            // sources beyond maxSources share one bucket
+            src = &overflow;
+            src->refill(now, rate, burst);
+        }
+
+        if(src && src->tokens<1.0)
+            return Throttled;
+    }
+
+    if(totalRate>0.0) {
+        total.refill(now, totalRate, totalBurst);
+        if(total.tokens<1.0)
+            return Dropped;
+        total.tokens -= 1.0;
+    }
+
+    if(src)
+        src->tokens -= 1.0;
+    return Allowed;
+}
+
+size_t SearchLimit::nsources()
+{
+    Guard G(lock);
+    return sources.size();
+}
+
+GWSearchLimiter::GWSearchLimiter(const GWServerChannelProvider::shared_pointer& client,
+                                 const SearchLimit::shared_pointer& limit)
+    :client(client)
+    ,limit(limit)
+    ,nthrottled(0u)
+    ,ndropped(0u)
+{}
+
+GWSearchLimiter::~GWSearchLimiter() {}
+
+// Called from UDP search thread with no locks held
+// Called from TCP threads (for search w/ TCP)
+pva::ChannelFind::shared_pointer
+GWSearchLimiter::channelFind(std::string const & channelName,
+                             pva::ChannelFindRequester::shared_pointer const & channelFindRequester)
+{
+    // any name already cached, connected or not, costs upstream nothing more
+    if(!channelName.empty() && !client->cache.find(channelName)) {
+        std::string source;
+        std::tr1::shared_ptr<const pva::PeerInfo> info(channelFindRequester->getPeerInfo());
+        if(info) {
+            // "host:port", where the port of a UDP search may change
+            source = info->peer.substr(0, info->peer.find_last_of(':'));
+        }
+
+        SearchLimit::result_t result = limit->take(source, channelFindRequester);
+        if(result!=SearchLimit::Allowed) {
+            if(result==SearchLimit::Throttled)
+                epicsAtomicIncrSizeT(&nthrottled);
+            else
+                epicsAtomicIncrSizeT(&ndropped);
+            LOG(pva::logLevelDebug, "Search limit for '%s' from '%s'", channelName.c_str(), source.c_str());
+
+            pva::ChannelFind::shared_pointer ret;
+            channelFindRequester->channelFindResult(pvd::Status::Ok, ret, false);
+            return ret;
+        }
+    }
+
+    return client->channelFind(channelName, channelFindRequester);
+}
+
+pva::Channel::shared_pointer
+GWSearchLimiter::createChannel(std::string const & channelName,
+                               pva::ChannelRequester::shared_pointer const & channelRequester,
+                               short priority, std::string const & address)
+{
+    return client->createChannel(channelName, channelRequester, priority, address);
+}
+
 GWServerChannelProvider::GWServerChannelProvider(const pva::ChannelProvider::shared_pointer& prov)
     :cache(prov)
 {}
@@ -114,25 +277,19 @@ void ServerConfig::drop(const char *client, const char *channel)
 
         const GWServerChannelProvider::shared_pointer& prov(it->second);
 
-        ChannelCacheEntry::shared_pointer entry;
-
-        // find the channel, if it's there
-        {
-            Guard G(prov->cache.cacheLock);
-
-            ChannelCache::entries_t::iterator it = prov->cache.entries.find(channel);
-            if(it==prov->cache.entries.end())
-                continue;
-
-            std::cout<<"Drop from "<<it->first<<" : "<<it->second->channelName<<"\n";
+        // find the channel, if it's there, and drop out of cache (TODO: not required)
+        ChannelCacheEntry::shared_pointer entry(prov->cache.erase(channel));
+        if(!entry)
+            continue;
 
-            entry = it->second;
-            prov->cache.entries.erase(it); // drop out of cache (TODO: not required)
-        }
+        std::cout<<"Drop from "<<it->first<<" : "<<entry->channelName<<"\n";
 
         // trigger client side disconnect (recursively calls call CRequester::channelStateChange())
         // TODO: shouldn't need this
-        entry->channel->destroy();
+        // NULL while still queued to the Creator
+        pva::Channel::shared_pointer chan(entry->upstream());
+        if(chan)
+            chan->destroy();
 
     }
 }
@@ -150,6 +307,20 @@ void ServerConfig::status_server(int lvl, const char *server)
         const pva::ServerContext::shared_pointer& serv(it->second);
         std::cout<<"==> Server: "<<it->first<<"\n";
         serv->printInfo(std::cout);
+
+        server_limiters_t::const_iterator lit(limiters.find(it->first));
+        if(lit!=limiters.end() && !lit->second.empty()) {
+            SearchLimit& L = *lit->second.begin()->second->limit;
+            std::cout<<"Search limit "<<L.rate<<"/s (burst "<<L.burst<<") per source, "
+                     <<L.totalRate<<"/s (burst "<<L.totalBurst<<") total.  "
+                     <<L.nsources()<<" sources\n";
+            FOREACH(limiters_t::const_iterator, it2, end2, lit->second)
+            {
+                std::cout<<"  client "<<it2->first<<" : "
+                         <<epicsAtomicGetSizeT(&it2->second->nthrottled)<<" throttled, "
+                         <<epicsAtomicGetSizeT(&it2->second->ndropped)<<" dropped\n";
+            }
+        }
         std::cout<<"<== Server: "<<it->first<<"\n\n";
         // TODO: print client list somehow
     }
@@ -175,27 +346,119 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
 
         ChannelCache::entries_t entries;
 
-        size_t ncache, ncleaned, ndust;
+        size_t ncache, ncleaned, nidle, nsize;
         {
-            Guard G(prov->cache.cacheLock);
-
-            ncache = prov->cache.entries.size();
-            ncleaned = prov->cache.cleanerRuns;
-            ndust = prov->cache.cleanerDust;
+            ncache = prov->cache.size();
+            ncleaned = epicsAtomicGetSizeT(&prov->cache.cleanerRuns);
+            nidle = epicsAtomicGetSizeT(&prov->cache.evictIdle);
+            nsize = epicsAtomicGetSizeT(&prov->cache.evictSize);
 
             if(lvl>0) {
                 if(!iswild) { // no string or some glob pattern
-                    entries = prov->cache.entries; // copy of std::map
+                    prov->cache.snapshot(entries); // copy of each shard std::map
                 } else { // just one channel
-                    ChannelCache::entries_t::iterator it(prov->cache.entries.find(channel));
-                    if(it!=prov->cache.entries.end())
-                        entries[it->first] = it->second;
+                    ChannelCacheEntry::shared_pointer ent(prov->cache.find(channel));
+                    if(ent)
+                        entries[ent->channelName] = ent;
                 }
             }
         }
 
-        std::cout<<"Cache has "<<ncache<<" channels.  Cleaned "
-                <<ncleaned<<" times closing "<<ndust<<" channels\n";
+        std::cout<<"Cache has "<<ncache<<" channels";
+        if(prov->cache.cacheMax)
+            std::cout<<" (max "<<prov->cache.cacheMax<<")";
+        if(prov->cache.contexts.size()>1)
+            std::cout<<" over "<<prov->cache.contexts.size()<<" client contexts";
+        std::cout<<".  Cleaned "<<ncleaned<<" times closing "<<nidle<<" idle and "
+                 <<nsize<<" excess channels\n";
+        {
+            ChannelCache::Creator& C = prov->cache.creator;
+            size_t depth, peak, ncreated, nrejected;
+            double avglat, maxlat;
+            {
+                Guard G(C.lock);
+                depth = C.queue.size();
+                peak = C.peakDepth;
+                ncreated = C.ncreated;
+                nrejected = C.nrejected;
+                avglat = ncreated ? C.totalLatency/ncreated : 0.0;
+                maxlat = C.maxLatency;
+            }
+            std::cout<<"Create queue "<<depth<<"/"<<C.maxDepth<<" (peak "<<peak<<"), "
+                     <<ncreated<<" created, "<<nrejected<<" rejected, latency avg "
+                     <<avglat*1e3<<" ms max "<<maxlat*1e3<<" ms\n";
+        }
+        if(prov->cache.fanout) {
+            const FanoutPool::workers_t& W = prov->cache.fanout->workers;
+            for(size_t i=0; i<W.size(); i++) {
+                size_t depth, peak, nprocessed;
+                {
+                    Guard G(W[i]->lock);
+                    depth = W[i]->queue.size();
+                    peak = W[i]->peak;
+                    nprocessed = W[i]->nprocessed;
+                }
+                std::cout<<"Fanout worker "<<i<<" backlog "<<depth<<" (peak "<<peak<<"), "
+                         <<nprocessed<<" updates\n";
+            }
+        }
+        std::cout<<"getField "<<epicsAtomicGetSizeT(&prov->cache.fieldHits)<<" cache hits, "
+                 <<epicsAtomicGetSizeT(&prov->cache.fieldMisses)<<" misses\n";
+        std::cout<<"get "<<epicsAtomicGetSizeT(&prov->cache.getUpstream)<<" upstream, "
+                 <<epicsAtomicGetSizeT(&prov->cache.getCoalesced)<<" coalesced, "
+                 <<epicsAtomicGetSizeT(&prov->cache.getMonitor)<<" from monitor\n";
+        std::cout<<"put "<<epicsAtomicGetSizeT(&prov->cache.putUpstream)<<" through shared operations, "
+                 <<epicsAtomicGetSizeT(&prov->cache.putCoalesced)<<" coalesced\n";
+        std::cout<<"get/put "<<epicsAtomicGetSizeT(&prov->cache.opReused)<<" re-used an upstream operation";
+        if(prov->cache.opRetain>0.0)
+            std::cout<<", idle operations kept "<<prov->cache.opRetain<<"s";
+        std::cout<<"\n";
+        std::cout<<"monitor "<<epicsAtomicGetSizeT(&prov->cache.monProjected)<<" attached to a monitor with more fields, "
+                 <<epicsAtomicGetSizeT(&prov->cache.monSliced)<<" with array slices\n";
+        {
+            ElementPool& P = *prov->cache.pool;
+            size_t nfree, ntypes, nhits, nmisses, ndiscards;
+            {
+                Guard G(P.lock);
+                nfree = P.nfree;
+                ntypes = P.free.size();
+                nhits = P.nhits;
+                nmisses = P.nmisses;
+                ndiscards = P.ndiscards;
+            }
+            std::cout<<"Element pool "<<nfree<<"/"<<P.maxFree<<" free elements of "<<ntypes<<" types, "
+                     <<nhits<<" hits "<<nmisses<<" misses "<<ndiscards<<" discards\n";
+        }
+        if(prov->cache.monitorRetain>0.0) {
+            ChannelCache& C = prov->cache;
+            size_t nretained, nhits, nexpired, nevicted;
+            {
+                Guard G(C.retainLock);
+                nretained = C.nretained;
+                nhits = C.retainHits;
+                nexpired = C.retainExpired;
+                nevicted = C.retainEvicted;
+            }
+            std::cout<<"Retained "<<nretained<<"/"<<C.monitorRetainMax<<" idle monitors, "
+                     <<nhits<<" re-used, "<<nexpired<<" expired, "<<nevicted<<" evicted\n";
+        }
+        if(!prov->cache.warmFile.empty())
+            std::cout<<"Warm start file \""<<prov->cache.warmFile<<"\" written "
+                     <<epicsAtomicGetSizeT(&prov->cache.warmSaves)<<" times\n";
+        if(prov->cache.reconnectHold>0.0)
+            std::cout<<"Upstream disconnects "<<epicsAtomicGetSizeT(&prov->cache.reconnectHeld)<<" held, "
+                     <<epicsAtomicGetSizeT(&prov->cache.reconnectResumed)<<" resumed, "
+                     <<epicsAtomicGetSizeT(&prov->cache.reconnectExpired)<<" expired, "
+                     <<epicsAtomicGetSizeT(&prov->cache.reconnectRetyped)<<" type changed\n";
+        if(prov->cache.deferTimeout>0.0)
+            std::cout<<epicsAtomicGetSizeT(&prov->cache.deferReplies)<<" held searches answered on connect\n";
+        if(prov->cache.negativeTTL>0.0)
+            std::cout<<"Negative cache has "<<prov->cache.negativeSize()<<" names.  "
+                     <<epicsAtomicGetSizeT(&prov->cache.negativeHits)<<" searches skipped\n";
+        if(lvl>2) {
+            std::cout<<"Monitor latency (count@bin)\n";
+            prov->cache.latency.show(std::cout, "  ");
+        }
 
         if(lvl<=0)
             continue;
@@ -209,14 +472,18 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
             ChannelCacheEntry& E = *it2->second;
             ChannelCacheEntry::mon_entries_t::lock_vector_type mons;
             size_t nsrv, nmon;
-            bool dropflag;
-            const char *chstate;
+            double idle;
+            {
+                Guard G(prov->cache.shardFor(channame).lock);
+                idle = epicsTime::getCurrent() - E.lastused;
+            }
+            const char *chstate = "QUEUED"; // to the Creator
             {
                 Guard G(E.mutex());
-                chstate = pva::Channel::ConnectionStateNames[E.channel->getConnectionState()];
+                if(E.channel)
+                    chstate = pva::Channel::ConnectionStateNames[E.channel->getConnectionState()];
                 nsrv = E.interested.size();
                 nmon = E.mon_entries.size();
-                dropflag = E.dropPoke;
 
                 if(lvl>1)
                     mons = E.mon_entries.lock_vector();
@@ -226,11 +493,17 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
                      <<" Client Channel '"<<channame
                      <<"' used by "<<nsrv<<" Server channel(s) with "
                      <<nmon<<" unique subscription(s) "
-                     <<(dropflag?'!':'_')<<"\n";
+                     <<"idle "<<idle<<"s\n";
+            if(size_t nput = epicsAtomicGetSizeT(&E.putUpstream))
+                std::cout<<"  put "<<nput<<" upstream, "
+                         <<epicsAtomicGetSizeT(&E.putCoalesced)<<" coalesced\n";
 
             if(lvl<=1)
                 continue;
 
+            if(lvl>2 && nmon)
+                E.latency.show(std::cout, "  latency ");
+
             FOREACH(ChannelCacheEntry::mon_entries_t::lock_vector_type::const_iterator, it2, end2, mons) {
                 MonitorCacheEntry& ME =  *it2->second;
 
@@ -263,7 +536,10 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
                          <<"opened, Has "<<(hasdata?"":"not ")
                          <<"recv'd some data, Has "<<(isdone?"":"not ")<<"finalized\n"
                            "    "<<      epicsAtomicGetSizeT(&ME.nwakeups)<<" wakeups "
-                         <<epicsAtomicGetSizeT(&ME.nevents)<<" events\n";
+                         <<epicsAtomicGetSizeT(&ME.nevents)<<" events";
+                if(ME.flowcontrol)
+                    std::cout<<" "<<epicsAtomicGetSizeT(&ME.npauses)<<" pauses";
+                std::cout<<"\n";
 #ifdef USE_MSTATS
                 if(mstats.nempty || mstats.nfilled || mstats.noutstanding)
                     std::cout<<"    US monitor queue "<<mstats.nfilled
@@ -281,10 +557,11 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
                     bool isrunning;
                     {
                         Guard G(MU.mutex());
+                        Guard Q(MU.qlock);
 
-                        nempty = MU.empty.size();
-                        nfilled = MU.filled.size();
-                        nused = MU.inuse.size();
+                        nfilled = MU.nfilled;
+                        nused = MU.ninuse;
+                        nempty = MU.ring.size() - nfilled - nused;
                         isrunning = MU.running;
 
                         GWChannel::shared_pointer srvchan(MU.srvchan.lock());
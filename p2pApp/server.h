@@ -35,6 +35,99 @@ struct GWServerChannelProvider :
     virtual ~GWServerChannelProvider();
 };
 
+/** Token bucket limits on searches for names not already cached, for one server.
+ *
+ * Each source address, and the server as a whole, has a bucket which refills
+ * at 'rate' tokens per second up to 'burst'.  A search costs one token from both.
+ * rate<=0 disables that bucket.
+ */
+struct SearchLimit
+{
+    POINTER_DEFINITIONS(SearchLimit);
+
+    struct Bucket {
+        double tokens;
+        epicsTime last;
+        Bucket(double tokens, const epicsTime& now) :tokens(tokens), last(now) {}
+        // add tokens accumulated since 'last'
+        void refill(const epicsTime& now, double rate, double burst);
+    };
+
+    const double rate, burst, totalRate, totalBurst;
+    //! Max. number of sources tracked.  Beyond this, new sources share one bucket.
+    size_t maxSources;
+
+    epicsMutex lock;
+    // guarded by lock
+    Bucket total;
+    typedef std::map<std::string, Bucket> sources_t;
+    sources_t sources;
+    Bucket overflow; // for sources not in 'sources'
+    epicsTime lastSweep; // of 'sources' for full buckets
+
+    enum result_t {
+        Allowed,
+        Throttled, // source bucket empty
+        Dropped,   // server bucket empty
+    };
+
+    // The server asks each client provider in turn with the same requester.
+    // Remember recent results so that one search costs one token.
+    struct Recent {
+        std::tr1::weak_ptr<void> search;
+        result_t result;
+        Recent() :result(Allowed) {}
+    };
+    std::vector<Recent> recent; // ring buffer
+    size_t nextRecent;
+
+    SearchLimit(double rate, double burst, double totalRate, double totalBurst);
+
+    /** Take one token for a search from 'source' (an IP address).
+     *  When 'search' is given, and was recently charged, repeat that result without taking another.
+     */
+    result_t take(const std::string& source,
+                  const std::tr1::shared_ptr<void>& search = std::tr1::shared_ptr<void>());
+    // call with lock held
+    result_t charge(const epicsTime& now, const std::string& source);
+
+    size_t nsources();
+};
+
+/** Stands in for one client's GWServerChannelProvider in one server,
+ *  applying that server's SearchLimit to names the client has not cached.
+ *  Searches for cached names, and all createChannel(), pass straight through.
+ */
+struct GWSearchLimiter :
+        public epics::pvAccess::ChannelProvider
+{
+    POINTER_DEFINITIONS(GWSearchLimiter);
+
+    const GWServerChannelProvider::shared_pointer client;
+    const SearchLimit::shared_pointer limit;
+
+    size_t nthrottled, ndropped; // atomic
+
+    GWSearchLimiter(const GWServerChannelProvider::shared_pointer& client,
+                    const SearchLimit::shared_pointer& limit);
+    virtual ~GWSearchLimiter();
+
+    virtual std::string getProviderName() {
+        return client->getProviderName();
+    }
+
+    virtual epics::pvAccess::ChannelFind::shared_pointer channelFind(std::string const & channelName,
+                                             epics::pvAccess::ChannelFindRequester::shared_pointer const & channelFindRequester);
+
+    using epics::pvAccess::ChannelProvider::createChannel;
+    virtual epics::pvAccess::Channel::shared_pointer createChannel(std::string const & channelName,
+                                                       epics::pvAccess::ChannelRequester::shared_pointer const & channelRequester,
+                                                       short priority, std::string const & address);
+    virtual void destroy() {}
+};
+
+struct GWStatus;
+
 struct ServerConfig {
     int debug;
     bool interactive;
@@ -46,6 +139,15 @@ struct ServerConfig {
     typedef std::map<std::string, epics::pvAccess::ServerContext::shared_pointer> servers_t;
     servers_t servers;
 
+    //! status PVs of servers with a control_prefix
+    typedef std::map<std::string, std::tr1::shared_ptr<GWStatus> > statuses_t;
+    statuses_t statuses;
+
+    //! search limiters of servers with a search rate limit, by client name
+    typedef std::map<std::string, GWSearchLimiter::shared_pointer> limiters_t;
+    typedef std::map<std::string, limiters_t> server_limiters_t;
+    server_limiters_t limiters;
+
     ServerConfig() :debug(1), interactive(true) {}
 
     void drop(const char *client, const char *channel);
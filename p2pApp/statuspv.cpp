@@ -0,0 +1,410 @@
+#include <epicsAtomic.h>
+#include <errlog.h>
+
+#include <pv/pvIntrospect.h> /* for pvdVersion.h */
+#include <pv/standardField.h>
+#include <pv/pvAccess.h>
+#include <pv/logger.h>
+
+#define epicsExportSharedSymbols
+#include "helper.h"
+#include "pva2pva.h"
+#include "statuspv.h"
+
+#if defined(PVDATA_VERSION_INT)
+#if PVDATA_VERSION_INT > VERSION_INT(7,0,0,0)
+#  define USE_MSTATS
+#endif
+#endif
+
+namespace pva = epics::pvAccess;
+namespace pvd = epics::pvData;
+
+namespace {
+
+struct column_t {
+    const char *name;
+    pvd::ScalarType type;
+};
+
+const column_t clientcols[] = {
+    {"client", pvd::pvString},
+    {"channels", pvd::pvULong},
+    {"cleaned", pvd::pvULong},
+    {"evictIdle", pvd::pvULong},
+    {"evictSize", pvd::pvULong},
+    {"created", pvd::pvULong},
+    {"rejected", pvd::pvULong},
+    {"fieldHits", pvd::pvULong},
+    {"fieldMisses", pvd::pvULong},
+    {"getUpstream", pvd::pvULong},
+    {"getCoalesced", pvd::pvULong},
+    {"getMonitor", pvd::pvULong},
+    {"opReused", pvd::pvULong},
+    {"negativeHits", pvd::pvULong},
+    {"searchThrottled", pvd::pvULong},
+    {"searchDropped", pvd::pvULong},
+    {"eventRate", pvd::pvDouble},
+    {"dropRate", pvd::pvDouble},
+};
+
+const column_t channelcols[] = {
+    {"client", pvd::pvString},
+    {"channel", pvd::pvString},
+    {"connected", pvd::pvBoolean},
+    {"servers", pvd::pvULong},
+    {"monitors", pvd::pvULong},
+    {"subscribers", pvd::pvULong},
+    {"events", pvd::pvULong},
+    {"drops", pvd::pvULong},
+    {"upstreamQueued", pvd::pvULong}, // zero unless pvData provides Monitor::Stats
+    {"putUpstream", pvd::pvULong},
+    {"putCoalesced", pvd::pvULong},
+    {"eventRate", pvd::pvDouble},
+    {"dropRate", pvd::pvDouble},
+    {"idle", pvd::pvDouble},
+    {"enqueueP99", pvd::pvDouble},
+    {"pollP99", pvd::pvDouble},
+};
+
+const column_t latencycols[] = {
+    {"client", pvd::pvString},
+    {"stage", pvd::pvString},
+    {"count", pvd::pvULong},
+    {"p50", pvd::pvDouble},
+    {"p90", pvd::pvDouble},
+    {"p99", pvd::pvDouble},
+    {"max", pvd::pvDouble},
+};
+
+#define NELEMENTS(A) (sizeof(A)/sizeof(A[0]))
+
+pvd::StructureConstPtr buildTable(const column_t *cols, size_t ncols)
+{
+    pvd::FieldBuilderPtr B(pvd::getFieldCreate()->createFieldBuilder()
+                           ->setId("epics:nt/NTTable:1.0")
+                           ->addArray("labels", pvd::pvString)
+                           ->addNestedStructure("value"));
+    for(size_t i=0; i<ncols; i++)
+        B = B->addArray(cols[i].name, cols[i].type);
+
+    return B->endNested()
+            ->add("timeStamp", pvd::getStandardField()->timeStamp())
+            ->createStructure();
+}
+
+pvd::PVStructurePtr buildValue(const pvd::StructureConstPtr& type, const column_t *cols, size_t ncols)
+{
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(type));
+
+    pvd::PVStringArray::svector labels(ncols);
+    for(size_t i=0; i<ncols; i++)
+        labels[i] = cols[i].name;
+    ret->getSubFieldT<pvd::PVStringArray>("labels")->replace(pvd::freeze(labels));
+
+    return ret;
+}
+
+template<typename PVA>
+void putColumn(const pvd::PVStructurePtr& value, const char *name, typename PVA::svector& col)
+{
+    value->getSubFieldT<PVA>(std::string("value.")+name)->replace(pvd::freeze(col));
+}
+
+void putTime(const pvd::PVStructurePtr& value, const epicsTime& now)
+{
+    epicsTimeStamp ts(now);
+    value->getSubFieldT<pvd::PVLong>("timeStamp.secondsPastEpoch")->put(ts.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
+    value->getSubFieldT<pvd::PVInt>("timeStamp.nanoseconds")->put(ts.nsec);
+}
+
+} // namespace
+
+GWStatus::GWStatus(const std::string& servername,
+                   const std::string& prefix,
+                   const ServerConfig::clients_t& clients,
+                   const ServerConfig::limiters_t& limiters,
+                   double period)
+    :prefix(prefix)
+    ,period(period)
+    ,clients(clients)
+    ,limiters(limiters)
+    ,provider("gwstatus:"+servername)
+    ,clientpv(pvas::SharedPV::buildReadOnly())
+    ,channelpv(pvas::SharedPV::buildReadOnly())
+    ,latencypv(pvas::SharedPV::buildReadOnly())
+    ,clienttype(buildTable(clientcols, NELEMENTS(clientcols)))
+    ,channeltype(buildTable(channelcols, NELEMENTS(channelcols)))
+    ,latencytype(buildTable(latencycols, NELEMENTS(latencycols)))
+    ,lastupdate(epicsTime::getCurrent())
+    ,nupdates(0)
+    ,timerQueue(&epicsTimerQueueActive::allocate(1, epicsThreadPriorityLow))
+{
+    clientpv->open(*buildValue(clienttype, clientcols, NELEMENTS(clientcols)));
+    channelpv->open(*buildValue(channeltype, channelcols, NELEMENTS(channelcols)));
+    latencypv->open(*buildValue(latencytype, latencycols, NELEMENTS(latencycols)));
+
+    provider.add(prefix+"clients", clientpv);
+    provider.add(prefix+"channels", channelpv);
+    provider.add(prefix+"latency", latencypv);
+
+    timer = &timerQueue->createTimer();
+    timer->start(*this, 0.0);
+}
+
+GWStatus::~GWStatus()
+{
+    timer->destroy(); // waits for expire() to complete
+    timerQueue->release();
+    clientpv->close(true);
+    channelpv->close(true);
+    latencypv->close(true);
+}
+
+epicsTimerNotify::expireStatus
+GWStatus::expire(const epicsTime& currentTime)
+{
+    try {
+        update();
+    }catch(std::exception& e){
+        errlogPrintf("%s: status update error: %s\n", prefix.c_str(), e.what());
+    }
+    return expireStatus(restart, period);
+}
+
+void
+GWStatus::update()
+{
+    epicsTime now(epicsTime::getCurrent());
+    double dT = now - lastupdate;
+    lastupdate = now;
+    // rates are only meaningful from the second refresh onward
+    const bool haverate = nupdates++>0 && dT>0.0;
+
+    prev_t nextprev;
+
+    // client table columns
+    pvd::PVStringArray::svector c_name;
+    pvd::PVULongArray::svector c_chans, c_cleaned, c_idle, c_size, c_created, c_rejected,
+                               c_fhits, c_fmiss, c_gup, c_gco, c_gmon, c_reuse, c_neg, c_sthrot, c_sdrop;
+    pvd::PVDoubleArray::svector c_erate, c_drate;
+
+    // channel table columns
+    pvd::PVStringArray::svector h_client, h_name;
+    pvd::PVBooleanArray::svector h_conn;
+    pvd::PVULongArray::svector h_srv, h_mon, h_sub, h_events, h_drops, h_queued, h_pup, h_pco;
+    pvd::PVDoubleArray::svector h_erate, h_drate, h_idle, h_enq99, h_poll99;
+
+    // latency table columns
+    pvd::PVStringArray::svector l_client, l_stage;
+    pvd::PVULongArray::svector l_count;
+    pvd::PVDoubleArray::svector l_p50, l_p90, l_p99, l_max;
+
+    FOREACH(ServerConfig::clients_t::const_iterator, it, end, clients)
+    {
+        const GWServerChannelProvider::shared_pointer& prov(it->second);
+        ChannelCache& cache = prov->cache;
+
+        ChannelCache::entries_t entries;
+        cache.snapshot(entries); // copy of each shard std::map
+
+        double clerate = 0.0, cldrate = 0.0;
+
+        FOREACH(ChannelCache::entries_t::const_iterator, it2, end2, entries)
+        {
+            const std::string& channame = it2->first;
+            ChannelCacheEntry& E = *it2->second;
+
+            ChannelCacheEntry::mon_entries_t::lock_vector_type mons;
+            size_t nsrv, nsub = 0u, nevents = 0u, ndropped = 0u, nqueued = 0u;
+            double idle;
+            bool connected;
+            {
+                Guard G(cache.shardFor(channame).lock);
+                idle = now - E.lastused;
+            }
+            {
+                Guard G(E.mutex());
+                // 'channel' is NULL while its creation is queued
+                connected = E.channel && E.channel->getConnectionState()==pva::Channel::CONNECTED;
+                nsrv = E.interested.size();
+                mons = E.mon_entries.lock_vector();
+            }
+
+            FOREACH(ChannelCacheEntry::mon_entries_t::lock_vector_type::const_iterator, it3, end3, mons)
+            {
+                MonitorCacheEntry& ME = *it3->second;
+                MonitorCacheEntry::interested_t::vector_type usrs;
+
+                nevents += epicsAtomicGetSizeT(&ME.nevents);
+                {
+                    Guard G(ME.mutex());
+                    usrs = ME.interested.lock_vector();
+#ifdef USE_MSTATS
+                    if(ME.mon) {
+                        pvd::Monitor::Stats mstats;
+                        ME.mon->getStats(mstats);
+                        nqueued += mstats.nfilled;
+                    }
+#endif
+                }
+
+                nsub += usrs.size();
+                FOREACH(MonitorCacheEntry::interested_t::vector_type::const_iterator, it4, end4, usrs)
+                {
+                    ndropped += epicsAtomicGetSizeT(&(*it4)->ndropped);
+                }
+            }
+
+            double erate = 0.0, drate = 0.0;
+            {
+                Prev& P = nextprev[std::make_pair(it->first, channame)];
+                P.nevents = nevents;
+                P.ndropped = ndropped;
+
+                prev_t::const_iterator pit(prev.find(std::make_pair(it->first, channame)));
+                if(haverate && pit!=prev.end()) {
+                    // counters restart if subscriptions are re-created
+                    erate = (nevents>=pit->second.nevents ? nevents-pit->second.nevents : nevents)/dT;
+                    drate = (ndropped>=pit->second.ndropped ? ndropped-pit->second.ndropped : ndropped)/dT;
+                }
+            }
+            clerate += erate;
+            cldrate += drate;
+
+            h_client.push_back(it->first);
+            h_name.push_back(channame);
+            h_conn.push_back(connected);
+            h_srv.push_back(nsrv);
+            h_mon.push_back(mons.size());
+            h_sub.push_back(nsub);
+            h_events.push_back(nevents);
+            h_drops.push_back(ndropped);
+            h_queued.push_back(nqueued);
+            h_pup.push_back(epicsAtomicGetSizeT(&E.putUpstream));
+            h_pco.push_back(epicsAtomicGetSizeT(&E.putCoalesced));
+            h_erate.push_back(erate);
+            h_drate.push_back(drate);
+            h_idle.push_back(idle);
+            {
+                LatencyHist::bins_t bins;
+                E.latency.enqueue.get(bins);
+                h_enq99.push_back(LatencyHist::quantile(bins, 0.99));
+                E.latency.poll.get(bins);
+                h_poll99.push_back(LatencyHist::quantile(bins, 0.99));
+            }
+        }
+
+        size_t ncreated, nrejected;
+        {
+            Guard G(cache.creator.lock);
+            ncreated = cache.creator.ncreated;
+            nrejected = cache.creator.nrejected;
+        }
+
+        c_name.push_back(it->first);
+        c_chans.push_back(entries.size());
+        c_cleaned.push_back(epicsAtomicGetSizeT(&cache.cleanerRuns));
+        c_idle.push_back(epicsAtomicGetSizeT(&cache.evictIdle));
+        c_size.push_back(epicsAtomicGetSizeT(&cache.evictSize));
+        c_created.push_back(ncreated);
+        c_rejected.push_back(nrejected);
+        c_fhits.push_back(epicsAtomicGetSizeT(&cache.fieldHits));
+        c_fmiss.push_back(epicsAtomicGetSizeT(&cache.fieldMisses));
+        c_gup.push_back(epicsAtomicGetSizeT(&cache.getUpstream));
+        c_gco.push_back(epicsAtomicGetSizeT(&cache.getCoalesced));
+        c_gmon.push_back(epicsAtomicGetSizeT(&cache.getMonitor));
+        c_reuse.push_back(epicsAtomicGetSizeT(&cache.opReused));
+        c_neg.push_back(epicsAtomicGetSizeT(&cache.negativeHits));
+        {
+            ServerConfig::limiters_t::const_iterator lit(limiters.find(it->first));
+            bool limited = lit!=limiters.end();
+            c_sthrot.push_back(limited ? epicsAtomicGetSizeT(&lit->second->nthrottled) : 0u);
+            c_sdrop.push_back(limited ? epicsAtomicGetSizeT(&lit->second->ndropped) : 0u);
+        }
+        c_erate.push_back(clerate);
+        c_drate.push_back(cldrate);
+
+        const char *stages[] = {"enqueue", "poll", "release"};
+        const LatencyHist *hists[] = {&cache.latency.enqueue, &cache.latency.poll, &cache.latency.release};
+        for(size_t i=0; i<NELEMENTS(stages); i++) {
+            LatencyHist::bins_t bins;
+            hists[i]->get(bins);
+            size_t count = 0u;
+            for(size_t b=0; b<LatencyHist::NBins; b++)
+                count += bins[b];
+
+            l_client.push_back(it->first);
+            l_stage.push_back(stages[i]);
+            l_count.push_back(count);
+            l_p50.push_back(LatencyHist::quantile(bins, 0.5));
+            l_p90.push_back(LatencyHist::quantile(bins, 0.9));
+            l_p99.push_back(LatencyHist::quantile(bins, 0.99));
+            l_max.push_back(LatencyHist::quantile(bins, 1.0));
+        }
+    }
+
+    // forget channels which are no longer cached
+    prev.swap(nextprev);
+
+    // all gateway locks released.  SharedPV::post() copies, so each value is used once.
+    pvd::BitSet changed;
+    changed.set(0);
+
+    {
+        pvd::PVStructurePtr value(buildValue(clienttype, clientcols, NELEMENTS(clientcols)));
+        putColumn<pvd::PVStringArray>(value, "client", c_name);
+        putColumn<pvd::PVULongArray>(value, "channels", c_chans);
+        putColumn<pvd::PVULongArray>(value, "cleaned", c_cleaned);
+        putColumn<pvd::PVULongArray>(value, "evictIdle", c_idle);
+        putColumn<pvd::PVULongArray>(value, "evictSize", c_size);
+        putColumn<pvd::PVULongArray>(value, "created", c_created);
+        putColumn<pvd::PVULongArray>(value, "rejected", c_rejected);
+        putColumn<pvd::PVULongArray>(value, "fieldHits", c_fhits);
+        putColumn<pvd::PVULongArray>(value, "fieldMisses", c_fmiss);
+        putColumn<pvd::PVULongArray>(value, "getUpstream", c_gup);
+        putColumn<pvd::PVULongArray>(value, "getCoalesced", c_gco);
+        putColumn<pvd::PVULongArray>(value, "getMonitor", c_gmon);
+        putColumn<pvd::PVULongArray>(value, "opReused", c_reuse);
+        putColumn<pvd::PVULongArray>(value, "negativeHits", c_neg);
+        putColumn<pvd::PVULongArray>(value, "searchThrottled", c_sthrot);
+        putColumn<pvd::PVULongArray>(value, "searchDropped", c_sdrop);
+        putColumn<pvd::PVDoubleArray>(value, "eventRate", c_erate);
+        putColumn<pvd::PVDoubleArray>(value, "dropRate", c_drate);
+        putTime(value, now);
+        clientpv->post(*value, changed);
+    }
+    {
+        pvd::PVStructurePtr value(buildValue(channeltype, channelcols, NELEMENTS(channelcols)));
+        putColumn<pvd::PVStringArray>(value, "client", h_client);
+        putColumn<pvd::PVStringArray>(value, "channel", h_name);
+        putColumn<pvd::PVBooleanArray>(value, "connected", h_conn);
+        putColumn<pvd::PVULongArray>(value, "servers", h_srv);
+        putColumn<pvd::PVULongArray>(value, "monitors", h_mon);
+        putColumn<pvd::PVULongArray>(value, "subscribers", h_sub);
+        putColumn<pvd::PVULongArray>(value, "events", h_events);
+        putColumn<pvd::PVULongArray>(value, "drops", h_drops);
+        putColumn<pvd::PVULongArray>(value, "upstreamQueued", h_queued);
+        putColumn<pvd::PVULongArray>(value, "putUpstream", h_pup);
+        putColumn<pvd::PVULongArray>(value, "putCoalesced", h_pco);
+        putColumn<pvd::PVDoubleArray>(value, "eventRate", h_erate);
+        putColumn<pvd::PVDoubleArray>(value, "dropRate", h_drate);
+        putColumn<pvd::PVDoubleArray>(value, "idle", h_idle);
+        putColumn<pvd::PVDoubleArray>(value, "enqueueP99", h_enq99);
+        putColumn<pvd::PVDoubleArray>(value, "pollP99", h_poll99);
+        putTime(value, now);
+        channelpv->post(*value, changed);
+    }
+    {
+        pvd::PVStructurePtr value(buildValue(latencytype, latencycols, NELEMENTS(latencycols)));
+        putColumn<pvd::PVStringArray>(value, "client", l_client);
+        putColumn<pvd::PVStringArray>(value, "stage", l_stage);
+        putColumn<pvd::PVULongArray>(value, "count", l_count);
+        putColumn<pvd::PVDoubleArray>(value, "p50", l_p50);
+        putColumn<pvd::PVDoubleArray>(value, "p90", l_p90);
+        putColumn<pvd::PVDoubleArray>(value, "p99", l_p99);
+        putColumn<pvd::PVDoubleArray>(value, "max", l_max);
+        putTime(value, now);
+        latencypv->post(*value, changed);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef STATUSPV_H
+#define STATUSPV_H
+
+#include <string>
+#include <map>
+
+#include <epicsTimer.h>
+
+#include <pv/sharedstate.h>
+
+#include "server.h"
+
+/** Gateway statistics served as PVs for one server, under its control_prefix
+ *
+ *  <prefix>clients  - NTTable with one row per client (upstream) cache, and its search limiter
+ *  <prefix>channels - NTTable with one row per cached channel
+ *  <prefix>latency  - NTTable with one row per client and stage of MonitorLatency
+ *
+ * Refreshed every period seconds from our own timer thread.  Counters are read atomically,
+ * and entry lists are copied with locks held briefly, so nothing is locked while posting
+ * to subscribers.  Rates are computed from the difference with the previous refresh.
+ */
+struct GWStatus : public epicsTimerNotify
+{
+    POINTER_DEFINITIONS(GWStatus);
+
+    const std::string prefix;
+    const double period;
+    //! the clients used by this server
+    const ServerConfig::clients_t clients;
+    //! search limiters of this server, if any
+    const ServerConfig::limiters_t limiters;
+
+    pvas::StaticProvider provider;
+    const pvas::SharedPV::shared_pointer clientpv, channelpv, latencypv;
+    const epics::pvData::StructureConstPtr clienttype, channeltype, latencytype;
+
+    // cumulative counters at the last refresh, for computing rates.
+    // only accessed from the timer thread
+    struct Prev {
+        size_t nevents, ndropped;
+        Prev() :nevents(0), ndropped(0) {}
+    };
+    typedef std::map<std::pair<std::string, std::string>, Prev> prev_t;
+    prev_t prev;
+    epicsTime lastupdate;
+    size_t nupdates;
+
+    epicsTimerQueueActive *timerQueue;
+    epicsTimer *timer;
+
+    GWStatus(const std::string& servername,
+             const std::string& prefix,
+             const ServerConfig::clients_t& clients,
+             const ServerConfig::limiters_t& limiters = ServerConfig::limiters_t(),
+             double period = 1.0);
+    virtual ~GWStatus();
+
+    //! Gather and post.  Called periodically.
+    void update();
+
+    virtual expireStatus expire(const epicsTime& currentTime);
+};
+
+#endif // STATUSPV_H
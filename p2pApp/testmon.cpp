@@ -1,9 +1,14 @@
+#include <map>
+#include <set>
+#include <vector>
 
 #include <epicsAtomic.h>
 #include <epicsGuard.h>
+#include <epicsThread.h>
 #include <epicsUnitTest.h>
 #include <testMain.h>
 
+#include <pv/alarm.h>
 #include <pv/epicsException.h>
 #include <pv/monitor.h>
 #include <pv/thread.h>
@@ -17,25 +22,116 @@ namespace pvd = epics::pvData;
 namespace pva = epics::pvAccess;
 
 typedef epicsGuard<epicsMutex> Guard;
+typedef epicsGuardRelease<epicsMutex> UnGuard;
 
 namespace {
 
-pvd::PVStructurePtr makeRequest(size_t bsize)
+pvd::PVStructurePtr makeRequest(size_t bsize, double maxRate=0.0)
+{
+    pvd::FieldBuilderPtr builder(pvd::getFieldCreate()->createFieldBuilder()
+                                 ->addNestedStructure("record")
+                                    ->addNestedStructure("_options")
+                                        ->add("queueSize", pvd::pvString)); // yes, really.  PVA wants a string
+    if(maxRate>0.0)
+        builder = builder->add("maxRate", pvd::pvString);
+    pvd::StructureConstPtr dtype(builder->endNested()
+                                 ->endNested()
+                                 ->createStructure());
+
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(dtype));
+    ret->getSubFieldT<pvd::PVScalar>("record._options.queueSize")->putFrom<pvd::int32>(bsize);
+    if(maxRate>0.0)
+        ret->getSubFieldT<pvd::PVScalar>("record._options.maxRate")->putFrom<double>(maxRate);
+
+    return ret;
+}
+
+// request only field 'y', with options in a different order than makeRequest()
+pvd::PVStructurePtr makeRequestY(size_t bsize)
 {
     pvd::StructureConstPtr dtype(pvd::getFieldCreate()->createFieldBuilder()
                                  ->addNestedStructure("record")
                                     ->addNestedStructure("_options")
-                                        ->add("queueSize", pvd::pvString) // yes, really.  PVA wants a string
+                                        ->add("queueSize", pvd::pvString)
+                                    ->endNested()
+                                 ->endNested()
+                                 ->addNestedStructure("field")
+                                    ->addNestedStructure("y")
                                     ->endNested()
                                  ->endNested()
                                  ->createStructure());
 
     pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(dtype));
     ret->getSubFieldT<pvd::PVScalar>("record._options.queueSize")->putFrom<pvd::int32>(bsize);
+    return ret;
+}
+
+// all fields, no options.  as "field()"
+pvd::PVStructurePtr makeGetRequest()
+{
+    return pvd::getPVDataCreate()->createPVStructure(pvd::getFieldCreate()->createFieldBuilder()
+                                                     ->createStructure());
+}
+
+// all fields, with one option.  as "record[name=value]field()"
+pvd::PVStructurePtr makeOptionRequest(const std::string& name, const std::string& value)
+{
+    pvd::StructureConstPtr dtype(pvd::getFieldCreate()->createFieldBuilder()
+                                 ->addNestedStructure("record")
+                                    ->addNestedStructure("_options")
+                                        ->add(name, pvd::pvString)
+                                    ->endNested()
+                                 ->endNested()
+                                 ->createStructure());
+
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(dtype));
+    ret->getSubFieldT<pvd::PVScalar>("record._options."+name)->putFrom<std::string>(value);
+    return ret;
+}
+
+// all fields, with put coalescing
+pvd::PVStructurePtr makeCoalesceRequest()
+{
+    return makeOptionRequest("coalesce", "true");
+}
+
+// all fields, with an array slice
+pvd::PVStructurePtr makeSliceRequest(size_t bsize, size_t start, size_t count, size_t stride)
+{
+    pvd::StructureConstPtr dtype(pvd::getFieldCreate()->createFieldBuilder()
+                                 ->addNestedStructure("record")
+                                    ->addNestedStructure("_options")
+                                        ->add("queueSize", pvd::pvString)
+                                        ->add("arrayStart", pvd::pvString)
+                                        ->add("arrayCount", pvd::pvString)
+                                        ->add("arrayStride", pvd::pvString)
+                                    ->endNested()
+                                 ->endNested()
+                                 ->createStructure());
 
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(dtype));
+    ret->getSubFieldT<pvd::PVScalar>("record._options.queueSize")->putFrom<pvd::int32>(bsize);
+    ret->getSubFieldT<pvd::PVScalar>("record._options.arrayStart")->putFrom<pvd::uint32>(start);
+    ret->getSubFieldT<pvd::PVScalar>("record._options.arrayCount")->putFrom<pvd::uint32>(count);
+    ret->getSubFieldT<pvd::PVScalar>("record._options.arrayStride")->putFrom<pvd::uint32>(stride);
     return ret;
 }
 
+// "value" of elem as a string, eg. "[1,2,3]"
+std::string arrayString(const pvd::MonitorElementPtr& elem)
+{
+    if(!elem)
+        return "<no update>";
+    pvd::PVDoubleArray::const_svector arr(elem->pvStructurePtr->getSubFieldT<pvd::PVDoubleArray>("value")->view());
+    std::string ret("[");
+    for(size_t i=0; i<arr.size(); i++) {
+        if(i)
+            ret += ",";
+        ret += toString(arr[i]);
+    }
+    return ret+"]";
+}
+
 struct TestMonitor {
     TestProvider::shared_pointer upstream;
     TestPV::shared_pointer test1;
@@ -338,18 +434,1336 @@ struct TestMonitor {
 
         mon->destroy();
     }
+
+    void test_shared_snapshot()
+    {
+        testDiag("Check shared snapshots of updates between downstream monitors");
+
+        gateway->cache.sharedSnapshots = true;
+
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeRequest(2)));
+        if(!mon) testAbort("Failed to create monitor");
+
+        TestChannelMonitorRequester::shared_pointer mreq2(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon2(client->createMonitor(mreq2, makeRequest(2)));
+        if(!mon2) testAbort("Failed to create monitor2");
+
+        testOk1(mon->start().isSuccess());
+        testOk1(mon2->start().isSuccess());
+        upstream->dispatch(); // trigger monitorEvent() from upstream to gateway
+
+        pva::MonitorElementPtr elem(mon->poll());
+        pva::MonitorElementPtr elem2(mon2->poll());
+        testOk1(elem && elem2 && elem!=elem2);
+        testOk1(elem && elem2 && elem->pvStructurePtr==elem2->pvStructurePtr);
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==1);
+
+        pvd::PVStructurePtr initial;
+        if(elem) initial = elem->pvStructurePtr;
+
+        if(elem) mon->release(elem);
+        if(elem2) mon2->release(elem2);
+
+        testDiag("push an update, then overflow mon2");
+        pvd::BitSet changed;
+        changed.set(1);
+        test1_x = 42;
+        test1->post(changed);
+
+        elem = mon->poll();
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==42);
+        testOk1(elem && elem->pvStructurePtr!=initial);
+        testOk1(initial && initial->getSubFieldT<pvd::PVInt>("x")->get()==1); // not modified
+        if(elem) mon->release(elem);
+
+        test1_x = 43;
+        test1->post(changed);
+        test1_x = 44;
+        test1->post(changed);
+
+        testDiag("mon2 has 42, 43, and 44 in overflow");
+        elem2 = mon2->poll();
+        testOk1(elem2 && elem2->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==42);
+        if(elem2) mon2->release(elem2);
+        elem2 = mon2->poll();
+        testOk1(elem2 && elem2->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==43);
+        if(elem2) mon2->release(elem2);
+        elem2 = mon2->poll();
+        testOk1(elem2 && elem2->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==44);
+        testOk1(elem2 && elem2->changedBitSet->nextSetBit(0)==1);
+        testOk1(elem2 && elem2->overrunBitSet->nextSetBit(0)==-1);
+
+        elem = mon->poll(); // 43
+        if(elem) mon->release(elem);
+        elem = mon->poll(); // 44
+        testOk1(elem && elem2 && elem->pvStructurePtr==elem2->pvStructurePtr);
+        if(elem) mon->release(elem);
+        if(elem2) mon2->release(elem2);
+
+        testOk1(!mon->poll());
+        testOk1(!mon2->poll());
+
+        mon->destroy();
+        mon2->destroy();
+    }
+
+    void test_max_rate()
+    {
+        testDiag("Check downstream monitor with maxRate");
+
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeRequest(4, 2.0)));
+        if(!mon) testAbort("Failed to create monitor");
+
+        testOk1(mon->start().isSuccess());
+        upstream->dispatch(); // trigger monitorEvent() from upstream to gateway
+
+        pva::MonitorElementPtr elem(mon->poll());
+        testOk1(!!elem.get());
+        if(elem) mon->release(elem);
+
+        pvd::BitSet changed;
+        changed.set(1);
+        test1_x=50;
+        test1->post(changed);
+        test1_x=51;
+        test1->post(changed);
+        test1_x=52;
+        test1->post(changed);
+
+        testDiag("updates within 1/maxRate of the initial update are held");
+        testOk1(!mon->poll());
+
+        epicsThreadSleep(1.0); // > 1/maxRate
+
+        testDiag("held updates are combined");
+        elem = mon->poll();
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==52);
+        testOk1(elem && elem->changedBitSet->nextSetBit(0)==1);
+        testOk1(elem && elem->overrunBitSet->nextSetBit(0)==1);
+        if(elem) mon->release(elem);
+
+        testOk1(!mon->poll());
+
+        epicsThreadSleep(1.0);
+
+        testDiag("update after a quiet period is queued immediately");
+        test1_x=53;
+        test1->post(changed);
+        elem = mon->poll();
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==53);
+        if(elem) mon->release(elem);
+
+        testOk1(!mon->poll());
+
+        mon->destroy();
+    }
+
+    void test_release_order()
+    {
+        testDiag("Check downstream release() out of poll() order");
+
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeRequest(2)));
+        if(!mon) testAbort("Failed to create monitor");
+
+        testOk1(mon->start().isSuccess());
+        upstream->dispatch();
+
+        pvd::BitSet changed;
+        changed.set(1);
+        test1_x=70;
+        test1->post(changed);
+
+        pva::MonitorElementPtr elem1(mon->poll()), elem2(mon->poll());
+        testOk1(elem1 && elem2);
+        testOk1(!mon->poll());
+
+        if(elem2) mon->release(elem2);
+        if(elem1) mon->release(elem1);
+
+        bool threw = false;
+        try {
+            mon->release(elem1);
+        } catch(std::invalid_argument&) {
+            threw = true;
+        }
+        testOk(threw, "release() twice is an error");
+
+        test1_x=71;
+        test1->post(changed);
+        pva::MonitorElementPtr elem(mon->poll());
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==71);
+        if(elem) mon->release(elem);
+
+        testOk1(!mon->poll());
+
+        testDiag("a slot released out of order is reused while the older is in use");
+        test1_x=72;
+        test1->post(changed);
+        test1_x=73;
+        test1->post(changed);
+        elem1 = mon->poll();
+        elem2 = mon->poll();
+        testOk1(elem1 && elem2);
+        if(elem2) mon->release(elem2);
+
+        test1_x=74;
+        test1->post(changed);
+        elem = mon->poll();
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==74);
+        if(elem) mon->release(elem);
+        if(elem1) mon->release(elem1);
+
+        testOk1(!mon->poll());
+
+        mon->destroy();
+    }
+
+    static size_t histCount(const LatencyHist& H)
+    {
+        LatencyHist::bins_t bins;
+        H.get(bins);
+        size_t total = 0u;
+        for(size_t i=0; i<LatencyHist::NBins; i++)
+            total += bins[i];
+        return total;
+    }
+
+    void test_latency()
+    {
+        testDiag("Check monitor latency histograms");
+
+        {
+            LatencyHist H;
+            LatencyHist::bins_t bins;
+            H.add(0u);        // < 1us
+            H.add(1500u);     // 1.5us
+            H.add(3000u);     // 3us
+            H.add(1000000000000ull); // 1000s, past the last bin
+            H.get(bins);
+            testOk1(bins[0]==1 && bins[1]==1 && bins[2]==1 && bins[LatencyHist::NBins-1]==1);
+            testOk1(LatencyHist::quantile(bins, 0.5)==LatencyHist::upper(1));
+            testOk1(LatencyHist::quantile(bins, 1.0)==LatencyHist::upper(LatencyHist::NBins-1));
+        }
+
+        const MonitorLatency& L = gateway->cache.latency;
+        size_t nenq = histCount(L.enqueue), npoll = histCount(L.poll), nrel = histCount(L.release);
+
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeRequest(2)));
+        if(!mon) testAbort("Failed to create monitor");
+
+        testOk1(mon->start().isSuccess());
+        upstream->dispatch();
+
+        pva::MonitorElementPtr elem(mon->poll());
+        if(elem) mon->release(elem);
+
+        testDiag("initial update doesn't come from upstream poll()");
+        testEqual(histCount(L.enqueue), nenq);
+        testEqual(histCount(L.poll), npoll+1u);
+        testEqual(histCount(L.release), nrel+1u);
+
+        pvd::BitSet changed;
+        changed.set(1);
+        test1_x=60;
+        test1->post(changed);
+
+        elem = mon->poll();
+        testOk1(!!elem.get());
+        if(elem) mon->release(elem);
+
+        testEqual(histCount(L.enqueue), nenq+1u);
+        testEqual(histCount(L.poll), npoll+2u);
+        testEqual(histCount(L.release), nrel+2u);
+
+        mon->destroy();
+    }
+
+    void test_pool()
+    {
+        testDiag("Check re-use of monitor elements");
+
+        pvd::StructureConstPtr type(pvd::getFieldCreate()->createFieldBuilder()
+                                    ->add("x", pvd::pvInt)
+                                    ->addArray("y", pvd::pvDouble)
+                                    ->createStructure());
+
+        ElementPool P;
+        P.maxFree = 1u;
+
+        pvd::MonitorElementPtr elem(P.get(type));
+        testOk1(!!elem.get());
+        testEqual(P.nmisses, 1u);
+        pvd::MonitorElement *orig = elem.get();
+
+        pvd::PVDoubleArray::svector Y(4, 1.0);
+        elem->pvStructurePtr->getSubFieldT<pvd::PVDoubleArray>("y")->replace(pvd::freeze(Y));
+        elem->changedBitSet->set(1);
+
+        P.put(elem);
+        testOk1(!elem);
+        testEqual(P.nfree, 1u);
+
+        // a second is discarded
+        pvd::MonitorElementPtr other(new pvd::MonitorElement(pvd::getPVDataCreate()->createPVStructure(type)));
+        P.put(other);
+        testEqual(P.ndiscards, 1u);
+
+        elem = P.get(type);
+        testOk1(elem.get()==orig);
+        testEqual(P.nhits, 1u);
+        testEqual(P.nfree, 0u);
+        testEqual(elem->pvStructurePtr->getSubFieldT<pvd::PVDoubleArray>("y")->getLength(), 0u);
+        testOk1(elem->changedBitSet->isEmpty());
+
+        // still referenced elsewhere, so not re-used
+        pvd::MonitorElementPtr ref(elem);
+        P.put(elem);
+        testEqual(P.nfree, 0u);
+    }
+
+    void test_projection()
+    {
+        testDiag("Check a sub-set of fields sharing an upstream monitor");
+
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeRequest(2)));
+        if(!mon) testAbort("Failed to create monitor");
+
+        // different queueSize doesn't prevent sharing
+        TestChannelMonitorRequester::shared_pointer mreq2(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon2(client->createMonitor(mreq2, makeRequestY(3)));
+        if(!mon2) testAbort("Failed to create monitor2");
+
+        testEqual(gateway->cache.monProjected, 1u);
+        ChannelCacheEntry::shared_pointer ent(gateway->cache.find("test1"));
+        testEqual(ent ? ent->mon_entries.size() : 0u, 1u);
+
+        testOk1(mon->start().isSuccess());
+        testOk1(mon2->start().isSuccess());
+        upstream->dispatch();
+
+        testOk1(mreq2->dtype && mreq2->dtype->getNumberFields()==1 && mreq2->dtype->getField("y"));
+
+        pva::MonitorElementPtr elem(mon->poll()), elem2(mon2->poll());
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==1);
+        testOk1(elem2 && elem2->pvStructurePtr->getSubFieldT<pvd::PVInt>("y")->get()==2);
+        if(elem) mon->release(elem);
+        if(elem2) mon2->release(elem2);
+
+        testDiag("change only 'x', which mon2 doesn't see");
+        pvd::BitSet changed;
+        changed.set(1);
+        test1_x = 42;
+        test1->post(changed);
+
+        elem = mon->poll();
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==42);
+        if(elem) mon->release(elem);
+        testOk1(!mon2->poll());
+
+        testDiag("change 'y'");
+        changed.clear();
+        changed.set(2);
+        test1_y = 43;
+        test1->post(changed);
+
+        elem = mon->poll();
+        elem2 = mon2->poll();
+        testOk1(!!elem.get());
+        if(elem) mon->release(elem);
+        testOk1(elem2 && elem2->pvStructurePtr->getSubFieldT<pvd::PVInt>("y")->get()==43);
+        if(elem2) testEqual(toString(*elem2->changedBitSet), "{1}");
+        else testFail("no update");
+        if(elem2) mon2->release(elem2);
+
+        mon->destroy();
+        mon2->destroy();
+    }
+
+    void test_retain()
+    {
+        testDiag("Check upstream monitor kept after last subscriber goes away");
+
+        gateway->cache.monitorRetain = 60.0;
+
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeRequest(2)));
+        if(!mon) testAbort("Failed to create monitor");
+
+        testOk1(mon->start().isSuccess());
+        upstream->dispatch();
+        pva::MonitorElementPtr elem(mon->poll());
+        if(elem) mon->release(elem);
+
+        size_t nment = epicsAtomicGetSizeT(&MonitorCacheEntry::num_instances);
+
+        mon->destroy();
+        mon.reset();
+        mreq.reset();
+        elem.reset();
+
+        testEqual(gateway->cache.nretained, 1u);
+        testEqual(epicsAtomicGetSizeT(&MonitorCacheEntry::num_instances), nment);
+
+        testDiag("new subscriber gets last value w/o upstream dispatch()");
+        test1_x = 5; // not post()ed
+        mreq.reset(new TestChannelMonitorRequester);
+        mon = client->createMonitor(mreq, makeRequest(2));
+        if(!mon) testAbort("Failed to re-create monitor");
+        testOk1(mreq->connected);
+        testEqual(gateway->cache.retainHits, 1u);
+        testEqual(gateway->cache.nretained, 0u);
+
+        testOk1(mon->start().isSuccess());
+        elem = mon->poll();
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==1);
+        if(elem) mon->release(elem);
+
+        mon->destroy();
+        mon.reset();
+        mreq.reset();
+        elem.reset();
+
+        testEqual(gateway->cache.nretained, 1u);
+
+        gateway->cache.expireRetained(epicsTime::getCurrent()+120.0);
+        testEqual(gateway->cache.nretained, 0u);
+        testEqual(gateway->cache.retainExpired, 1u);
+        testEqual(epicsAtomicGetSizeT(&MonitorCacheEntry::num_instances), nment-1u);
+    }
+
+    void test_reconnect_hold()
+    {
+        testDiag("Check upstream disconnect hidden from downstream");
+
+        gateway->cache.reconnectHold = 60.0;
+
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeRequest(2)));
+        if(!mon) testAbort("Failed to create monitor");
+
+        testOk1(mon->start().isSuccess());
+        upstream->dispatch();
+        pva::MonitorElementPtr elem(mon->poll());
+        if(elem) mon->release(elem);
+
+        test1->disconnect();
+
+        testEqual(gateway->cache.reconnectHeld, 1u);
+        {
+            Guard G(client_req->lock);
+            testEqual(client_req->laststate, pva::Channel::CONNECTED);
+        }
+        testOk1(!!gateway->cache.find("test1"));
+        testOk1(!mreq->unlistend);
+
+        mon->destroy();
+    }
+
+    // the only upstream subscription to 'pv', or NULL
+    static TestPVMonitor::shared_pointer upstreamMonitor(const TestPV::shared_pointer& pv)
+    {
+        TestPVMonitor::shared_pointer ret;
+        Guard G(pv->lock);
+        TestPV::channels_t::vector_type chans(pv->channels.lock_vector());
+        if(chans.size()==1) {
+            TestPVChannel::monitors_t::vector_type mons(chans[0]->monitors.lock_vector());
+            if(mons.size()==1)
+                ret = mons[0];
+        }
+        return ret;
+    }
+
+    void test_reconnect_resume()
+    {
+        testDiag("Check a held monitor resumes when upstream reconnects");
+
+        gateway->cache.reconnectHold = 60.0;
+
+        TestPV::shared_pointer pv(upstream->addPV("alarmed", pvd::getFieldCreate()->createFieldBuilder()
+                                                  ->add("x", pvd::pvInt)
+                                                  ->addNestedStructure("alarm")
+                                                     ->add("severity", pvd::pvInt)
+                                                     ->add("status", pvd::pvInt)
+                                                     ->add("message", pvd::pvString)
+                                                  ->endNested()
+                                                  ->createStructure()));
+        ScalarAccessor<pvd::int32> pv_x(pv->value, "x");
+        pv_x = 1;
+
+        TestChannelRequester::shared_pointer creq(new TestChannelRequester);
+        pva::Channel::shared_pointer chan(gateway->createChannel("alarmed", creq));
+        if(!chan) testAbort("channel \"alarmed\" not connected");
+
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(chan->createMonitor(mreq, makeRequest(2)));
+        MonitorUser::shared_pointer usr(std::tr1::dynamic_pointer_cast<MonitorUser>(mon));
+        if(!usr) testAbort("Failed to create monitor");
+
+        testOk1(mon->start().isSuccess());
+        upstream->dispatch();
+        pva::MonitorElementPtr elem(mon->poll());
+        if(elem) mon->release(elem);
+
+        TestPVMonitor::shared_pointer umon(upstreamMonitor(pv));
+        if(!umon) testAbort("No upstream subscription");
+        pvd::PVStructurePtr ureq(umon->pvRequest);
+
+        pv->disconnect();
+        testEqual(gateway->cache.reconnectHeld, 1u);
+
+        elem = mon->poll();
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("alarm.severity")->get()==pvd::invalidAlarm);
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVString>("alarm.message")->get()=="Upstream Disconnected");
+        if(elem) mon->release(elem);
+
+        pv->reconnect();
+        testEqual(gateway->cache.reconnectResumed, 1u);
+
+        testDiag("upstream re-subscribes the same request, without a new subscription from the gateway");
+        testOk1(upstreamMonitor(pv)==umon && umon->pvRequest==ureq);
+        testEqual(usr->entry->nreconnects, 1u);
+
+        // complete update after re-subscribing clears the alarm
+        upstream->dispatch();
+        elem = mon->poll();
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("alarm.severity")->get()==pvd::noAlarm);
+        if(elem) mon->release(elem);
+
+        pv_x = 5;
+        pv->post();
+        elem = mon->poll();
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==5);
+        if(elem) mon->release(elem);
+
+        {
+            Guard G(creq->lock);
+            testEqual(creq->laststate, pva::Channel::CONNECTED);
+        }
+        testOk1(!mreq->unlistend);
+
+        mon->destroy();
+        chan->destroy();
+    }
+
+    void test_reconnect_retype()
+    {
+        testDiag("Check a type change on upstream reconnect closes the channel");
+
+        gateway->cache.reconnectHold = 60.0;
+
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeRequest(2)));
+        if(!mon) testAbort("Failed to create monitor");
+
+        testOk1(mon->start().isSuccess());
+        upstream->dispatch();
+        pva::MonitorElementPtr elem(mon->poll());
+        if(elem) mon->release(elem);
+
+        test1->disconnect();
+        testEqual(gateway->cache.reconnectHeld, 1u);
+
+        test1->reconnect(pvd::getFieldCreate()->createFieldBuilder()
+                         ->add("x", pvd::pvInt)
+                         ->add("y", pvd::pvInt)
+                         ->add("z", pvd::pvDouble)
+                         ->createStructure());
+
+        testEqual(gateway->cache.reconnectRetyped, 1u);
+        testOk1(!gateway->cache.find("test1"));
+        {
+            Guard G(client_req->lock);
+            testEqual(client_req->laststate, pva::Channel::DISCONNECTED);
+        }
+        testOk1(mreq->unlistend);
+
+        mon->destroy();
+    }
+
+    // returns # of distinct PVStructures queued to 'nmon' subscribers for 'nupdate' updates
+    size_t fanout_cost(bool shared, size_t nmon, size_t nupdate)
+    {
+        gateway->cache.sharedSnapshots = shared;
+
+        std::vector<TestChannelMonitorRequester::shared_pointer> reqs(nmon);
+        std::vector<pvd::Monitor::shared_pointer> mons(nmon);
+
+        for(size_t i=0; i<nmon; i++) {
+            reqs[i].reset(new TestChannelMonitorRequester);
+            mons[i] = client->createMonitor(reqs[i], makeRequest(nupdate));
+            if(!mons[i]) testAbort("Failed to create monitor");
+            mons[i]->start();
+        }
+        upstream->dispatch();
+
+        for(size_t i=0; i<nmon; i++) {
+            pva::MonitorElementPtr elem(mons[i]->poll());
+            if(elem) mons[i]->release(elem);
+        }
+
+        pvd::BitSet changed;
+        changed.set(1);
+
+        epicsTime start(epicsTime::getCurrent());
+        for(size_t n=0; n<nupdate; n++) {
+            test1_x = 100+n;
+            test1->post(changed);
+        }
+        double elapsed = epicsTime::getCurrent() - start;
+
+        std::set<pvd::PVStructure*> distinct;
+        for(size_t i=0; i<nmon; i++) {
+            pva::MonitorElementPtr elem;
+            while(!!(elem=mons[i]->poll())) {
+                distinct.insert(elem->pvStructurePtr.get());
+                mons[i]->release(elem);
+            }
+            mons[i]->destroy();
+        }
+
+        testDiag("%s: %lu subscribers %lu updates, %lu structures queued, %.3f ms",
+                 shared ? "shared" : "copy", (unsigned long)nmon, (unsigned long)nupdate,
+                 (unsigned long)distinct.size(), elapsed*1e3);
+        return distinct.size();
+    }
+
+    void test_fanout_cost()
+    {
+        testDiag("Compare copy and shared snapshot fanout");
+
+        testEqual(fanout_cost(false, 20, 4), 20u*4u);
+        testEqual(fanout_cost(true, 20, 4), 4u);
+    }
+
+    // wait until the FanoutPool worker is done with 'usr'
+    static void waitFanout(MonitorUser& usr)
+    {
+        while(true) {
+            {
+                Guard G(usr.mutex());
+                if(!usr.fanoutQueued)
+                    return;
+            }
+            epicsThreadSleep(0.001);
+        }
+    }
+
+    void test_fanout_worker()
+    {
+        testDiag("Check a FanoutPool worker holds each subscriber at most once");
+
+        gateway->cache.fanout = new FanoutPool(1);
+
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeRequest(2)));
+        MonitorUser::shared_pointer usr(std::tr1::dynamic_pointer_cast<MonitorUser>(mon));
+        if(!usr) testAbort("Failed to create monitor");
+
+        testOk1(mon->start().isSuccess());
+        upstream->dispatch();
+        waitFanout(*usr);
+
+        pvd::BitSet changed;
+        changed.set(1);
+        for(size_t n=0; n<10; n++) {
+            test1_x = 100+n;
+            test1->post(changed);
+        }
+        waitFanout(*usr);
+
+        {
+            FanoutPool::Worker& W = *gateway->cache.fanout->workers[0];
+            Guard G(W.lock);
+            testEqual(W.peak, 1u);
+        }
+
+        // updates not yet queued by the worker were merged, so the latest is kept
+        pvd::int32 last = 0;
+        pva::MonitorElementPtr elem;
+        while(!!(elem=mon->poll())) {
+            last = elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get();
+            mon->release(elem);
+        }
+        testEqual(last, 109);
+
+        testDiag("unlisten() after the update waiting for the worker");
+        test1_x = 200;
+        test1->post(changed);
+        usr->entry->unlisten(pvd::MonitorPtr());
+        {
+            Guard G(mreq->lock);
+            while(!mreq->unlistend) {
+                UnGuard U(G);
+                if(!mreq->wait.wait(5.0))
+                    break;
+            }
+            testOk1(mreq->unlistend);
+        }
+        elem = mon->poll();
+        testOk1(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==200);
+        if(elem)
+            mon->release(elem);
+
+        mon->destroy();
+    }
+
+    void test_flowcontrol()
+    {
+        testDiag("Check flowcontrol stops upstream poll() while all subscribers are full");
+
+        gateway->cache.flowControl = true;
+
+        TestChannelMonitorRequester::shared_pointer mreq[2];
+        pvd::Monitor::shared_pointer mon[2];
+        for(size_t i=0; i<2; i++) {
+            mreq[i].reset(new TestChannelMonitorRequester);
+            mon[i] = client->createMonitor(mreq[i], makeRequest(2));
+            if(!mon[i]) testAbort("Failed to create monitor");
+            testOk1(mon[i]->start().isSuccess());
+        }
+        upstream->dispatch(); // initial update fills one of two slots
+
+        MonitorCacheEntry::shared_pointer ment(std::tr1::dynamic_pointer_cast<MonitorUser>(mon[0])->entry);
+        TestPVMonitor::shared_pointer umon(upstreamMonitor(test1));
+        if(!umon) testAbort("No upstream subscription");
+
+        {
+            pvd::PVScalar::shared_pointer pipeline(umon->pvRequest->getSubField<pvd::PVScalar>("record._options.pipeline"));
+            testOk(pipeline && pipeline->getAs<std::string>()=="true", "upstream request has pipeline=true");
+        }
+
+        testDiag("fill both queues, then one more update is left upstream");
+        test1_x = 10;
+        test1->post();
+        test1_x = 11;
+        test1->post();
+
+        size_t nbuffered;
+        {
+            Guard G(test1->lock);
+            nbuffered = umon->buffer.size();
+        }
+        {
+            Guard G(ment->mutex());
+            testOk1(ment->paused);
+        }
+        testEqual(epicsAtomicGetSizeT(&ment->npauses), 2u);
+        testEqual(nbuffered, 1u);
+
+        testDiag("release() from one subscriber resumes upstream poll()");
+        {
+            pva::MonitorElementPtr elem(mon[0]->poll());
+            if(elem) mon[0]->release(elem);
+        }
+        {
+            Guard G(test1->lock);
+            nbuffered = umon->buffer.size();
+        }
+        testEqual(nbuffered, 0u);
+        testEqual(epicsAtomicGetSizeT(&ment->npauses), 3u); // full again
+
+        pvd::int32 last = 0;
+        pva::MonitorElementPtr elem;
+        while(!!(elem=mon[0]->poll())) {
+            last = elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get();
+            mon[0]->release(elem);
+        }
+        testEqual(last, 11);
+
+        for(size_t i=0; i<2; i++)
+            mon[i]->destroy();
+    }
+
+    struct FindResult : public pva::ChannelFindRequester
+    {
+        int nresults;
+        bool found;
+        FindResult() :nresults(0), found(false) {}
+        virtual ~FindResult() {}
+        virtual void channelFindResult(const pvd::Status& status, const pva::ChannelFind::shared_pointer& find, bool wasFound)
+        {
+            nresults++;
+            found = wasFound;
+        }
+    };
+
+    void test_search_limit()
+    {
+        testDiag("Check search rate limit skips cached names");
+
+        SearchLimit::shared_pointer limit(new SearchLimit(1.0, 1.0, 0.0, 0.0));
+        GWSearchLimiter::shared_pointer limiter(new GWSearchLimiter(gateway, limit));
+
+        // empty the bucket of the unknown source
+        testEqual(limit->take(""), SearchLimit::Allowed);
+
+        for(unsigned i=0; i<3; i++) {
+            std::tr1::shared_ptr<FindResult> req(new FindResult);
+            limiter->channelFind("test1", req);
+            testOk(req->nresults==1 && req->found, "cached name found %u", i);
+        }
+        testEqual(limiter->nthrottled, 0u);
+
+        {
+            std::tr1::shared_ptr<FindResult> req(new FindResult);
+            limiter->channelFind("nosuchchannel", req);
+            testOk1(req->nresults==1 && !req->found);
+        }
+        testEqual(limiter->nthrottled, 1u);
+        testEqual(limit->take("10.0.0.1"), SearchLimit::Allowed);
+        testEqual(limit->take("10.0.0.1"), SearchLimit::Throttled);
+
+        {
+            // the server asks each client provider with the same requester
+            GWSearchLimiter::shared_pointer other(new GWSearchLimiter(gateway, limit));
+            std::tr1::shared_ptr<FindResult> req(new FindResult);
+            other->channelFind("nosuchchannel", req);
+            limiter->channelFind("nosuchchannel", req);
+            testEqual(other->nthrottled, 1u);
+            testEqual(limiter->nthrottled, 2u);
+
+            SearchLimit once(1.0, 1.0, 0.0, 0.0);
+            std::tr1::shared_ptr<int> search(new int(0));
+            testEqual(once.take("10.0.0.1", search), SearchLimit::Allowed);
+            testEqual(once.take("10.0.0.1", search), SearchLimit::Allowed);
+            testEqual(once.take("10.0.0.1"), SearchLimit::Throttled);
+        }
+
+        // sources beyond maxSources share one bucket
+        SearchLimit few(1.0, 1.0, 0.0, 0.0);
+        few.maxSources = 1u;
+        testEqual(few.take("10.0.0.1"), SearchLimit::Allowed);
+        testEqual(few.take("10.0.0.2"), SearchLimit::Allowed);
+        testEqual(few.take("10.0.0.3"), SearchLimit::Throttled);
+        testEqual(few.nsources(), 1u);
+
+        SearchLimit total(0.0, 0.0, 1.0, 1.0);
+        testEqual(total.take("10.0.0.1"), SearchLimit::Allowed);
+        testEqual(total.take("10.0.0.2"), SearchLimit::Dropped);
+    }
+
+    // 'n' names which fall in the same ChannelCache shard
+    std::vector<std::string> sameShard(const std::string& prefix, size_t n)
+    {
+        std::map<ChannelCache::Shard*, std::vector<std::string> > byshard;
+        for(char a='a'; a<='z'; a++) {
+            for(char b='a'; b<='z'; b++) {
+                std::string name(prefix);
+                name += a;
+                name += b;
+                std::vector<std::string>& names = byshard[&gateway->cache.shardFor(name)];
+                names.push_back(name);
+                if(names.size()==n)
+                    return names;
+            }
+        }
+        testAbort("No %u names with prefix %s in one shard", (unsigned)n, prefix.c_str());
+        return std::vector<std::string>();
+    }
+
+    TestPV::shared_pointer addOffline(const std::string& name)
+    {
+        TestPV::shared_pointer ret(upstream->addPV(name, test1->dtype));
+        Guard G(ret->lock);
+        ret->offline = true;
+        return ret;
+    }
+
+    void test_async_create()
+    {
+        testDiag("Check a search queues upstream channel creation, and is answered when it connects");
+
+        ChannelCache& cache = gateway->cache;
+        TestPV::shared_pointer pv(addOffline("test2"));
+
+        std::tr1::shared_ptr<FindResult> req(new FindResult);
+        gateway->channelFind("test2", req);
+        testEqual(req->nresults, 0); // held
+
+        ChannelCacheEntry::shared_pointer ent(cache.find("test2"));
+        if(!ent) testAbort("No entry for \"test2\"");
+
+        // wait for the Creator
+        for(size_t i=0; i<5000 && !ent->upstream(); i++)
+            epicsThreadSleep(0.001);
+        pva::Channel::shared_pointer chan(ent->upstream());
+        testOk1(chan && chan->getConnectionState()==pva::Channel::NEVER_CONNECTED);
+        {
+            Guard G(cache.creator.lock);
+            testEqual(cache.creator.ncreated, 1u);
+        }
+
+        pv->reconnect();
+        testOk1(req->nresults==1 && req->found);
+        testEqual(epicsAtomicGetSizeT(&cache.deferReplies), 1u);
+
+        std::tr1::shared_ptr<FindResult> req2(new FindResult);
+        gateway->channelFind("test2", req2);
+        testOk1(req2->nresults==1 && req2->found);
+        {
+            Guard G(cache.creator.lock);
+            testEqual(cache.creator.ncreated, 1u); // not created again
+        }
+
+        testDiag("a search held while upstream creation fails is answered");
+        std::tr1::shared_ptr<FindResult> req3(new FindResult);
+        gateway->channelFind("nosuchchannel", req3);
+        for(size_t i=0; i<5000 && req3->nresults==0; i++)
+            epicsThreadSleep(0.001);
+        testOk1(req3->nresults==1 && !req3->found);
+        testOk1(!cache.find("nosuchchannel"));
+    }
+
+    void test_negative_cache()
+    {
+        testDiag("Check names which never connect are remembered as missing");
+
+        ChannelCache& cache = gateway->cache;
+        cache.negativeDelay = 0.0;
+        cache.negativeTTL = 0.5;
+        cache.negativeMax = ChannelCache::NShards; // one name per shard
+
+        std::vector<std::string> names(sameShard("missing", 2));
+        TestPV::shared_pointer pvs[2];
+        for(size_t i=0; i<2; i++) {
+            pvs[i] = addOffline(names[i]);
+
+            testOk1(!cache.lookup(names[i])); // creates the upstream channel
+            epicsThreadSleep(0.01);           // > negativeDelay
+            testOk1(!cache.lookup(names[i])); // gives up
+            testOk(!cache.find(names[i]), "%s dropped", names[i].c_str());
+        }
+
+        {
+            ChannelCache::Shard& shard = cache.shardFor(names[0]);
+            Guard G(shard.lock);
+            testOk(shard.negative.size()==1 && shard.negative.count(names[1])==1,
+                   "negativeMax forgets %s first", names[0].c_str());
+        }
+
+        std::tr1::shared_ptr<FindResult> req(new FindResult);
+        gateway->channelFind(names[1], req);
+        testOk1(req->nresults==1 && !req->found);
+        testEqual(epicsAtomicGetSizeT(&cache.negativeHits), 1u);
+        testOk1(!cache.find(names[1])); // no upstream search
+
+        testDiag("searched for again after negativeTTL");
+        epicsThreadSleep(0.6);
+        {
+            Guard G(pvs[1]->lock);
+            pvs[1]->offline = false;
+        }
+        testOk1(!!cache.lookup(names[1]));
+        testEqual(epicsAtomicGetSizeT(&cache.negativeHits), 1u);
+    }
+
+    void test_lru_evict()
+    {
+        testDiag("Check idle entries beyond cacheMax are evicted least recently used first");
+
+        ChannelCache& cache = gateway->cache;
+
+        std::vector<std::string> names(sameShard("lru", 4));
+        std::vector<TestPV::shared_pointer> pvs;
+        for(size_t i=0; i<names.size(); i++)
+            pvs.push_back(upstream->addPV(names[i], test1->dtype));
+
+        // names[0] is the oldest, but used by a downstream channel
+        TestChannelRequester::shared_pointer creq(new TestChannelRequester);
+        pva::Channel::shared_pointer chan(gateway->createChannel(names[0], creq));
+        if(!chan) testAbort("channel \"%s\" not connected", names[0].c_str());
+        for(size_t i=1; i<names.size(); i++)
+            cache.lookup(names[i]);
+        cache.lookup(names[1]); // most recent
+
+        // two per shard
+        cache.cacheMax = 2u*ChannelCache::NShards;
+        size_t runs = epicsAtomicGetSizeT(&cache.cleanerRuns);
+        for(size_t i=0; i<50 && epicsAtomicGetSizeT(&cache.cleanerRuns) < runs+2u; i++)
+            epicsThreadSleep(0.1);
+
+        testOk1(cache.find(names[0]) && cache.find(names[1]));
+        testOk1(!cache.find(names[2]) && !cache.find(names[3]));
+        testEqual(epicsAtomicGetSizeT(&cache.evictSize), 2u);
+
+        chan->destroy();
+    }
+
+    // put() one field of test1 through the gateway
+    void putField(const TestChannelPutRequester::shared_pointer& req, const char *fld, pvd::int32 val)
+    {
+        pvd::PVStructurePtr value(pvd::getPVDataCreate()->createPVStructure(req->fielddesc));
+        pvd::PVInt::shared_pointer field(value->getSubFieldT<pvd::PVInt>(fld));
+        field->put(val);
+        pvd::BitSet::shared_pointer changed(new pvd::BitSet);
+        changed->set(field->getFieldOffset());
+        req->put->put(value, changed);
+    }
+
+    void test_put_coalesce()
+    {
+        testDiag("Check puts merged while an upstream put is in progress");
+
+        TestChannelPutRequester::shared_pointer preq[3];
+        for(size_t i=0; i<3; i++) {
+            preq[i].reset(new TestChannelPutRequester);
+            client->createChannelPut(preq[i], makeCoalesceRequest());
+        }
+        testOk1(preq[0]->connected && preq[1]->connected && preq[2]->connected);
+        if(!preq[0]->put || !preq[1]->put || !preq[2]->put)
+            testAbort("Failed to create put");
+
+        pvd::PVInt::shared_pointer x(test1->value->getSubFieldT<pvd::PVInt>("x")),
+                      y(test1->value->getSubFieldT<pvd::PVInt>("y"));
+
+        putField(preq[0], "x", 10); // goes upstream now
+        putField(preq[1], "x", 11); // these two wait, and are merged
+        putField(preq[2], "y", 20);
+
+        testEqual(x->get(), 10);
+        testOk1(!preq[0]->donePut);
+
+        upstream->dispatch(); // completes first put, which sends the merged put
+
+        testOk1(preq[0]->donePut && preq[0]->statusPut.isSuccess());
+        testOk1(!preq[1]->donePut && !preq[2]->donePut);
+        testEqual(x->get(), 11);
+        testEqual(y->get(), 20);
+
+        upstream->dispatch();
+
+        testOk1(preq[1]->donePut && preq[2]->donePut);
+
+        ChannelCacheEntry::shared_pointer ent(gateway->cache.find("test1"));
+        testEqual(epicsAtomicGetSizeT(&ent->putUpstream), 2u);
+        testEqual(epicsAtomicGetSizeT(&ent->putCoalesced), 1u);
+
+        for(size_t i=0; i<3; i++)
+            preq[i]->put->destroy();
+    }
+
+    void test_op_pool()
+    {
+        testDiag("Check upstream get and put operations re-used");
+
+        ChannelCache& cache = gateway->cache;
+        cache.opRetain = 60.0;
+
+        // a new get operation for each get, as a script would
+        for(unsigned i=0; i<2; i++) {
+            TestChannelGetRequester::shared_pointer greq(new TestChannelGetRequester);
+            pva::ChannelGet::shared_pointer op(client->createChannelGet(greq, makeGetRequest()));
+            testOk(greq->connected && greq->statusConnect.isSuccess(), "get %u connected", i);
+            if(!op) testAbort("Failed to create get");
+            op->get();
+            testOk(greq->done && greq->statusDone.isSuccess(), "get %u done", i);
+            op->destroy();
+        }
+        testEqual(epicsAtomicGetSizeT(&cache.opReused), 1u);
+
+        // without coalescing, puts through a shared operation are sent one at a time
+        TestChannelPutRequester::shared_pointer preq[2];
+        for(size_t i=0; i<2; i++) {
+            preq[i].reset(new TestChannelPutRequester);
+            client->createChannelPut(preq[i], makeRequest(2));
+        }
+        testOk1(preq[0]->connected && preq[1]->connected);
+        if(!preq[0]->put || !preq[1]->put)
+            testAbort("Failed to create put");
+        testEqual(epicsAtomicGetSizeT(&cache.opReused), 2u);
+
+        pvd::PVInt::shared_pointer x(test1->value->getSubFieldT<pvd::PVInt>("x"));
+
+        putField(preq[0], "x", 10);
+        putField(preq[1], "x", 11); // queued
+
+        testEqual(x->get(), 10);
+
+        upstream->dispatch();
+
+        testOk1(preq[0]->donePut && !preq[1]->donePut);
+        testEqual(x->get(), 11);
+
+        upstream->dispatch();
+
+        testOk1(preq[1]->donePut);
+
+        ChannelCacheEntry::shared_pointer ent(cache.find("test1"));
+        testEqual(epicsAtomicGetSizeT(&ent->putUpstream), 2u);
+        testEqual(epicsAtomicGetSizeT(&ent->putCoalesced), 0u);
+
+        for(size_t i=0; i<2; i++)
+            preq[i]->put->destroy();
+    }
+
+    void test_get_cache()
+    {
+        testDiag("Check downstream gets coalesced, answered from a monitor, or passed through");
+
+        ChannelCache& cache = gateway->cache;
+        {
+            Guard G(test1->lock);
+            test1->deferGets = true;
+        }
+
+        TestChannelGetRequester::shared_pointer greq[2];
+        pva::ChannelGet::shared_pointer op[2];
+        for(size_t i=0; i<2; i++) {
+            greq[i].reset(new TestChannelGetRequester);
+            op[i] = client->createChannelGet(greq[i], makeGetRequest());
+            if(!op[i]) testAbort("Failed to create get");
+        }
+
+        testDiag("a get while another is in progress shares its result");
+        op[0]->get();
+        op[1]->get();
+        testEqual(test1->ngets, 1u);
+        testOk1(!greq[0]->done && !greq[1]->done);
+        testEqual(epicsAtomicGetSizeT(&cache.getUpstream), 1u);
+        testEqual(epicsAtomicGetSizeT(&cache.getCoalesced), 1u);
+
+        upstream->dispatch();
+
+        testOk1(greq[0]->done && greq[1]->done);
+        testOk1(greq[1]->value && greq[1]->value->getSubFieldT<pvd::PVInt>("x")->get()==1);
+
+        testDiag("passthrough, and other record options, always reach upstream");
+        const char *opts[2] = {"passthrough", "process"};
+        for(size_t i=0; i<2; i++) {
+            TestChannelGetRequester::shared_pointer preq(new TestChannelGetRequester);
+            pva::ChannelGet::shared_pointer pop(client->createChannelGet(preq, makeOptionRequest(opts[i], "true")));
+            if(!pop) testAbort("Failed to create get");
+            size_t before = test1->ngets;
+            pop->get();
+            upstream->dispatch();
+            testOk(preq->done && test1->ngets==before+1, "%s get reaches upstream", opts[i]);
+            pop->destroy();
+        }
+        testOk1(epicsAtomicGetSizeT(&cache.getUpstream)==1u && epicsAtomicGetSizeT(&cache.getCoalesced)==1u);
+
+        {
+            Guard G(test1->lock);
+            test1->deferGets = false;
+        }
+
+        testDiag("not answered from a monitor with record options");
+        {
+            TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+            pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeOptionRequest("DBE", "4")));
+            if(!mon) testAbort("Failed to create monitor");
+            testOk1(mon->start().isSuccess());
+            upstream->dispatch();
+
+            greq[0]->done = false;
+            size_t before = test1->ngets;
+            op[0]->get();
+            testOk1(greq[0]->done && test1->ngets==before+1);
+            mon->destroy();
+        }
+
+        testDiag("answered from a monitor without options");
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeRequest(2)));
+        if(!mon) testAbort("Failed to create monitor");
+        testOk1(mon->start().isSuccess());
+        upstream->dispatch();
+
+        test1_x = 5;
+        test1->post();
+
+        greq[0]->done = false;
+        size_t before = test1->ngets;
+        op[0]->get();
+        testOk1(greq[0]->done && test1->ngets==before);
+        testEqual(epicsAtomicGetSizeT(&cache.getMonitor), 1u);
+        testOk1(greq[0]->value && greq[0]->value->getSubFieldT<pvd::PVInt>("x")->get()==5);
+
+        mon->destroy();
+        for(size_t i=0; i<2; i++)
+            op[i]->destroy();
+    }
+
+    void test_contexts()
+    {
+        testDiag("Check assignment of channels to client contexts");
+
+        ChannelCache& cache = gateway->cache;
+        pva::ChannelProvider::shared_pointer extra[2] = {
+            pva::ChannelProvider::shared_pointer(new TestProvider()),
+            pva::ChannelProvider::shared_pointer(new TestProvider()),
+        };
+
+        testOk1(cache.providerFor("test1")==upstream);
+
+        // only used to pick a context, no channels are created
+        cache.contexts.push_back(extra[0]);
+
+        std::vector<size_t> two;
+        size_t counts[2] = {0u, 0u};
+        for(unsigned i=0; i<1000; i++) {
+            std::string name("chan"+toString(i));
+            const pva::ChannelProvider::shared_pointer& P = cache.providerFor(name);
+            two.push_back(P==upstream ? 0u : 1u);
+            counts[two.back()]++;
+        }
+        testOk(counts[0]>400 && counts[1]>400, "balanced %u %u", (unsigned)counts[0], (unsigned)counts[1]);
+
+        cache.contexts.push_back(extra[1]);
+
+        // names only move to the new context
+        size_t nmoved = 0u, nwrong = 0u;
+        for(unsigned i=0; i<1000; i++) {
+            std::string name("chan"+toString(i));
+            const pva::ChannelProvider::shared_pointer& P = cache.providerFor(name);
+            if(P==extra[1])
+                nmoved++;
+            else if(P!=cache.contexts[two[i]])
+                nwrong++;
+        }
+        testOk(nmoved>200 && nmoved<450, "moved %u", (unsigned)nmoved);
+        testEqual(nwrong, 0u);
+
+        cache.contexts.resize(1);
+    }
+
+    void test_array_slice()
+    {
+        testDiag("Check per-subscriber array slices sharing an upstream monitor");
+
+        TestPV::shared_pointer wave(upstream->addPV("wave", pvd::getFieldCreate()->createFieldBuilder()
+                                                    ->addArray("value", pvd::pvDouble)
+                                                    ->createStructure()));
+        pvd::PVDoubleArray::shared_pointer wave_value(wave->value->getSubFieldT<pvd::PVDoubleArray>("value"));
+        {
+            pvd::PVDoubleArray::svector arr(10);
+            for(size_t i=0; i<arr.size(); i++)
+                arr[i] = i;
+            wave_value->replace(pvd::freeze(arr));
+        }
+
+        TestChannelRequester::shared_pointer wreq(new TestChannelRequester);
+        pva::Channel::shared_pointer wchan(gateway->createChannel("wave", wreq));
+        if(!wchan) testAbort("channel \"wave\" not connected");
+
+        TestChannelMonitorRequester::shared_pointer mreq[4];
+        pvd::Monitor::shared_pointer mon[4];
+        for(size_t i=0; i<4; i++)
+            mreq[i].reset(new TestChannelMonitorRequester);
+        mon[0] = wchan->createMonitor(mreq[0], makeRequest(2));
+        mon[1] = wchan->createMonitor(mreq[1], makeSliceRequest(2, 2, 5, 2));
+        mon[2] = wchan->createMonitor(mreq[2], makeSliceRequest(3, 2, 5, 2));
+        mon[3] = wchan->createMonitor(mreq[3], makeSliceRequest(2, 7, 0, 1));
+        for(size_t i=0; i<4; i++)
+            if(!mon[i]) testAbort("Failed to create monitor %u", (unsigned)i);
+
+        testEqual(gateway->cache.monSliced, 3u);
+        ChannelCacheEntry::shared_pointer ent(gateway->cache.find("wave"));
+        testEqual(ent ? ent->mon_entries.size() : 0u, 1u);
+
+        for(size_t i=0; i<4; i++)
+            testOk1(mon[i]->start().isSuccess());
+        upstream->dispatch();
+
+        pvd::MonitorElementPtr elem[4];
+        for(size_t i=0; i<4; i++)
+            elem[i] = mon[i]->poll();
+
+        testEqual(arrayString(elem[0]), "[0,1,2,3,4,5,6,7,8,9]");
+        testEqual(arrayString(elem[1]), "[2,4,6]");
+        testEqual(arrayString(elem[2]), "[2,4,6]");
+        testEqual(arrayString(elem[3]), "[7,8,9]");
+
+        if(elem[0] && elem[1] && elem[2] && elem[3]) {
+            pvd::PVDoubleArray::const_svector full(elem[0]->pvStructurePtr->getSubFieldT<pvd::PVDoubleArray>("value")->view()),
+                                              dec1(elem[1]->pvStructurePtr->getSubFieldT<pvd::PVDoubleArray>("value")->view()),
+                                              dec2(elem[2]->pvStructurePtr->getSubFieldT<pvd::PVDoubleArray>("value")->view()),
+                                              tail(elem[3]->pvStructurePtr->getSubFieldT<pvd::PVDoubleArray>("value")->view());
+            testOk(dec1.data()==dec2.data(), "equal slices share one copy");
+            testOk(tail.data()==full.data()+7, "slice without stride references upstream array");
+        } else {
+            testFail("no update");
+            testFail("no update");
+        }
+        for(size_t i=0; i<4; i++)
+            if(elem[i]) mon[i]->release(elem[i]);
+
+        testDiag("update the array");
+        {
+            pvd::PVDoubleArray::svector arr(10);
+            for(size_t i=0; i<arr.size(); i++)
+                arr[i] = 10+i;
+            wave_value->replace(pvd::freeze(arr));
+        }
+        wave->post();
+
+        for(size_t i=0; i<4; i++)
+            elem[i] = mon[i]->poll();
+        testEqual(arrayString(elem[1]), "[12,14,16]");
+        testEqual(arrayString(elem[2]), "[12,14,16]");
+        testEqual(arrayString(elem[3]), "[17,18,19]");
+        for(size_t i=0; i<4; i++)
+            if(elem[i]) mon[i]->release(elem[i]);
+
+        testDiag("shared results dropped with the last subscriber of a slice");
+        MonitorCacheEntry::shared_pointer ment;
+        if(ent) {
+            ChannelCacheEntry::mon_entries_t::lock_vector_type ments(ent->mon_entries.lock_vector());
+            if(!ments.empty())
+                ment = ments.front().second;
+        }
+        for(size_t i=0; i<4; i++) {
+            mon[i]->destroy();
+            mon[i].reset();
+        }
+        if(ment) {
+            Guard G(ment->mutex());
+            testEqual(ment->slices.size(), 0u);
+        } else {
+            testFail("no monitor entry");
+        }
+        ment.reset();
+
+        wchan->destroy();
+    }
 };
 
 } // namespace
 
 MAIN(testmon)
 {
-    testPlan(79);
+    testPlan(299);
     TEST_METHOD(TestMonitor, test_event);
     TEST_METHOD(TestMonitor, test_share);
     TEST_METHOD(TestMonitor, test_ds_no_start);
     TEST_METHOD(TestMonitor, test_overflow_upstream);
     TEST_METHOD(TestMonitor, test_overflow_downstream);
+    TEST_METHOD(TestMonitor, test_shared_snapshot);
+    TEST_METHOD(TestMonitor, test_fanout_cost);
+    TEST_METHOD(TestMonitor, test_fanout_worker);
+    TEST_METHOD(TestMonitor, test_flowcontrol);
+    TEST_METHOD(TestMonitor, test_max_rate);
+    TEST_METHOD(TestMonitor, test_latency);
+    TEST_METHOD(TestMonitor, test_release_order);
+    TEST_METHOD(TestMonitor, test_pool);
+    TEST_METHOD(TestMonitor, test_projection);
+    TEST_METHOD(TestMonitor, test_retain);
+    TEST_METHOD(TestMonitor, test_reconnect_hold);
+    TEST_METHOD(TestMonitor, test_reconnect_resume);
+    TEST_METHOD(TestMonitor, test_reconnect_retype);
+    TEST_METHOD(TestMonitor, test_search_limit);
+    TEST_METHOD(TestMonitor, test_async_create);
+    TEST_METHOD(TestMonitor, test_negative_cache);
+    TEST_METHOD(TestMonitor, test_lru_evict);
+    TEST_METHOD(TestMonitor, test_contexts);
+    TEST_METHOD(TestMonitor, test_put_coalesce);
+    TEST_METHOD(TestMonitor, test_op_pool);
+    TEST_METHOD(TestMonitor, test_get_cache);
+    TEST_METHOD(TestMonitor, test_array_slice);
     TestProvider::testCounts();
     int ok = 1;
     size_t temp;
@@ -359,6 +1773,8 @@ MAIN(testmon)
     TESTC(ChannelCacheEntry);
     TESTC(MonitorCacheEntry);
     TESTC(MonitorUser);
+    TESTC(PutCacheEntry);
+    TESTC(PutUser);
 #undef TESTC
     testOk(ok, "All instances free'd");
     return testDone();